@@ -0,0 +1,161 @@
+/***************************************************************************
+| File: bulk.c
+|
+| Device side of the bulk transfers (compiled into the PIC firmware and the
+| simulator): the chunks of registers sent and not acknowledged, and the
+| replies to BTRC and BACK.
+----------------------------------------------------------------------------*/
+#include "protocol.h"
+#include "bulk.h"
+
+static int bulk_window = 0; //chunks of the bulk transfer that can be sent and not acknowledged (0 - no bulk transfer)
+static int bulk_acked = 0; //sequence number of the last chunk acknowledged
+static int bulk_seq = 0; //sequence number of the next chunk
+static int bulk_last = 0; //sequence number after the last chunk sent (bulk_seq is before it while chunks are sent again)
+static int bulk_sent = 0; //registers from iread sent in the chunks not acknowledged
+static unsigned char bulk_size[BULK_WINDOW]; //registers of the chunks not acknowledged (chunk s in s % BULK_WINDOW)
+
+//end the bulk transfer before all the registers are sent: the host starts another one from the sequence number it
+//expects, so no sequence number is used again for other registers
+static void bulk_end(void)
+{
+    bulk_window = 0;
+    send_status(BTRC, CMD_ERROR);
+}
+
+//send the chunks of the bulk transfer that fit in the window, with the registers from iread not sent yet (up to
+//BULK_CHUNK in each chunk); a chunk without registers, once all of them are sent and acknowledged, ends the transfer
+//a chunk sent again keeps its registers, less those overwritten since (the transfer ends if none is left; the copies
+//sent before all arrive before the BTRC error, so the host takes none of them for the new chunk with that number)
+static void bulk_fill(void)
+{
+    int i, n;
+    while(bulk_window > 0 && (bulk_seq - bulk_acked - 1 + BULK_SEQ) % BULK_SEQ < bulk_window)
+    {
+        if(bulk_seq != bulk_last)
+        {
+            n = bulk_size[bulk_seq % BULK_WINDOW];
+            if(n == 0) //all its registers were overwritten: the next transfer goes on from iread with new chunks
+            {
+                bulk_last = bulk_seq;
+                bulk_end();
+                return;
+            }
+        }
+        else
+        {
+            n = bulk_pending() - bulk_sent;
+            if(n > BULK_CHUNK)
+                n = BULK_CHUNK;
+            if(n == 0 && bulk_sent > 0) //the end waits for the acknowledgments
+                return;
+        }
+        send_begin(BCHK, 2 + 5*n);
+        send_byte((unsigned char)bulk_seq);
+        for(i = 0; i < n; i++)
+            bulk_send_register(bulk_sent + i);
+        send_end();
+        if(n == 0)
+        {
+            bulk_window = 0;
+            return;
+        }
+        if(bulk_seq == bulk_last)
+        {
+            bulk_size[bulk_seq % BULK_WINDOW] = (unsigned char)n;
+            bulk_last = (bulk_last + 1) % BULK_SEQ;
+        }
+        bulk_sent += n;
+        bulk_seq = (bulk_seq + 1) % BULK_SEQ;
+    }
+}
+
+//the chunks up to sequence number s are acknowledged: iread goes past their registers (old or duplicate
+//acknowledgments, of chunks not sent or already acknowledged, are ignored)
+static void bulk_acknowledge(int s)
+{
+    int k = (s - bulk_acked + BULK_SEQ) % BULK_SEQ; //chunks acknowledged
+    int n = 0;
+    if(k == 0 || k > (bulk_last - bulk_acked - 1 + BULK_SEQ) % BULK_SEQ)
+        return;
+    for(; k > 0; k--)
+    {
+        bulk_acked = (bulk_acked + 1) % BULK_SEQ;
+        n += bulk_size[bulk_acked % BULK_WINDOW];
+    }
+    //the chunks being sent again from bulk_seq that are acknowledged are not sent again
+    if((bulk_seq - bulk_acked - 1 + BULK_SEQ) % BULK_SEQ > (bulk_last - bulk_acked - 1 + BULK_SEQ) % BULK_SEQ)
+    {
+        bulk_seq = (bulk_acked + 1) % BULK_SEQ;
+        bulk_sent = 0;
+    }
+    else
+        bulk_sent -= n;
+    bulk_transferred(n);
+}
+
+//start a bulk transfer with a window of chunks, from sequence number s (BTRC)
+//s is the chunk the host expects, so the sequence numbers go on across the transfers: the chunks before s are
+//acknowledged, and those from s not acknowledged are sent again with the same registers, so a copy still on the way
+//from a transfer before is the same chunk; any other s (the device was reset) starts from iread
+void bulk_start(int window, int s)
+{
+    if(window < 1 || window > BULK_WINDOW || s >= BULK_SEQ)
+    {
+        send_status(BTRC, CMD_ERROR);
+        return;
+    }
+    bulk_acknowledge((s - 1 + BULK_SEQ) % BULK_SEQ);
+    if(bulk_acked != (s - 1 + BULK_SEQ) % BULK_SEQ)
+    {
+        bulk_acked = (s - 1 + BULK_SEQ) % BULK_SEQ;
+        bulk_last = s;
+    }
+    bulk_window = window;
+    bulk_seq = s;
+    bulk_sent = 0;
+    bulk_fill();
+}
+
+//iread moved without the bulk transfer (PTRC, TRGC or TRGI): the chunks not acknowledged are not sent again, as their
+//registers are no longer from iread, and a bulk transfer going on ends
+void bulk_moved(void)
+{
+    bulk_acked = (bulk_last - 1 + BULK_SEQ) % BULK_SEQ;
+    bulk_seq = bulk_last;
+    bulk_sent = 0;
+    if(bulk_window > 0)
+        bulk_end();
+}
+
+//the register at iread, sent in a chunk not acknowledged, was overwritten: that chunk starts one register later
+void bulk_overwritten(void)
+{
+    int s = (bulk_acked + 1) % BULK_SEQ;
+    while(s != bulk_last && bulk_size[s % BULK_WINDOW] == 0)
+        s = (s + 1) % BULK_SEQ;
+    if(s == bulk_last) //no register sent and not acknowledged
+        return;
+    bulk_size[s % BULK_WINDOW]--;
+    if((s - bulk_acked - 1 + BULK_SEQ) % BULK_SEQ < (bulk_seq - bulk_acked - 1 + BULK_SEQ) % BULK_SEQ) //sent again
+        bulk_sent--;
+}
+
+//the host acknowledged the chunks of the bulk transfer up to sequence number s (BACK): their registers are
+//transferred (iread only moves now, so a lost chunk loses nothing), and the next chunks fit in the window
+//without a bulk transfer (the chunk that ended it was lost) the host is told to start another one
+void bulk_ack(int s, int resend)
+{
+    if(bulk_window == 0 || s >= BULK_SEQ)
+    {
+        send_status(BTRC, CMD_ERROR);
+        return;
+    }
+    bulk_acknowledge(s);
+    if(resend) //the chunks not acknowledged are sent again
+    {
+        bulk_seq = (bulk_acked + 1) % BULK_SEQ;
+        bulk_sent = 0;
+    }
+    bulk_fill();
+}
@@ -0,0 +1,27 @@
+/***************************************************************************
+| File: bulk.h
+|
+| Device side of the bulk transfers (BTRC, BCHK and BACK, see protocol.h),
+| shared by the PIC firmware (weather_station.X/main.c) and the simulator
+| (pic_simulator.c). Each of them supplies the primitives that send the
+| messages and that read and free the registers of its ring buffer; bulk.c
+| keeps the window of chunks not acknowledged.
+----------------------------------------------------------------------------*/
+#ifndef BULK_H
+#define BULK_H
+
+/* supplied by the firmware or the simulator */
+void send_begin(unsigned char opcode, unsigned char length); /* SOM, length (protocol v2) and opcode */
+void send_byte(unsigned char b); /* one byte of a message, escaped in protocol v2 */
+void send_end(void); /* EOM */
+void send_status(unsigned char opcode, unsigned char status); /* message with only CMD_OK or CMD_ERROR */
+int bulk_pending(void); /* registers not transferred (from iread) */
+void bulk_send_register(int i); /* send the register i places after iread */
+void bulk_transferred(int n); /* the n registers from iread are transferred: iread goes past them */
+
+void bulk_start(int window, int s);
+void bulk_ack(int s, int resend);
+void bulk_moved(void);
+void bulk_overwritten(void);
+
+#endif
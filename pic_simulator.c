@@ -0,0 +1,816 @@
+/***************************************************************************
+| File: pic_simulator.c
+|
+| Simulator of the weather station PIC (weather_station.X/main.c) for Linux.
+| The station is exposed on a pseudo-terminal, so the eCos program (or any
+| other program) can be pointed at it instead of the serial line to the board.
+|
+| The EEPROM ring buffer (write_register, read_register, compare_and_save),
+| the parameters and every opcode of process_message follow the firmware,
+| in both protocol versions, and the bulk transfers are the bulk.c of the
+| firmware. The sensors are replaced by a generator of registers at a
+| configurable rate, the EUSART by the pty with an optional baud rate delay
+| and the line errors can be injected on purpose.
+|
+| Build:   cc -O2 -o pic_simulator pic_simulator.c protocol.c bulk.c
+| Usage:   pic_simulator [-n NREG] [-r registers/s] [-b baud] [-c corrupt] [-d drop] [-s seed] [-f eeprom] [-v]
+----------------------------------------------------------------------------*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include "protocol.h"
+#include "bulk.h"
+
+typedef unsigned char byte;
+
+#define MAGICAL_WORD_OFFSET 0x0000
+#define NREG_OFFSET 0x0001
+#define PMON_OFFSET 0x0002
+#define TALA_OFFSET 0x0003
+#define ALAT_OFFSET 0x0004
+#define ALAL_OFFSET 0x0005
+#define ALAF_OFFSET 0x0006
+#define CLKH_OFFSET 0x0007
+#define CLKM_OFFSET 0x0008
+#define CHECK_SUM_OFFSET 0x0009
+
+#define RING_BUFFER_INITR 0x000A //memory position for read index of ring buffer
+#define RING_BUFFER_INITW 0x000B //memory position for write index of ring buffer
+#define RING_BUFFER_NR    0x000C  //memory position for number of valid registers in buffer
+#define RING_BUFFER_iread 0x000D  //next to be transfered (not yet tranfered) register
+#define RING_BUFFER_memory 0x000E //# of registers not yet transfered
+#define RING_BUFFER_OFFSET 0x000F //ring buffer
+
+#define MAX_NREG 255 /* NREG, iread and iwrite are sent in one byte */
+#define EEPROM_SIZE (RING_BUFFER_OFFSET + 5*MAX_NREG) /* the board has 256 bytes, the simulator enough for MAX_NREG */
+
+#define MAGICAL_WORD 0xAA
+
+#define TX_BUFFER_SIZE 1024 /* bytes of one message, escaped in the worst case */
+
+byte eeprom[EEPROM_SIZE]; //simulated EEPROM (DATAEE)
+char* eeprom_file = NULL; //file where the EEPROM is kept between runs (NULL - erased on every run)
+
+byte message_received[10];
+bool receiving_message = false;
+int index_message_received = 0;
+int message_protocol = 0; //protocol version of the message being received (0 while unknown)
+int message_length = 0; //length announced by a protocol v2 message
+bool escape = false; //previous byte received was ESC
+int protocol = 1; //protocol version of the last message received, used for replies and notifications
+
+int NREG = 30; //number of data registers
+int PMON = 5; //sec monitoring period
+int TALA = 3; //sec duration of alarm signal (PWM)
+int ALAT = 25; //oC threshold for temperature alarm
+int ALAL = 2; //threshold for luminosity level alarm
+int ALAF = 0; //alarm flag ? initially disabled
+int CLKH = 0; //initial value for clock hours
+int CLKM = 0; //initial value for clock minutes
+int CLKS = 0; //initial value for clock seconds
+
+int currentLum = 0;
+int currentTemp = 0;
+
+//initialize write index with one more unit than read index
+int write_index = 1;
+int read_index = 0;
+int nr=0;
+int iread=1;  //next to be transfered (not yet tranfered)
+int memory =0;  //# of registers not yet transfered
+
+double rate = 0; //registers generated per second (0 - every PMON seconds, as the board)
+int baud = 0; //baud rate of the simulated line (0 - no delay)
+double corrupt = 0; //probability of one transmitted byte being corrupted
+double drop = 0; //probability of one transmitted byte being lost
+int verbose = 0; //print statistics every second
+
+int master = -1; //master side of the pseudo-terminal
+byte tx_buffer[TX_BUFFER_SIZE]; //message being sent
+int tx_length = 0;
+unsigned long samples = 0; //registers generated
+unsigned long saved = 0; //registers written to the ring buffer
+unsigned long overwritten = 0; //registers overwritten before they were transferred
+unsigned long received = 0; //messages processed
+unsigned long rejected = 0; //messages with a wrong length (protocol v2)
+unsigned long sent_bytes = 0; //bytes sent (before the errors)
+unsigned long corrupted = 0; //bytes corrupted
+unsigned long dropped = 0; //bytes lost
+volatile sig_atomic_t running = 1;
+
+//structure used for creating an entry for the buffer to save in the registers
+typedef struct buffer_entry
+{
+    byte hour;
+    byte minute;
+    byte seconds;
+    byte temperature;
+    byte lum;
+} buffer_entry;
+
+byte DATAEE_ReadByte(int address)
+{
+    return eeprom[address];
+}
+
+void DATAEE_WriteByte(int address, byte value)
+{
+    eeprom[address] = value;
+}
+
+//random number in [0, 1)
+double random_unit(void)
+{
+    return rand() / (RAND_MAX + 1.0);
+}
+
+//send the message in tx_buffer to the pty, with the injected errors and the time the line takes at the baud rate
+void flush_message(void)
+{
+    struct timespec t;
+    int i, n = 0;
+    byte b;
+    for(i = 0; i < tx_length; i++)
+    {
+        b = tx_buffer[i];
+        if(drop > 0 && random_unit() < drop)
+        {
+            dropped++;
+            continue;
+        }
+        if(corrupt > 0 && random_unit() < corrupt)
+        {
+            b ^= 1 << (rand() % 8);
+            corrupted++;
+        }
+        tx_buffer[n++] = b;
+    }
+    sent_bytes += tx_length;
+    for(i = 0; i < n; )
+    {
+        int w = write(master, tx_buffer + i, n - i);
+        if(w <= 0)
+            break;
+        i += w;
+    }
+    if(baud > 0) //10 bits per byte (start, 8 data bits, stop)
+    {
+        double seconds = tx_length * 10.0 / baud;
+        t.tv_sec = (time_t)seconds;
+        t.tv_nsec = (long)((seconds - t.tv_sec) * 1e9);
+        nanosleep(&t, NULL);
+    }
+    tx_length = 0;
+}
+
+void EUSART_Write(byte b)
+{
+    if(tx_length < TX_BUFFER_SIZE)
+        tx_buffer[tx_length++] = b;
+}
+
+//send one byte of a message, escaping SOM, EOM and ESC in protocol v2
+void send_byte(byte b)
+{
+    if(protocol == 2 && (b == SOM || b == EOM || b == ESC))
+    {
+        EUSART_Write(ESC);
+        EUSART_Write(b ^ ESC_XOR);
+    }
+    else
+        EUSART_Write(b);
+}
+
+//start sending a message: SOM, length of opcode and arguments (only in protocol v2) and opcode
+void send_begin(byte opcode, byte length)
+{
+    EUSART_Write(SOM);
+    if(protocol == 2)
+        EUSART_Write(length);
+    send_byte(opcode);
+}
+
+//finish sending a message
+void send_end(void)
+{
+    EUSART_Write(EOM);
+    flush_message();
+}
+
+//send a message with only the status of a command (CMD_OK or CMD_ERROR)
+void send_status(byte opcode, byte status)
+{
+    send_begin(opcode, 2);
+    send_byte(status);
+    send_end();
+}
+
+//send one register of the ring buffer
+void send_register(buffer_entry registo)
+{
+    send_byte(registo.hour);
+    send_byte(registo.minute);
+    send_byte(registo.seconds);
+    send_byte(registo.temperature);
+    send_byte(registo.lum);
+}
+
+//function used to calculate check sum using only the relevant fields saved to memory
+byte calculate_check_sum()
+{
+    return (byte)
+    (DATAEE_ReadByte(MAGICAL_WORD_OFFSET) +
+    DATAEE_ReadByte(NREG_OFFSET)+
+    DATAEE_ReadByte(PMON_OFFSET)+
+    DATAEE_ReadByte(TALA_OFFSET)+
+    DATAEE_ReadByte(ALAT_OFFSET)+
+    DATAEE_ReadByte(ALAL_OFFSET)+
+    DATAEE_ReadByte(ALAF_OFFSET)+
+    DATAEE_ReadByte(CLKH_OFFSET)+
+    DATAEE_ReadByte(CLKM_OFFSET));
+}
+
+//auxiliary funtion to write one buffer entry to memory
+void write_register(buffer_entry entry)
+{
+    DATAEE_WriteByte(RING_BUFFER_OFFSET+write_index*5,entry.hour);
+    DATAEE_WriteByte(RING_BUFFER_OFFSET+write_index*5+1,entry.minute);
+    DATAEE_WriteByte(RING_BUFFER_OFFSET+write_index*5+2,entry.seconds);
+    DATAEE_WriteByte(RING_BUFFER_OFFSET+write_index*5+3,entry.temperature);
+    DATAEE_WriteByte(RING_BUFFER_OFFSET+write_index*5+4,entry.lum);
+
+    //when a new regiter is written increments memory
+    if (memory < NREG)
+    {
+        memory++;
+        // when memory half full sends a notification
+        if (memory == NREG/2)
+        {
+            send_begin(NMFL, 1);
+            send_end();
+        }
+        DATAEE_WriteByte(RING_BUFFER_memory, (byte)memory);
+    }
+    else
+    {
+        bulk_overwritten();
+        overwritten++;
+    }
+
+    write_index++;
+    if(write_index>=NREG)
+        write_index=0;
+
+    //in case the oldest transfered register is written
+    if(memory == NREG)
+    {
+        iread = write_index;
+        DATAEE_WriteByte(RING_BUFFER_iread, (byte)iread);
+    }
+    if(nr < NREG)
+        nr++;
+
+    DATAEE_WriteByte(RING_BUFFER_NR, nr);
+    DATAEE_WriteByte(RING_BUFFER_INITW, write_index);
+    saved++;
+}
+
+//auxiliary funtion to read one buffer entry from memory
+buffer_entry read_register(int position)
+{
+    buffer_entry entry;
+    entry.hour=DATAEE_ReadByte(RING_BUFFER_OFFSET+position*5);
+    entry.minute=DATAEE_ReadByte(RING_BUFFER_OFFSET+position*5+1);
+    entry.seconds=DATAEE_ReadByte(RING_BUFFER_OFFSET+position*5+2);
+    entry.temperature=DATAEE_ReadByte(RING_BUFFER_OFFSET+position*5+3);
+    entry.lum=DATAEE_ReadByte(RING_BUFFER_OFFSET+position*5+4);
+    return entry;
+}
+
+//registers not transferred, for the bulk transfers (bulk.c)
+int bulk_pending(void)
+{
+    return memory;
+}
+
+//send the register i places after iread, for the bulk transfers (bulk.c)
+void bulk_send_register(int i)
+{
+    send_register(read_register((iread + i) % NREG));
+}
+
+//the n registers from iread were acknowledged in a bulk transfer (bulk.c)
+void bulk_transferred(int n)
+{
+    iread = (iread + n) % NREG;
+    memory -= n;
+    DATAEE_WriteByte(RING_BUFFER_memory, (byte)memory);
+    DATAEE_WriteByte(RING_BUFFER_iread, (byte)iread);
+}
+
+//the new entry is saved if there is a change in the luminosity or temperature of the previous entry
+void compare_and_save(buffer_entry new_entry)
+{
+    buffer_entry previous_entry = read_register(read_index);
+    if(previous_entry.temperature!=new_entry.temperature||previous_entry.lum!=new_entry.lum)
+    {
+        write_register(new_entry);
+        read_index++;
+        if(read_index==NREG)
+            read_index=0;
+        DATAEE_WriteByte(RING_BUFFER_INITR, read_index);
+    }
+}
+
+//the sensors are replaced by a slow temperature wave and a luminosity level that changes every 16 samples,
+//so consecutive samples are always different and every sample is saved
+void sample(void)
+{
+    buffer_entry new_entry;
+    new_entry.temperature = 15 + samples % 16;
+    new_entry.lum = (samples / 16) % 4;
+    currentTemp = new_entry.temperature;
+    currentLum = new_entry.lum;
+    new_entry.seconds=CLKS;
+    new_entry.hour=CLKH;
+    new_entry.minute=CLKM;
+    if((new_entry.temperature > ALAT || new_entry.lum > ALAL) && ALAF == 0)
+    {
+        ALAF = 1;
+        DATAEE_WriteByte(ALAF_OFFSET,(byte) ALAF);
+        DATAEE_WriteByte(CHECK_SUM_OFFSET, calculate_check_sum());
+    }
+    samples++;
+    compare_and_save(new_entry);
+}
+
+//one second of the clock of the board
+void processTime()
+{
+    CLKS++;
+    if(CLKS == 60) //a minute has passed
+    {
+        CLKS = 0;
+        CLKM++;
+        if(CLKM == 60) //an hour has passed
+        {
+            CLKH++;
+            CLKM = 0;
+            if(CLKH == 24) //24 hours have passed
+                CLKH = 0;
+            DATAEE_WriteByte(CLKH_OFFSET,(byte) CLKH);
+        }
+        DATAEE_WriteByte(CLKM_OFFSET, (byte) CLKM);
+        DATAEE_WriteByte(CHECK_SUM_OFFSET, calculate_check_sum());
+    }
+    //without a rate, read the sensors every PMON seconds as the board
+    if(rate == 0 && PMON!=0 && CLKS%PMON==0)
+        sample();
+}
+
+//the parameters and time from memory, or the defaults if the memory is not valid
+void MemoryInitialize()
+{
+    byte magicalWord = DATAEE_ReadByte(MAGICAL_WORD_OFFSET);
+    byte checkSum=calculate_check_sum();
+    byte checkSum_mem =(byte)DATAEE_ReadByte(CHECK_SUM_OFFSET);
+
+    //a different NREG on the command line also discards the memory
+    if (magicalWord != MAGICAL_WORD || checkSum_mem != checkSum || DATAEE_ReadByte(NREG_OFFSET) != NREG)
+    {
+        DATAEE_WriteByte(MAGICAL_WORD_OFFSET, MAGICAL_WORD);
+        DATAEE_WriteByte(NREG_OFFSET, (byte)NREG);
+        DATAEE_WriteByte(PMON_OFFSET, (byte)PMON);
+        DATAEE_WriteByte(TALA_OFFSET, (byte)TALA);
+        DATAEE_WriteByte(ALAT_OFFSET, (byte)ALAT);
+        DATAEE_WriteByte(ALAL_OFFSET, (byte)ALAL);
+        DATAEE_WriteByte(ALAF_OFFSET,(byte) ALAF);
+        DATAEE_WriteByte(CLKH_OFFSET,(byte) CLKH);
+        DATAEE_WriteByte(CLKM_OFFSET, (byte)CLKM);
+        DATAEE_WriteByte(CHECK_SUM_OFFSET, calculate_check_sum());
+        DATAEE_WriteByte(RING_BUFFER_INITW,(byte) write_index);
+        DATAEE_WriteByte(RING_BUFFER_INITR,(byte) read_index);
+        DATAEE_WriteByte(RING_BUFFER_NR, (byte)nr);
+        DATAEE_WriteByte(RING_BUFFER_iread, (byte)iread);
+        DATAEE_WriteByte(RING_BUFFER_memory, (byte)memory);
+    }
+    else
+    {
+        PMON=DATAEE_ReadByte(PMON_OFFSET);
+        TALA=DATAEE_ReadByte(TALA_OFFSET);
+        ALAT=DATAEE_ReadByte(ALAT_OFFSET);
+        ALAL=DATAEE_ReadByte(ALAL_OFFSET);
+        ALAF=DATAEE_ReadByte(ALAF_OFFSET);
+        CLKH=DATAEE_ReadByte(CLKH_OFFSET);
+        CLKM=DATAEE_ReadByte(CLKM_OFFSET);
+        read_index=DATAEE_ReadByte(RING_BUFFER_INITR);
+        write_index=DATAEE_ReadByte(RING_BUFFER_INITW);
+        nr=DATAEE_ReadByte(RING_BUFFER_NR);
+        iread=DATAEE_ReadByte(RING_BUFFER_iread);
+        memory=DATAEE_ReadByte(RING_BUFFER_memory);
+    }
+}
+
+//function that proccess the content of messages received (same as the firmware)
+void process_message(int size_message)
+{
+    buffer_entry registo;
+    int i=0;
+    int n=0;
+    int aux_read_index=0;
+    //only the commands of the device are executed, and those with a number of arguments that the protocol table does
+    //not allow are answered with an error (PTRC by TRCACK, BACK by BTRC)
+    if(protocol_where(message_received[0]) != PROTOCOL_DEVICE)
+        return;
+    if(!protocol_valid(message_received[0], size_message - 1, false))
+    {
+        send_status(message_received[0] == PTRC ? TRCACK : message_received[0] == BACK ? BTRC : message_received[0], CMD_ERROR);
+        return;
+    }
+    switch(message_received[0])
+    {
+        case RCLK:
+            send_begin(RCLK, 4);
+            send_byte((byte)CLKH);
+            send_byte((byte)CLKM);
+            send_byte((byte)CLKS);
+            send_end();
+            break;
+        case SCLK:
+            if (message_received[1] > 23 || message_received[2] > 59 || message_received[3] > 59)
+                send_status(SCLK, CMD_ERROR);
+            else
+            {
+                CLKH = message_received[1];
+                DATAEE_WriteByte(CLKH_OFFSET,(byte) CLKH);
+                CLKM = message_received[2];
+                DATAEE_WriteByte(CLKM_OFFSET, (byte)CLKM);
+                DATAEE_WriteByte(CHECK_SUM_OFFSET, calculate_check_sum());
+                CLKS = message_received[3];
+                send_status(SCLK, CMD_OK);
+            }
+            break;
+        case RTL:
+            send_begin(RTL, 3);
+            send_byte((byte)currentTemp);
+            send_byte((byte)currentLum);
+            send_end();
+            break;
+        case RPAR:
+            send_begin(RPAR, 3);
+            send_byte((byte)PMON);
+            send_byte((byte)TALA);
+            send_end();
+            break;
+        case MMP:
+            if (message_received[1] > 99)
+                send_status(MMP, CMD_ERROR);
+            else
+            {
+                PMON = message_received[1];
+                DATAEE_WriteByte(PMON_OFFSET, (byte)PMON);
+                DATAEE_WriteByte(CHECK_SUM_OFFSET, calculate_check_sum());
+                send_status(MMP, CMD_OK);
+            }
+            break;
+        case MTA:
+            if (message_received[1] > 60)
+                send_status(MTA, CMD_ERROR);
+            else
+            {
+                TALA = message_received[1];
+                DATAEE_WriteByte(TALA_OFFSET, (byte)TALA);
+                DATAEE_WriteByte(CHECK_SUM_OFFSET, calculate_check_sum());
+                send_status(MTA, CMD_OK);
+            }
+            break;
+        case RALA:
+            send_begin(RALA, 4);
+            send_byte((byte)ALAT);
+            send_byte((byte)ALAL);
+            send_byte((byte)ALAF);
+            send_end();
+            break;
+        case DATL:
+            if (message_received[1] > 50 || message_received[2] > 3)
+                send_status(DATL, CMD_ERROR);
+            else
+            {
+                ALAT = message_received[1];
+                ALAL = message_received[2];
+                send_status(DATL, CMD_OK);
+                DATAEE_WriteByte(ALAT_OFFSET, (byte)ALAT);
+                DATAEE_WriteByte(ALAL_OFFSET, (byte)ALAL);
+                DATAEE_WriteByte(CHECK_SUM_OFFSET, calculate_check_sum());
+            }
+            break;
+        case AALA:
+            if (message_received[1] > 1)
+                send_status(AALA, CMD_ERROR);
+            else
+            {
+                ALAF = message_received[1];
+                DATAEE_WriteByte(ALAF_OFFSET, (byte)ALAF);
+                DATAEE_WriteByte(CHECK_SUM_OFFSET, calculate_check_sum());
+                send_status(AALA, CMD_OK);
+            }
+            break;
+        case IREG:
+            send_begin(IREG, 5);
+            send_byte((byte)NREG);
+            send_byte((byte)nr);
+            send_byte((byte)iread);
+            send_byte((byte)write_index);
+            send_end();
+            break;
+        case TRGC:
+            if (message_received[1] > NREG)
+                send_status(TRGC, CMD_ERROR);
+            else
+            {
+                //number of registers to transfer, limited to the registers not yet transfered and to one message
+                n = message_received[1];
+                if(n > memory)
+                    n = memory;
+                if(n > MAX_TRANSFER)
+                    n = MAX_TRANSFER;
+                send_begin(TRGC, 1 + 5*n);
+                for (i = 0; i < n; i++)
+                {
+                    registo = read_register(iread);
+                    send_register(registo);
+                    memory--;
+                    iread++;
+                    if(iread >= NREG)
+                      iread = 0;
+                }
+                send_end();
+                DATAEE_WriteByte(RING_BUFFER_memory, (byte)memory);
+                DATAEE_WriteByte(RING_BUFFER_iread, (byte)iread);
+                bulk_moved();
+            }
+            break;
+        case PTRC:
+            n = memory;
+            if(n > MAX_TRANSFER)
+                n = MAX_TRANSFER;
+            send_begin(TRCACK, 1 + 5*n);
+            for (i = 0; i < n; i++)
+            {
+                registo = read_register(iread);
+                send_register(registo);
+                memory--;
+                iread++;
+                if(iread >= NREG)
+                  iread = 0;
+            }
+            send_end();
+            DATAEE_WriteByte(RING_BUFFER_memory, (byte)memory);
+            DATAEE_WriteByte(RING_BUFFER_iread, (byte)iread);
+            bulk_moved();
+            break;
+        case BTRC:
+            bulk_start(message_received[1], message_received[2]);
+            break;
+        case BACK:
+            bulk_ack(message_received[1], message_received[2]);
+            break;
+        case TRGI:
+            if (message_received[1] > NREG || message_received[2] > (NREG-1))
+                send_status(TRGI, CMD_ERROR);
+            else
+            {
+                //oldest register in ring buffer
+                int oldest = (write_index - nr);
+                while(oldest < 0)
+                    oldest = oldest + NREG;
+
+                aux_read_index = (oldest + message_received[2]);
+                while(aux_read_index >= NREG)
+                    aux_read_index = aux_read_index - NREG;
+
+                //number of registers to transfer, up to write_index
+                n = 0;
+                if(nr != 0)
+                {
+                    n = write_index - aux_read_index;
+                    if(n <= 0)
+                        n = n + NREG;
+                    if(n > message_received[1])
+                        n = message_received[1];
+                    if(n > MAX_TRANSFER)
+                        n = MAX_TRANSFER;
+                }
+                send_begin(TRGI, 1 + 5*n);
+                for (i = 0; i < n; i++)
+                {
+                    registo = read_register(aux_read_index);
+                    send_register(registo);
+                    if (aux_read_index == iread)
+                    {
+                        iread=(iread+1)%NREG;
+                        memory--;
+                    }
+                    aux_read_index=(aux_read_index+1)%NREG;
+                }
+                send_end();
+                DATAEE_WriteByte(RING_BUFFER_memory, (byte)memory);
+                DATAEE_WriteByte(RING_BUFFER_iread, (byte)iread);
+                bulk_moved();
+            }
+            break;
+    }
+}
+
+//receive one byte of a message (the receiving loop of the firmware)
+void receive_byte(byte bit_received)
+{
+    if(bit_received == SOM) //if is the start of the message
+    {
+        receiving_message = true;
+        index_message_received = 0;
+        message_protocol = 0;
+        escape = false;
+    }
+    else if(bit_received == EOM && receiving_message)  //if is the end of the message
+    {
+        receiving_message = false;
+        //protocol v2 messages are only processed if the length is right
+        if(message_protocol != 2 || (!escape && index_message_received == message_length))
+        {
+            if(message_protocol != 0)
+                protocol = message_protocol; //reply with the same version
+            received++;
+            process_message(index_message_received);
+        }
+        else
+            rejected++;
+        index_message_received = 0;
+    }
+    else if(receiving_message && message_protocol == 0 && bit_received < MAX_LEN)
+    {
+        message_protocol = 2;
+        message_length = bit_received;
+    }
+    else if(receiving_message && message_protocol == 2 && bit_received == ESC)
+    {
+        escape = true;
+    }
+    else if(receiving_message)
+    {
+        if(message_protocol == 0)
+            message_protocol = 1;
+        if(escape)
+        {
+            bit_received ^= ESC_XOR;
+            escape = false;
+        }
+        if(index_message_received < (int)sizeof(message_received))
+            message_received[index_message_received] = bit_received;
+        index_message_received++;
+    }
+}
+
+void stop(int signal)
+{
+    running = 0;
+}
+
+double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void usage(char* name)
+{
+    fprintf(stderr, "Usage: %s [-n NREG] [-r registers/s] [-b baud] [-c corrupt] [-d drop] [-s seed] [-f eeprom] [-v]\n"
+        "  -n NREG      number of registers of the ring buffer (1-%d, default 30)\n"
+        "  -r rate      registers generated per second (default: one every PMON seconds)\n"
+        "  -b baud      baud rate of the line, 0 for no delay (default 0)\n"
+        "  -c corrupt   probability of a bit error in each byte sent (default 0)\n"
+        "  -d drop      probability of losing each byte sent (default 0)\n"
+        "  -s seed      seed of the injected errors\n"
+        "  -f eeprom    file where the EEPROM is loaded from and saved to\n"
+        "  -v           print statistics every second\n", name, MAX_NREG);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    struct termios tio;
+    struct pollfd pfd;
+    struct timespec timeout;
+    byte rx[256];
+    double t, next_second, next_sample, next;
+    FILE* f;
+    int slave, opt, n, i;
+
+    while((opt = getopt(argc, argv, "n:r:b:c:d:s:f:v")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': NREG = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'b': baud = atoi(optarg); break;
+            case 'c': corrupt = atof(optarg); break;
+            case 'd': drop = atof(optarg); break;
+            case 's': srand(atoi(optarg)); break;
+            case 'f': eeprom_file = optarg; break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(NREG < 1 || NREG > MAX_NREG || rate < 0 || baud < 0)
+        usage(argv[0]);
+
+    memset(eeprom, 0xFF, sizeof(eeprom)); //erased EEPROM
+    if(eeprom_file != NULL && (f = fopen(eeprom_file, "rb")) != NULL)
+    {
+        if(fread(eeprom, 1, sizeof(eeprom), f) == 0)
+            memset(eeprom, 0xFF, sizeof(eeprom));
+        fclose(f);
+    }
+    MemoryInitialize();
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        perror("pty");
+        return 1;
+    }
+    //keep the slave open, so the master does not see a hangup between two runs of the host
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    printf("%s\n", ptsname(master));
+    fflush(stdout);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    pfd.fd = master;
+    pfd.events = POLLIN;
+    next_second = now() + 1;
+    next_sample = now();
+    while(running)
+    {
+        t = now();
+        while(t >= next_second) //one second of the clock
+        {
+            processTime();
+            next_second += 1;
+            if(verbose)
+                fprintf(stderr, "samples %lu saved %lu overwritten %lu received %lu rejected %lu sent %lu corrupted %lu dropped %lu nr %d memory %d\n",
+                    samples, saved, overwritten, received, rejected, sent_bytes, corrupted, dropped, nr, memory);
+        }
+        if(rate > 0)
+        {
+            //the samples late (a busy host or a slow line) are generated in a burst, up to one second of them
+            if(t - next_sample > 1)
+                next_sample = t - 1;
+            while(t >= next_sample)
+            {
+                sample();
+                next_sample += 1 / rate;
+            }
+        }
+
+        next = next_second;
+        if(rate > 0 && next_sample < next)
+            next = next_sample;
+        t = next - now();
+        if(t < 0)
+            t = 0;
+        timeout.tv_sec = (time_t)t;
+        timeout.tv_nsec = (long)((t - timeout.tv_sec) * 1e9);
+        if(ppoll(&pfd, 1, &timeout, NULL) > 0 && (pfd.revents & POLLIN))
+        {
+            n = read(master, rx, sizeof(rx));
+            for(i = 0; i < n; i++)
+                receive_byte(rx[i]);
+        }
+    }
+
+    if(eeprom_file != NULL && (f = fopen(eeprom_file, "wb")) != NULL)
+    {
+        fwrite(eeprom, 1, sizeof(eeprom), f);
+        fclose(f);
+    }
+    fprintf(stderr, "samples %lu saved %lu overwritten %lu received %lu rejected %lu sent %lu corrupted %lu dropped %lu\n",
+        samples, saved, overwritten, received, rejected, sent_bytes, corrupted, dropped);
+    close(slave);
+    close(master);
+    return 0;
+}
@@ -0,0 +1,90 @@
+/***************************************************************************
+| File: protocol.c
+|
+| Checks and encoder of the messages of the protocol, generated from the
+| table PROTOCOL_OPCODES of protocol.h (compiled into the weather station,
+| the PIC firmware and the simulator).
+----------------------------------------------------------------------------*/
+#include "protocol.h"
+
+//the bits of the numbers of arguments must stay below those of the messages with registers
+typedef char protocol_masks_check[(PROTOCOL_ARGS(PROTOCOL_MAX_ARGUMENTS) < PROTOCOL_CHUNK) ? 1 : -1];
+
+//numbers of arguments allowed for the command (reply FALSE) or the reply (reply TRUE) with "opcode" (0 - unknown)
+static unsigned long protocol_arguments(unsigned char opcode, int reply)
+{
+    switch(opcode)
+    {
+#define PROTOCOL_CASE(name, opcode, where, command, reply_) case opcode: return reply ? (reply_) : (command);
+        PROTOCOL_OPCODES(PROTOCOL_CASE)
+#undef PROTOCOL_CASE
+    }
+    return 0;
+}
+
+//where the command with "opcode" is executed (PROTOCOL_DEVICE, PROTOCOL_HOST or PROTOCOL_NOTIFICATION, which is also
+//returned for an unknown opcode)
+int protocol_where(unsigned char opcode)
+{
+    switch(opcode)
+    {
+#define PROTOCOL_CASE(name, opcode, where, command, reply) case opcode: return where;
+        PROTOCOL_OPCODES(PROTOCOL_CASE)
+#undef PROTOCOL_CASE
+    }
+    return PROTOCOL_NOTIFICATION;
+}
+
+//tells whether the command (reply FALSE) or the reply (reply TRUE) with "opcode" can have n arguments
+//(a reply can always be only CMD_ERROR, which is checked by the caller as it is the value of the argument)
+int protocol_valid(unsigned char opcode, int n, int reply)
+{
+    unsigned long allowed = protocol_arguments(opcode, reply);
+    if(n < 0)
+        return 0;
+    if(reply && n == 1 && allowed != 0)
+        return 1;
+    if(allowed & PROTOCOL_REGISTERS)
+        return n % 5 == 0;
+    if(allowed & PROTOCOL_CHUNK)
+        return n >= 1 && (n - 1) % 5 == 0 && (n - 1)/5 <= BULK_CHUNK;
+    return n <= PROTOCOL_MAX_ARGUMENTS && (allowed & PROTOCOL_ARGS(n)) != 0;
+}
+
+//tells whether a message of "size" bytes (SOM, opcode, arguments and EOM) is a valid command or reply
+//a reply with one argument that the table does not allow must be CMD_ERROR
+int protocol_check(const unsigned char* message, int size, int reply)
+{
+    if(size < 3 || message[0] != SOM || message[size-1] != EOM || !protocol_valid(message[1], size - 3, reply))
+        return 0;
+    if(reply && size == 4 && !(protocol_arguments(message[1], reply) & (PROTOCOL_ARGS(1) | PROTOCOL_CHUNK)))
+        return message[2] == CMD_ERROR;
+    return 1;
+}
+
+//write to "buffer" the command (reply FALSE) or the reply (reply TRUE) with "opcode" and n arguments (SOM, opcode,
+//arguments and EOM); returns the size of the message (0 if the table does not allow n arguments, nothing is written)
+int protocol_encode(unsigned char* buffer, unsigned char opcode, const unsigned char* arguments, int n, int reply)
+{
+    int i;
+    if(!protocol_valid(opcode, n, reply))
+        return 0;
+    buffer[0] = SOM;
+    buffer[1] = opcode;
+    for(i = 0; i < n; i++)
+        buffer[2+i] = arguments[i];
+    buffer[2+n] = EOM;
+    return n + 3;
+}
+
+//name of "opcode" (NULL if unknown)
+const char* protocol_name(unsigned char opcode)
+{
+    switch(opcode)
+    {
+#define PROTOCOL_CASE(name, opcode, where, command, reply) case opcode: return #name;
+        PROTOCOL_OPCODES(PROTOCOL_CASE)
+#undef PROTOCOL_CASE
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+/***************************************************************************
+| File: protocol.h
+|
+| Protocol between the weather station (weather_station.c) and the PIC
+| (weather_station.X/main.c, pic_simulator.c), shared by both sides.
+|
+| A message is SOM, opcode, arguments and EOM. Protocol v1 sends it as is;
+| protocol v2 puts after SOM the length of the opcode and the arguments and
+| escapes SOM, EOM and ESC inside the message. The opcodes, where each one is
+| executed and the numbers of arguments of its command and of its reply are
+| in the table PROTOCOL_OPCODES, from which protocol.c generates the checks
+| of the messages received and the encoder of the messages sent.
+|
+| A bulk transfer (BTRC) sends the registers not transferred in chunks (BCHK)
+| numbered modulo BULK_SEQ, up to a window of chunks not acknowledged. The
+| host acknowledges the chunks received in order (BACK), which frees their
+| registers in the device and lets it send the next ones; after a lost chunk
+| the host asks for those not acknowledged again (go-back-N), which the device
+| sends again with the same registers. A chunk without registers, sent when
+| all the others are acknowledged, ends the transfer. The sequence numbers go
+| on across the transfers (BTRC gives the one the host expects), so a chunk
+| of a transfer before is never taken for a chunk of the new one; when the
+| registers move without the transfer (PTRC, TRGC, TRGI) the device ends the
+| transfer with a BTRC error and the host starts another one.
+----------------------------------------------------------------------------*/
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#define SOM 0xFD /* start of message */
+#define EOM 0xFE /* end of message */
+#define ESC 0xFC /* escape of SOM, EOM and ESC inside a message (protocol v2) */
+#define ESC_XOR 0x20 /* value xored with an escaped byte (protocol v2) */
+#define MAX_LEN 0xC0 /* length field of protocol v2 is below the first opcode, so both versions can be told apart */
+#define CMD_OK 0 /* command successful */
+#define CMD_ERROR 0xFF /* error in command */
+#define MAX_TRANSFER 38 /* maximum number of registers in one message of the device */
+#define PROTOCOL_MAX_ARGUMENTS 14 /* maximum number of arguments of a message that is not a transfer of registers */
+#define BULK_WINDOW 8 /* maximum number of chunks of a bulk transfer sent and not acknowledged */
+#define BULK_SEQ 128 /* sequence numbers of the chunks of a bulk transfer (below every byte of the framing) */
+#define BULK_CHUNK 37 /* maximum number of registers in one chunk (its length in protocol v2 stays below MAX_LEN) */
+
+#define PROTOCOL_NOTIFICATION 0 /* not a command: sent by the device on its own or as the reply to another command */
+#define PROTOCOL_DEVICE 1 /* command executed by the device */
+#define PROTOCOL_HOST 2 /* command executed by the processing task of the weather station */
+
+/* numbers of arguments allowed, one bit for each number from 0 to PROTOCOL_MAX_ARGUMENTS, and above them the
+   messages that carry registers (long, as an int of the PIC has only 16 bits) */
+#define PROTOCOL_ARGS(n) (1ul << (n))
+#define PROTOCOL_NONE 0ul /* never sent */
+#define PROTOCOL_REGISTERS 0x80000000ul /* registers of 5 bytes (hours, minutes, seconds, temperature, luminosity) */
+#define PROTOCOL_CHUNK 0x40000000ul /* sequence number and up to BULK_CHUNK registers of 5 bytes */
+
+/* X(name, opcode, where it is executed, arguments of the command, arguments of the reply)
+   a reply with only CMD_ERROR is allowed for every command */
+#define PROTOCOL_OPCODES(X) \
+    X(RCLK,   0xC0, PROTOCOL_DEVICE, PROTOCOL_ARGS(0), PROTOCOL_ARGS(3)) /* read clock */ \
+    X(SCLK,   0xC1, PROTOCOL_DEVICE, PROTOCOL_ARGS(3), PROTOCOL_ARGS(1)) /* set clock */ \
+    X(RTL,    0xC2, PROTOCOL_DEVICE, PROTOCOL_ARGS(0), PROTOCOL_ARGS(2)) /* read temperature and luminosity */ \
+    X(RPAR,   0xC3, PROTOCOL_DEVICE, PROTOCOL_ARGS(0), PROTOCOL_ARGS(2)) /* read parameters */ \
+    X(MMP,    0xC4, PROTOCOL_DEVICE, PROTOCOL_ARGS(1), PROTOCOL_ARGS(1)) /* modify monitoring period */ \
+    X(MTA,    0xC5, PROTOCOL_DEVICE, PROTOCOL_ARGS(1), PROTOCOL_ARGS(1)) /* modify time alarm */ \
+    X(RALA,   0xC6, PROTOCOL_DEVICE, PROTOCOL_ARGS(0), PROTOCOL_ARGS(3)) /* read alarms (temperature, luminosity, active/inactive) */ \
+    X(DATL,   0xC7, PROTOCOL_DEVICE, PROTOCOL_ARGS(2), PROTOCOL_ARGS(1)) /* define alarm temperature and luminosity */ \
+    X(AALA,   0xC8, PROTOCOL_DEVICE, PROTOCOL_ARGS(1), PROTOCOL_ARGS(1)) /* activate/deactivate alarms */ \
+    X(IREG,   0xC9, PROTOCOL_DEVICE, PROTOCOL_ARGS(0), PROTOCOL_ARGS(4)) /* information about registers (NREG, nr, iread, iwrite) */ \
+    X(TRGC,   0xCA, PROTOCOL_DEVICE, PROTOCOL_ARGS(1), PROTOCOL_REGISTERS) /* transfer registers (curr. position) */ \
+    X(TRGI,   0xCB, PROTOCOL_DEVICE, PROTOCOL_ARGS(2), PROTOCOL_REGISTERS) /* transfer registers (index) */ \
+    X(NMFL,   0xCC, PROTOCOL_NOTIFICATION, PROTOCOL_NONE, PROTOCOL_ARGS(0)) /* notification memory (half) full */ \
+    X(CPT,    0xD0, PROTOCOL_HOST, PROTOCOL_ARGS(0), PROTOCOL_ARGS(1)) /* check period of transference */ \
+    X(MPT,    0xD1, PROTOCOL_HOST, PROTOCOL_ARGS(1), PROTOCOL_ARGS(1)) /* modify period of transference */ \
+    X(CTTL,   0xD2, PROTOCOL_HOST, PROTOCOL_ARGS(0), PROTOCOL_ARGS(2)) /* check threshold temperature and luminosity for processing */ \
+    X(DTTL,   0xD3, PROTOCOL_HOST, PROTOCOL_ARGS(2), PROTOCOL_ARGS(1)) /* define threshold temperature and luminosity for processing */ \
+    X(PR,     0xD4, PROTOCOL_HOST, PROTOCOL_ARGS(0) | PROTOCOL_ARGS(3) | PROTOCOL_ARGS(6), PROTOCOL_ARGS(6)) /* process registers (max, min, mean) between instants t1 and t2 (h,m,s) */ \
+    X(PTRC,   0xD5, PROTOCOL_DEVICE, PROTOCOL_ARGS(0), PROTOCOL_NONE) /* start periodic transfer (answered by TRCACK) */ \
+    X(TRCACK, 0xD6, PROTOCOL_NOTIFICATION, PROTOCOL_NONE, PROTOCOL_REGISTERS) /* acknowledgment of periodic transfer */ \
+    X(PRD,    0xD7, PROTOCOL_HOST, PROTOCOL_ARGS(0) | PROTOCOL_ARGS(3) | PROTOCOL_ARGS(6), PROTOCOL_ARGS(8)) /* process registers (median, p90, p95, p99 and histogram) between instants t1 and t2 (h,m,s) */ \
+    X(BTRC,   0xD8, PROTOCOL_DEVICE, PROTOCOL_ARGS(2), PROTOCOL_ARGS(2)) /* start bulk transfer with a window of chunks from a sequence number (answered by BCHK; reply of the host - registers transferred, high and low byte) */ \
+    X(BCHK,   0xD9, PROTOCOL_NOTIFICATION, PROTOCOL_NONE, PROTOCOL_CHUNK) /* chunk of a bulk transfer (without registers - end of the transfer) */ \
+    X(BACK,   0xDA, PROTOCOL_DEVICE, PROTOCOL_ARGS(2), PROTOCOL_NONE) /* acknowledge the chunks of a bulk transfer up to a sequence number (TRUE - send again those not acknowledged) */
+
+#define PROTOCOL_ENUM(name, opcode, where, command, reply) name = opcode,
+enum protocol_opcode { PROTOCOL_OPCODES(PROTOCOL_ENUM) PROTOCOL_LAST_OPCODE = 0xFF };
+#undef PROTOCOL_ENUM
+
+int protocol_where(unsigned char opcode);
+int protocol_valid(unsigned char opcode, int n, int reply);
+int protocol_check(const unsigned char* message, int size, int reply);
+int protocol_encode(unsigned char* buffer, unsigned char opcode, const unsigned char* arguments, int n, int reply);
+const char* protocol_name(unsigned char opcode);
+
+#endif
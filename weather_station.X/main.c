@@ -43,6 +43,8 @@
 
 #include "mcc_generated_files/mcc.h"
 #include "I2C/i2c.h"
+#include "../protocol.h"
+#include "../bulk.h"
 
 #define EEAddr_MIN 0x7000 //EEPROM start
 #define EEAddr_MAX 0x70FF //EEPROM end
@@ -67,27 +69,6 @@
 
 #define MAGICAL_WORD 0xAA
 
-#define SOM 0xFD /* start of message */
-#define EOM 0xFE /* end of message */
-#define RCLK 0xC0 /* read clock */
-#define SCLK 0XC1 /* set clock */
-#define RTL 0XC2 /* read temperature and luminosity */
-#define RPAR 0XC3 /* read parameters */
-#define MMP 0XC4 /* modify monitoring period */
-#define MTA 0XC5 /* modify time alarm */
-#define RALA 0XC6 /* read alarms (temperature, luminosity, active/inactive) */
-#define DATL_ 0XC7 /* define alarm temperature and luminosity */
-#define AALA 0XC8 /* activate/deactivate alarms */
-#define IREG 0XC9 /* information about registers (NREG, nr, iread, iwrite)*/
-#define TRGC 0XCA /* transfer registers (curr. position)*/
-#define TRGI 0XCB /* transfer registers (index) */
-#define NMFL 0XCC /* notification memory (half) full */
-#define CMD_OK 0 /* command successful */
-#define CMD_ERROR 0xFF /* error in command */
-
-#define PTRC 0xD5
-#define TRCACK 0xD6
-
 
 int currentLum = 0;
 int currentTemp = 0;
@@ -95,6 +76,10 @@ int currentTemp = 0;
 uint8_t message_received[10];
 bool receiving_message = false;
 int index_message_received = 0;
+int message_protocol = 0; //protocol version of the message being received (0 while unknown)
+int message_length = 0; //length announced by a protocol v2 message
+bool escape = false; //previous byte received was ESC
+int protocol = 1; //protocol version of the last message received, used for replies and notifications
 
 
 /*
@@ -219,6 +204,51 @@ void PWM_Output_D4_Disable (void){
     PPSLOCKbits.PPSLOCKED = 0x01; // lock PPS
 }
 
+//send one byte of a message, escaping SOM, EOM and ESC in protocol v2
+void send_byte(byte b)
+{
+    if(protocol == 2 && (b == SOM || b == EOM || b == ESC))
+    {
+        EUSART_Write(ESC);
+        EUSART_Write(b ^ ESC_XOR);
+    }
+    else
+        EUSART_Write(b);
+}
+
+//start sending a message: SOM, length of opcode and arguments (only in protocol v2) and opcode
+void send_begin(byte opcode, byte length)
+{
+    EUSART_Write(SOM);
+    if(protocol == 2)
+        EUSART_Write(length);
+    send_byte(opcode);
+}
+
+//finish sending a message
+void send_end(void)
+{
+    EUSART_Write(EOM);
+}
+
+//send a message with only the status of a command (CMD_OK or CMD_ERROR)
+void send_status(byte opcode, byte status)
+{
+    send_begin(opcode, 2);
+    send_byte(status);
+    send_end();
+}
+
+//send one register of the ring buffer
+void send_register(buffer_entry registo)
+{
+    send_byte(registo.hour);
+    send_byte(registo.minute);
+    send_byte(registo.seconds);
+    send_byte(registo.temperature);
+    send_byte(registo.lum);
+}
+
 //auxiliary funtion to write one buffer entry to memory
 void write_register(buffer_entry entry)
 {
@@ -236,12 +266,13 @@ void write_register(buffer_entry entry)
         // when memory half full sends a notification
         if (memory == NREG/2)
         {
-            EUSART_Write(SOM);
-            EUSART_Write(NMFL);
-            EUSART_Write(EOM);
+            send_begin(NMFL, 1);
+            send_end();
         }
         DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_memory, (byte)memory);
     }
+    else
+        bulk_overwritten();
    
     //increment write index so that the program doesn't overwrite previous entry
     write_index++;
@@ -277,6 +308,27 @@ buffer_entry read_register(int position)
     return entry;
 }
 
+//registers not transferred, for the bulk transfers (bulk.c)
+int bulk_pending(void)
+{
+    return memory;
+}
+
+//send the register i places after iread, for the bulk transfers (bulk.c)
+void bulk_send_register(int i)
+{
+    send_register(read_register((iread + i) % NREG));
+}
+
+//the n registers from iread were acknowledged in a bulk transfer (bulk.c)
+void bulk_transferred(int n)
+{
+    iread = (iread + n) % NREG;
+    memory -= n;
+    DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_memory, (byte)memory);
+    DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_iread, (byte)iread);
+}
+
 //this function uses auxiliary functions write_register an read_register to read previous entry 
 //The new entry is saved if there is a change in the luminosity or temperature of the previous entry
 void compare_and_save(buffer_entry new_entry)
@@ -770,37 +822,33 @@ void process_message(int size_message)
 {
     buffer_entry registo;
     int i=0;
+    int n=0;
     int aux_read_index=0;
+    //only the commands of the device are executed, and those with a number of arguments that the protocol table does
+    //not allow are answered with an error (PTRC by TRCACK, BACK by BTRC)
+    if(protocol_where(message_received[0]) != PROTOCOL_DEVICE)
+        return;
+    if(!protocol_valid(message_received[0], size_message - 1, false))
+    {
+        send_status(message_received[0] == PTRC ? TRCACK : message_received[0] == BACK ? BTRC : message_received[0], CMD_ERROR);
+        return;
+    }
     //instruction in message_received[0]
     switch(message_received[0])
     {
         case RCLK:
-            if (size_message!=1)
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(RCLK);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
-            }
-            else
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(RCLK);
-                EUSART_Write((byte)CLKH);
-                EUSART_Write((byte)CLKM);
-                EUSART_Write((byte)CLKS);
-                EUSART_Write(EOM);
-            }
+            send_begin(RCLK, 4);
+            send_byte((byte)CLKH);
+            send_byte((byte)CLKM);
+            send_byte((byte)CLKS);
+            send_end();
             
             break;
         case SCLK:
-            if (size_message!=4 || message_received[1] > 23 || message_received[1] < 0 ||
+            if (message_received[1] > 23 || message_received[1] < 0 ||
                 message_received[2] > 59 || message_received[2] < 0 || message_received[3] > 59 || message_received[3] < 0)
             {
-                EUSART_Write(SOM);
-                EUSART_Write(SCLK);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
+                send_status(SCLK, CMD_ERROR);
             }
             else
             {
@@ -810,122 +858,68 @@ void process_message(int size_message)
                 DATAEE_WriteByte(EEAddr_MIN+CLKM_OFFSET, (byte)CLKM);
                 DATAEE_WriteByte(EEAddr_MIN+CHECK_SUM_OFFSET, calculate_check_sum());
                 CLKS = message_received[3];
-                EUSART_Write(SOM);
-                EUSART_Write(SCLK);
-                EUSART_Write(CMD_OK);
-                EUSART_Write(EOM);
+                send_status(SCLK, CMD_OK);
             }
             break;
         case RTL:
-            if (size_message!=1)
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(RTL);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
-            }
-            else
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(RTL);
-                EUSART_Write((byte)currentTemp);
-                EUSART_Write((byte)currentLum);
-                EUSART_Write(EOM);
-            }
+            send_begin(RTL, 3);
+            send_byte((byte)currentTemp);
+            send_byte((byte)currentLum);
+            send_end();
 
             break;
         case RPAR:
-            if (size_message!=1)
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(RPAR);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
-            }
-            else
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(RPAR);
-                EUSART_Write((byte)PMON);
-                EUSART_Write((byte)TALA);
-                EUSART_Write(EOM);
-            }
+            send_begin(RPAR, 3);
+            send_byte((byte)PMON);
+            send_byte((byte)TALA);
+            send_end();
             break;
             
         case MMP:
-            if (size_message!=2 || message_received[1] > 99 || message_received[1] < 0)
+            if (message_received[1] > 99 || message_received[1] < 0)
             {
-                EUSART_Write(SOM);
-                EUSART_Write(MMP);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
+                send_status(MMP, CMD_ERROR);
             }
             else
             {
                 PMON = message_received[1];
                 DATAEE_WriteByte(EEAddr_MIN+PMON_OFFSET, (byte)PMON);
                 DATAEE_WriteByte(EEAddr_MIN+CHECK_SUM_OFFSET, calculate_check_sum());
-                EUSART_Write(SOM);
-                EUSART_Write(MMP);
-                EUSART_Write(CMD_OK);
-                EUSART_Write(EOM);
+                send_status(MMP, CMD_OK);
             }
             break;
         case MTA:
-            if (size_message!=2 || message_received[1] > 60 || message_received[1] < 0)
+            if (message_received[1] > 60 || message_received[1] < 0)
             {
-                EUSART_Write(SOM);
-                EUSART_Write(MTA);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
+                send_status(MTA, CMD_ERROR);
             }
             else 
             {
                 TALA = message_received[1];
                 DATAEE_WriteByte(EEAddr_MIN+TALA_OFFSET, (byte)TALA);
                 DATAEE_WriteByte(EEAddr_MIN+CHECK_SUM_OFFSET, calculate_check_sum());
-                EUSART_Write(SOM);
-                EUSART_Write(MTA);
-                EUSART_Write(CMD_OK);
-                EUSART_Write(EOM);
+                send_status(MTA, CMD_OK);
             }
             break;
         case RALA:
-            if (size_message!=1)
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(RALA);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
-            }
-            else
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(RALA);
-                EUSART_Write((byte)ALAT);
-                EUSART_Write((byte)ALAL);
-                EUSART_Write((byte)ALAF);
-                EUSART_Write(EOM); 
-            }
+            send_begin(RALA, 4);
+            send_byte((byte)ALAT);
+            send_byte((byte)ALAL);
+            send_byte((byte)ALAF);
+            send_end();
 
             break;
-        case DATL_:
-            if (size_message!=3 || message_received[1] > 50 || message_received[1] < 0 ||
+        case DATL:
+            if (message_received[1] > 50 || message_received[1] < 0 ||
                  message_received[2] > 3 || message_received[2] < 0)
             {
-                EUSART_Write(SOM);
-                EUSART_Write(DATL_);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
+                send_status(DATL, CMD_ERROR);
             }
             else
             {
                 ALAT = message_received[1];
                 ALAL = message_received[2];
-                EUSART_Write(SOM);
-                EUSART_Write(DATL_);
-                EUSART_Write(CMD_OK);
-                EUSART_Write(EOM);
+                send_status(DATL, CMD_OK);
                 DATAEE_WriteByte(EEAddr_MIN+ALAT_OFFSET, (byte)ALAT);
                 DATAEE_WriteByte(EEAddr_MIN+ALAL_OFFSET, (byte)ALAL);
                 DATAEE_WriteByte(EEAddr_MIN+CHECK_SUM_OFFSET, calculate_check_sum()); 
@@ -933,12 +927,9 @@ void process_message(int size_message)
 
             break;
         case AALA:
-            if (size_message!=2 || message_received[1] > 1 || message_received[1] < 0)
+            if (message_received[1] > 1 || message_received[1] < 0)
             {
-                EUSART_Write(SOM);
-                EUSART_Write(AALA);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
+                send_status(AALA, CMD_ERROR);
             }
             else
             {
@@ -954,131 +945,87 @@ void process_message(int size_message)
                 }
                 DATAEE_WriteByte(EEAddr_MIN+ALAF_OFFSET, (byte)ALAF);
                 DATAEE_WriteByte(EEAddr_MIN+CHECK_SUM_OFFSET, calculate_check_sum());
-                EUSART_Write(SOM);
-                EUSART_Write(AALA);
-                EUSART_Write(CMD_OK);
-                EUSART_Write(EOM);
+                send_status(AALA, CMD_OK);
             }
             break; 
             
         case IREG:
-            if (size_message!=1)
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(IREG);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
-            }
-            else
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(IREG);
-                EUSART_Write((byte)NREG);
-                EUSART_Write((byte)nr);
-                EUSART_Write((byte)iread);
-                EUSART_Write((byte)write_index);
-                EUSART_Write(EOM);
-            }
+            send_begin(IREG, 5);
+            send_byte((byte)NREG);
+            send_byte((byte)nr);
+            send_byte((byte)iread);
+            send_byte((byte)write_index);
+            send_end();
             break;
         case TRGC:
-            if (size_message!=2 || message_received[1] < 0 || message_received[1] > NREG)
+            if (message_received[1] < 0 || message_received[1] > NREG)
             {
-                EUSART_Write(SOM);
-                EUSART_Write(TRGC);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
+                send_status(TRGC, CMD_ERROR);
             }
             else
             {
-                EUSART_Write(SOM);
-                EUSART_Write(TRGC);
-                
-                //if there is registers to be transfered
-                if(memory != 0)
-                {
-                    for (i = 0; i < message_received[1]; i++)
-                    {   
-                        registo = read_register(iread);
-                        EUSART_Write(registo.hour);
-                        EUSART_Write(registo.minute);
-                        EUSART_Write(registo.seconds);
-                        EUSART_Write(registo.temperature);
-                        EUSART_Write(registo.lum);
-                        //# of registers to be sent decrements
-                        memory--;
-                        
-                        //register yet to be sent increments
-                        iread++;
-                        if(iread >= NREG)
-                          iread = 0;
-                        
-                        if(memory==0)
-                        {
-                            break;
-                        }
-                    }
+                //number of registers to transfer, limited to the registers not yet transfered and to one message
+                n = message_received[1];
+                if(n > memory)
+                    n = memory;
+                if(n > MAX_TRANSFER)
+                    n = MAX_TRANSFER;
+                send_begin(TRGC, 1 + 5*n);
+                for (i = 0; i < n; i++)
+                {   
+                    registo = read_register(iread);
+                    send_register(registo);
+                    //# of registers to be sent decrements
+                    memory--;
+                    
+                    //register yet to be sent increments
+                    iread++;
+                    if(iread >= NREG)
+                      iread = 0;
                 }
-                EUSART_Write(EOM); 
+                send_end();
                 DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_memory, (byte)memory);
                 DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_iread, (byte)iread);
+                bulk_moved();
                 
             }
             break;
             //when there is a periodic trransfer from the processing task to be able to 
             //distinguish periodic transfers from non periodic transfers
          case PTRC:
-             if (size_message!=1)
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(TRCACK);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
-            }
-            else
-            {
-                EUSART_Write(SOM);
-                EUSART_Write(TRCACK);
+            n = memory;
+            if(n > MAX_TRANSFER)
+                n = MAX_TRANSFER;
+            send_begin(TRCACK, 1 + 5*n);
+            for (i = 0; i < n; i++)
+            {   
+                registo = read_register(iread);
+                send_register(registo);
+                memory--;
                 
-                if(memory != 0)
-                {
-                    for (i = 0; i < NREG; i++)
-                    {   
-                        registo = read_register(iread);
-                        EUSART_Write(registo.hour);
-                        EUSART_Write(registo.minute);
-                        EUSART_Write(registo.seconds);
-                        EUSART_Write(registo.temperature);
-                        EUSART_Write(registo.lum);
-                        memory--;
-                        
-                        iread++;
-                        if(iread >= NREG)
-                          iread = 0;
-                        
-                        if(memory==0)
-                        {
-                            break;
-                        }
-                    }
-                }
-                EUSART_Write(EOM); 
-                DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_memory, (byte)memory);
-                DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_iread, (byte)iread);
+                iread++;
+                if(iread >= NREG)
+                  iread = 0;
             }
+            send_end();
+            DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_memory, (byte)memory);
+            DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_iread, (byte)iread);
+            bulk_moved();
+            break;
+         case BTRC:
+            bulk_start(message_received[1], message_received[2]);
+            break;
+         case BACK:
+            bulk_ack(message_received[1], message_received[2]);
             break;
          case TRGI:
-            if (size_message!=3 || message_received[1] < 0 || message_received[1] > NREG ||
+            if (message_received[1] < 0 || message_received[1] > NREG ||
                 message_received[2] < 0 || message_received[2] > (NREG-1) )
             {
-                EUSART_Write(SOM);
-                EUSART_Write(TRGI);
-                EUSART_Write(CMD_ERROR);
-                EUSART_Write(EOM);
+                send_status(TRGI, CMD_ERROR);
             }
             else
             {
-                EUSART_Write(SOM);
-                EUSART_Write(TRGI);
                 //oldest register in ring buffer
                 int oldest = (write_index - nr);
                 //adjust index to buffer size
@@ -1091,35 +1038,36 @@ void process_message(int size_message)
                 while(aux_read_index >= NREG)
                     aux_read_index = aux_read_index - NREG;
                 
-                //if is registers in buffer
+                //number of registers to transfer, up to write_index
+                n = 0;
                 if(nr != 0)
                 {
-                    for (i = 0; i< message_received[1]; i++)
-                    {   
-                        registo = read_register(aux_read_index);
-                        EUSART_Write(aux_read_index);
-                        EUSART_Write(registo.minute);
-                        EUSART_Write(registo.seconds);
-                        EUSART_Write(registo.temperature);
-                        EUSART_Write(registo.lum);
-                        
-                        if (aux_read_index == iread)
-                        {
-                            iread=(iread+1)%NREG;
-                            memory--;
-                        }
-                        
-                        aux_read_index=(aux_read_index+1)%NREG;;
-
-                        if(aux_read_index==write_index)
-                        {
-                            break;
-                        }
+                    n = write_index - aux_read_index;
+                    if(n <= 0)
+                        n = n + NREG;
+                    if(n > message_received[1])
+                        n = message_received[1];
+                    if(n > MAX_TRANSFER)
+                        n = MAX_TRANSFER;
+                }
+                send_begin(TRGI, 1 + 5*n);
+                for (i = 0; i < n; i++)
+                {   
+                    registo = read_register(aux_read_index);
+                    send_register(registo);
+                    
+                    if (aux_read_index == iread)
+                    {
+                        iread=(iread+1)%NREG;
+                        memory--;
                     }
+                    
+                    aux_read_index=(aux_read_index+1)%NREG;
                 }
-                EUSART_Write(EOM); 
+                send_end();
                 DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_memory, (byte)memory);
                 DATAEE_WriteByte(EEAddr_MIN+RING_BUFFER_iread, (byte)iread);
+                bulk_moved();
             }
             break;   
     }
@@ -1191,18 +1139,44 @@ void main(void)
             {
                 receiving_message = true;
                 index_message_received = 0; //reset of index buffer 
+                message_protocol = 0;
+                escape = false;
             }
-            else if(bit_received == EOM)  //if is the end of the message
+            else if(bit_received == EOM && receiving_message)  //if is the end of the message
             {
                 receiving_message = false;
-                process_message(index_message_received);   // processes the message
+                //protocol v2 messages are only processed if the length is right
+                if(message_protocol != 2 || (!escape && index_message_received == message_length))
+                {
+                    if(message_protocol != 0)
+                        protocol = message_protocol; //reply with the same version
+                    process_message(index_message_received);   // processes the message
+                }
                 index_message_received = 0;
                 
             }
+            else if(receiving_message && message_protocol == 0 && bit_received < MAX_LEN)
+            {
+                //length field of a protocol v2 message
+                message_protocol = 2;
+                message_length = bit_received;
+            }
+            else if(receiving_message && message_protocol == 2 && bit_received == ESC)
+            {
+                escape = true;
+            }
             else if(receiving_message)  
             {
+                if(message_protocol == 0)
+                    message_protocol = 1;
+                if(escape)
+                {
+                    bit_received ^= ESC_XOR;
+                    escape = false;
+                }
                 //saves the byte in a buffer
-                message_received[index_message_received] = bit_received;    
+                if(index_message_received < sizeof(message_received))
+                    message_received[index_message_received] = bit_received;    
                 index_message_received++;
             }
         }
@@ -1,5 +1,8 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <cyg/kernel/kapi.h>
 #include <cyg/io/io.h>
 #include <ctype.h>
@@ -7,35 +10,18 @@
 #include <cyg/io/serialio.h>
 #include <cyg/io/config_keys.h>
 #include <cyg/infra/diag.h>
+#include <cyg/hal/hal_intr.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define SOM 0xFD /* start of message */
-#define EOM 0xFE /* end of message */
-#define RCLK 0xC0 /* read clock */
-#define SCLK 0XC1 /* set clock */
-#define RTL 0XC2 /* read temperature and luminosity */
-#define RPAR 0XC3 /* read parameters */
-#define MMP 0XC4 /* modify monitoring period */
-#define MTA 0XC5 /* modify time alarm */
-#define RALA 0XC6 /* read alarms (temperature, luminosity, active/inactive) */
-#define DATL 0XC7 /* define alarm temperature and luminosity */
-#define AALA 0XC8 /* activate/deactivate alarms */
-#define IREG 0XC9 /* information about registers (NREG, nr, iread, iwrite)*/
-#define TRGC 0XCA /* transfer registers (curr. position)*/
-#define TRGI 0XCB /* transfer registers (index) */
-#define NMFL 0XCC /* notification memory (half) full */
-#define CMD_OK 0 /* command successful */
-#define CMD_ERROR 0xFF /* error in command */
-
-#define CPT 0xD0 /*check period of transference*/
-#define MPT 0xD1 /*modify period of transference */
-#define CTTL 0xD2 /*check threshold temperature and luminosity for processing*/
-#define DTTL 0xD3 /*define threshold temperature and luminosity for processing*/
-#define PR 0xD4 /*process registers (max, min, mean) between instants t1 and t2 (h,m,s)*/
-#define PTRC 0xD5 /*start periodic transfer*/
-#define TRCACK 0xD6 /*acknowledgment of periodic transfer*/
-
+#include "protocol.h"
 
 #define TIMEOUT 50 /*timeout for receiving response from command in UI*/
+#define NREQUESTS 32 /*maximum number of commands waiting for a response*/
+#define TICKS_PER_SECOND 100 /*ticks of the real time clock per second*/
 
 
 #define TRUE 1
@@ -43,16 +29,68 @@
 #define NONE 255
 
 #define MAX_MESSAGE 200 /*maximum size of message received (bytes)*/
+#define RX_BUFFER_SIZE 512 /*size of the receive buffer of the frame decoder (bytes)*/
+#define MSG_BLOCK_SIZE 16 /*size of a block of the message pool (bytes)*/
+#define NMSG 64 /*number of blocks in the message pool*/
+#define MAX_FRAME (2*MSG_BLOCK_SIZE) /*maximum size of an encoded frame sent to the device (bytes)*/
+#define TX_BUFFER_SIZE (16*MAX_FRAME) /*size of the transmit buffer where the writer coalesces messages (bytes)*/
+#define WRITER_NBATCH 8 /*number of entries of the histogram of messages per write (last entry counts bigger batches)*/
+#define CAPTURE_RX 0 /*capture record of bytes read from the device*/
+#define CAPTURE_TX 1 /*capture record of bytes written to the device*/
+#define PROTOCOL_VERSION 2 /*protocol version used at startup (1 - SOM/EOM, 2 - length and byte stuffing)*/
+#define BENCH_STREAM 4096 /*size of the byte stream replayed by the benchmarks*/
+#define NMBOX 3 /*number of mailboxes (besides the sending mailbox of each station but the first)*/
+#define NSTATIONS 4 /*maximum number of stations (devices) connected at the same time*/
+#define MSG_HOST NSTATIONS /*station of the messages that do not come from a device (processing task)*/
+#define CONSOLE_RECORDS 1024 /*records of the console queue (power of 2)*/
+#define CONSOLE_RECORD 256 /*maximum size of a record of the console queue (bytes, longer text is cut)*/
+#ifndef NRBUF
+#define NRBUF 100 /*size of the ring buffer at startup (registers, mrb changes it while the station runs)*/
+#endif
+#define NRUNS 64 /*runs of registers in time order indexed in the ring buffer (more runs and pr scans all registers)*/
+#define RING_BLOCK 64 /*registers of the ring buffer summarized by each leaf of its summary tree*/
+#define RING_PAGE 65536 /*registers in each page of the columns of the ring buffer (multiple of RING_BLOCK)*/
+#define LOG_SEGMENT 65536 /*registers in each segment file of the register log*/
+#define LOG_BLOCK 1024 /*registers of the register log summarized by each entry of its index (LOG_SEGMENT multiple of it)*/
+#define LOG_RECORD 6 /*bytes of each register in the register log*/
+#define LOG_PATH 128 /*maximum size of the path of a segment file of the register log*/
+#define LOG_RUNS 64 /*runs of consecutive numbers of the ring buffer appended to the register log that are remembered*/
+#define HIST_BLOCK 512 /*registers of each compressed block of the register history*/
+#define HIST_CODE (6*HIST_BLOCK + 1) /*maximum size of the code of a block of the register history (6 bytes per register and the unit)*/
+#define HIST_REPEAT 64 /*maximum number of repetitions of a difference coded in one byte of the register history*/
+#define ROLLUP_MINUTES (2*24*60) /*per-minute summaries of registers kept (two days)*/
+#define ROLLUP_HOURS (31*24) /*per-hour summaries of registers kept (a month)*/
+#define ROLLUP_DAYS 366 /*per-day summaries of registers kept (a year)*/
+#define NBINS 256 /*bins of the histograms of temperature and luminosity (one per value)*/
+#define ROLLUP_MERGED 2 /*returned by rollup_merge when the summary is merged*/
+#define EXPORT_CHUNK 1024 /*registers copied at a time by exp from the log, the history or the ring buffer*/
+#define EXPORT_BUFFER 65536 /*size of the buffer where exp formats the registers before writing them (bytes)*/
+#define EXPORT_RECORD 24 /*maximum size of a register formatted by exp (bytes)*/
+#define TRANSFER_FILL 80 /*percentage of the ring buffer of the device filled when the scheduler sends the next PTRC*/
+#define TRANSFER_PERIOD 10 /*maximum minutes between two periodic transfers when a NMFL starts them*/
+#define TRANSFER_MIN_DELAY TICKS_PER_SECOND /*minimum ticks to the next PTRC planned (and shortest sample of the rate)*/
+#define TRANSFER_TIMEOUT (2*TICKS_PER_SECOND) /*ticks a bulk transfer can go without a chunk before the chunks are asked again*/
+#define TRANSFER_PROBE (5*TICKS_PER_SECOND) /*maximum ticks to the next PTRC while the rate has not been sampled yet*/
+#define RING_RETRIES 3 /*times an aggregation of the ring buffer is repeated when the writer overwrote registers being read*/
+#define BENCH_REGISTERS (1 << 20) /*registers aggregated by the aggregation benchmark*/
+#define BENCH_CHUNK 38 /*registers written at once by the ring buffer benchmark (one full transfer)*/
+#define BENCH_WINDOWS 100 /*windows queried in each run of the window benchmark*/
+#define LAT_NBUCKETS 25 /*buckets of the latency histograms (bucket k - 2^k to 2^(k+1)-1 microseconds)*/
+#define LAT_FIRST_OPCODE RCLK /*opcodes with a latency histogram go from RCLK to RCLK+LAT_NOPCODES-1*/
+#define LAT_NOPCODES 0x20
+#define LAT_COMMAND 0 /*latency from the command sent to the response printed*/
+#define LAT_RECEIVE 1 /*latency from the frame read from the device to the message in the mailbox*/
 
 #define NCOMMANDS  (sizeof(commands)/sizeof(struct command_d))
 #define ARGVECSIZE 10 /*maximum size of argument*/
 #define MAX_LINE   50 /*maximum size of command line*/
-#define NT 4 /*number of threads*/
+#define NT 5 /*number of threads (besides the receiving and writing threads of each station)*/
 #define PRI 0 /*priority*/
 #define STKSIZE 4096 /*thread stack size*/
 
 void process_message(unsigned char* message, int size);
 void receiveFromSerial(cyg_addrword_t data);
+void cmd_st(int argc, char **argv);
 void cmd_sair (int argc, char **argv);
 void cmd_ems (int argc, char **argv);
 void cmd_emh (int argc, char **argv);
@@ -72,20 +110,51 @@ void cmd_aa (int argc, char **argv);
 void cmd_ir (int argc, char **argv);
 void cmd_trc (int argc, char **argv);
 void cmd_tri (int argc, char **argv);
-void writeToSerial (void);
+void writeToSerial (cyg_addrword_t data);
 void cmd_irl(int argc, char **argv);
 void processingTask(void);
 void alarm_func(cyg_handle_t alarmH, cyg_addrword_t data);
 void cmd_pr(int argc, char **argv);
+void cmd_prd(int argc, char **argv);
 void cmd_dttl(int argc, char **argv);
 void cmd_lr(int argc, char **argv);
+void cmd_exp(int argc, char **argv);
 void cmd_dr(int argc, char **argv);
+void cmd_mrb(int argc, char **argv);
 void cmd_cpt(int argc, char **argv);
 int my_getline (char** argv, int argvsize);
+int split_line (char* line, char** argv, int argvsize);
+void cmd_run(int argc, char **argv);
+void cmd_cap(int argc, char **argv);
+void cmd_rep(int argc, char **argv);
+void capture_record(int direction, unsigned char* data, int size);
 void monitor (void);
 void cmd_mpt(int argc, char **argv);
 void cmd_cttl(int argc, char **argv);
-int bufflen(unsigned char * buff);
+int msg_size(unsigned char* m);
+int msg_station(unsigned char* m);
+void msg_from(unsigned char* m, int s);
+unsigned char* msg_encode(unsigned char opcode, const unsigned char* arguments, int n, int reply);
+void cmd_bench(int argc, char **argv);
+unsigned char* msg_alloc(int size);
+void cmd_pv(int argc, char **argv);
+void cmd_wr(int argc, char **argv);
+void cmd_iq(int argc, char **argv);
+void send_command(int s, unsigned char* m);
+void request_add(int s, unsigned char opcode, int scheduler);
+void send_arguments(unsigned char opcode, int argc, char **argv);
+void replyTask(void);
+void msg_free(unsigned char* m);
+void cmd_imp(int argc, char **argv);
+void cmd_lat(int argc, char **argv);
+void cmd_stats(int argc, char **argv);
+void print_stats(void);
+void mbox_put(cyg_handle_t mbox, void* m);
+cyg_uint64 current_time_us(void);
+void latency_record(int stage, unsigned char opcode, cyg_uint64 start);
+int console_printf(const char* format, ...);
+void consoleTask(void);
+void console_flush(void);
 
 
 /*structure used to store the registers in a ring buffer*/
@@ -98,6 +167,264 @@ typedef struct register_
     unsigned char luminosity;
 } register_;
 
+void print_register(register_* r);
+
+/*aggregation of registers (count, sum, min and max of temperature and luminosity)*/
+typedef struct aggregate_
+{
+    unsigned long count;
+    unsigned long sum_temperature;
+    unsigned long sum_luminosity;
+    unsigned char min_temperature;
+    unsigned char max_temperature;
+    unsigned char min_luminosity;
+    unsigned char max_luminosity;
+} aggregate_;
+
+/*local ring buffer of registers, stored by columns so that pr goes through contiguous arrays of each field*/
+//the columns are split in pages of RING_PAGE registers, so that a ring buffer of millions of registers does not need
+//one huge contiguous allocation
+//there is one writer at a time (ring_buffer_mux) and the readers never lock it: "writing" is advanced before registers are
+//overwritten and "written" after, so a reader can tell when a register changed while it read it
+//registers mostly arrive in time order, so the ring buffer is indexed by runs of registers in time order, where pr
+//finds the registers of its interval by binary search; a new run starts at midnight or with a register out of order
+//the registers found are aggregated from a segment tree of summaries of blocks of RING_BLOCK positions, updated by the
+//writer for each block it writes, so that only the blocks at the ends of the interval are aggregated register by register
+typedef struct ring_buffer_
+{
+    int size; //number of registers
+    int pages; //number of pages of each column (the last one may be smaller)
+    cyg_int32** time; //seconds of the day of each register (60*60*hours + 60*minutes + seconds)
+    unsigned char** temperature; //temperature of each register
+    unsigned char** luminosity; //luminosity of each register
+    volatile cyg_uint32 written; //number of registers written since startup (register k is in position k % size)
+    volatile cyg_uint32 writing; //number of registers written once the write in progress ends
+    cyg_uint32 first; //number of the first register not deleted
+    cyg_uint32 read; //number of the next register not yet read
+    cyg_uint32 run_start[NRUNS]; //number of the first register of each run (run r in position r % NRUNS)
+    volatile cyg_uint32 runs; //number of runs started since startup
+    cyg_int32 last_time; //time of the last register written
+    int leaves; //number of leaves of the summary tree (power of 2, at least one per block)
+    aggregate_* tree; //summary tree (node i has children 2*i and 2*i+1, block b is summarized by leaf "leaves" + b)
+} ring_buffer_;
+
+void aggregate_span(const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity, int n,
+    cyg_int32 lo, cyg_int32 hi, aggregate_* a);
+void aggregate_init(aggregate_* a);
+void aggregate_merge(aggregate_* a, const aggregate_* b);
+cyg_uint32 ring_aggregate(ring_buffer_* rb, cyg_uint32 first, cyg_uint32 count, cyg_int32* lo, cyg_int32* hi, int nranges,
+    aggregate_* a);
+void ring_aggregate_slice(ring_buffer_* rb, cyg_uint32 oldest, cyg_int32 s, cyg_int32 e, cyg_int32 lo, cyg_int32 hi,
+    int sorted, aggregate_* a);
+
+int ring_init(ring_buffer_* rb, int size);
+void ring_free(ring_buffer_* rb);
+int ring_resize(int size);
+ring_buffer_* ring_acquire(void);
+void ring_release(void);
+void ring_span(ring_buffer_* rb, int p, int q, cyg_int32 lo, cyg_int32 hi, aggregate_* a);
+void ring_summarize(ring_buffer_* rb, int p, int q, cyg_int32 lo, cyg_int32 hi, aggregate_* a);
+int ring_get(ring_buffer_* rb, cyg_uint32 k, register_* r);
+int ring_consume(ring_buffer_* rb, int n, cyg_uint32* first);
+cyg_uint32 ring_oldest(ring_buffer_* rb, cyg_uint32 written);
+void ring_bounds(cyg_uint32 oldest, cyg_uint32 written, cyg_uint32 first, cyg_uint32 count, cyg_int32* s, cyg_int32* e);
+int ring_copy(ring_buffer_* rb, cyg_uint32* k, int count, cyg_int32* time, unsigned char* temperature,
+    unsigned char* luminosity);
+
+/*entry of the index of the register log: summary of a block of LOG_BLOCK registers*/
+typedef struct log_block_
+{
+    aggregate_ a; //aggregation of the registers of the block
+    cyg_int32 min_time; //minimum time of the registers of the block
+    cyg_int32 max_time; //maximum time of the registers of the block
+} log_block_;
+
+/*run of registers appended to the register log with consecutive numbers in the ring buffer (a register lost starts another)*/
+typedef struct log_run_
+{
+    cyg_uint32 ring; //number in the ring buffer of the first register of the run
+    cyg_uint32 log; //number in the log of the first register of the run
+} log_run_;
+
+void logTask(void);
+void cmd_log(int argc, char **argv);
+void log_append(void);
+void log_run_add(cyg_uint32 ring, cyg_uint32 n);
+cyg_uint32 log_end(cyg_uint32 oldest);
+int log_get(cyg_uint32 n, register_* r);
+int log_copy(cyg_uint32 n, int count, cyg_int32* time, unsigned char* temperature, unsigned char* luminosity);
+void log_aggregate(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 oldest, aggregate_* a);
+void aggregate_scalar(const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity, int n,
+    cyg_int32 lo, cyg_int32 hi, aggregate_* a);
+
+/*compressed block of the register history*/
+typedef struct hist_block_
+{
+    cyg_uint32 first; //number in the ring buffer of the first register of the block (the others follow without gaps)
+    int count; //number of registers
+    int size; //bytes of code
+    unsigned char* code; //registers coded by hist_encode
+    aggregate_ a; //aggregation of the registers of the block
+    cyg_int32 min_time; //minimum time of the registers of the block
+    cyg_int32 max_time; //maximum time of the registers of the block
+} hist_block_;
+
+void cmd_hist(int argc, char **argv);
+void hist_append(void);
+void hist_print(void);
+cyg_uint32 hist_oldest(cyg_uint32 oldest);
+int hist_get(cyg_uint32 k, register_* r);
+int hist_copy(cyg_uint32 k, int count, cyg_int32* time, unsigned char* temperature, unsigned char* luminosity);
+cyg_uint32 hist_aggregate(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 oldest, aggregate_* a);
+int hist_encode(const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity, int n,
+    unsigned char* code);
+void hist_decode(const unsigned char* code, int n, cyg_int32* time, unsigned char* temperature, unsigned char* luminosity);
+
+/*summary of the registers of one minute, hour or day*/
+typedef struct rollup_
+{
+    cyg_uint32 key; //minute (day*24*60 + minute of the day), hour (day*24 + hour of the day) or day summarized
+    cyg_uint32 first; //number in the ring buffer of the first register
+    aggregate_ a; //aggregation of the registers (count 0 - no register)
+    cyg_int32 min_time; //minimum time of the registers
+    cyg_int32 max_time; //maximum time of the registers
+} rollup_;
+
+void rollup_add(unsigned char* registers, int num_registers, cyg_uint32 k);
+void rollup_skip(cyg_uint32 k);
+void rollup_reset(cyg_uint32 k);
+cyg_uint32 rollup_start(cyg_uint32 oldest, cyg_uint32 written, int bins);
+int rollup_ranges(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_int32* edge_lo, cyg_int32* edge_hi, int* nedges);
+void rollup_aggregate(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 from, aggregate_* a, cyg_uint32* bins);
+int rollup_histograms(void);
+cyg_uint32 ring_histogram(ring_buffer_* rb, cyg_uint32 first, cyg_uint32 count, cyg_int32* lo, cyg_int32* hi, int nranges,
+    cyg_uint32* bins);
+cyg_uint32 hist_histogram(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 oldest, cyg_uint32* bins);
+void log_histogram(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 oldest, cyg_uint32* bins);
+void histogram_span(const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity, int n,
+    cyg_int32 lo, cyg_int32 hi, cyg_uint32* bins);
+int histogram_quantile(const cyg_uint32* bins, unsigned long count, int percent);
+void histogram_print(const cyg_uint32* bins);
+
+/*command sent by the UI that is waiting for its response*/
+typedef struct request_
+{
+    int id; //request ID, given in increasing order (0 - free entry)
+    unsigned char opcode; //opcode of the command, responses are matched to the oldest request with the same opcode
+    int station; //station whose device the command was sent to (MSG_HOST - processing task), as the opcode
+    int scheduler; //TRUE - sent by the scheduler of the periodic transfers, the response goes to the processing task
+    cyg_tick_count_t sent; //time when the command was sent
+    cyg_uint64 sent_us; //time when the command was sent (microseconds)
+    cyg_tick_count_t moved; //time when the command was sent or a command sent before it to the same station was answered
+} request_;
+
+/*state of the frame decoder used by the receiving thread*/
+typedef struct frame_decoder
+{
+    unsigned char buffer[RX_BUFFER_SIZE]; //bytes read from the device and not yet decoded
+    int length; //number of valid bytes in buffer
+    int start; //index of the SOM of the frame being received (-1 if none)
+    int write; //index where the next decoded byte of the frame is stored
+    int version; //protocol version of the frame being received (0 while unknown)
+    int expected; //length announced by a protocol v2 frame
+    int escape; //tells wether the previous byte was ESC
+    void (*deliver)(struct frame_decoder* d, unsigned char* message, int index_eom); //called for every complete frame
+    int station; //station whose device the bytes come from (0 for the replays and benchmarks)
+    cyg_uint64 time_us; //time when the bytes being decoded were read from the device
+    unsigned long frames; //number of frames delivered
+    unsigned long dropped; //number of frames dropped (frame pool exhausted or frame too big)
+    unsigned long malformed; //number of frames with a size the protocol table does not allow or (protocol v2) a wrong length or escape
+} frame_decoder;
+
+/*station: a device with its own receiving and writing threads, frame decoder, sending mailbox and ring buffer*/
+//the registers of station 0 go to the local ring buffer "ring", which also feeds the log, the history, the rollups and
+//the commands that read registers (lr, pr, prd, ...); the other stations keep theirs in a ring buffer of their own
+typedef struct station_
+{
+    cyg_io_handle_t serH; //device handler (0 - not connected)
+    int device; //number of the device (/dev/ser<device>)
+    frame_decoder decoder; //decoder of the frames received from the device
+    cyg_handle_t mbx_sendingH; //mailbox of the messages to write to the device
+    cyg_mbox mbx_sending;
+    ring_buffer_* ring; //ring buffer of the registers of a station other than station 0
+    unsigned long bytes_received; //number of bytes read from the device
+    unsigned long bytes_sent; //number of bytes written to the device
+    unsigned long registers_ingested; //number of registers copied to the ring buffer
+    unsigned long last_registers; //registers ingested when the statistics were last printed
+    volatile int bulk; //TRUE while a bulk transfer is going on
+    int bulk_expected; //sequence number of the next chunk (it goes on across the bulk transfers)
+    int bulk_rewound; //sequence number for which the chunks not acknowledged were asked again (-1 - none)
+    unsigned long bulk_registers; //registers received in the bulk transfer
+    cyg_tick_count_t bulk_last; //time of the last chunk received in order (or of the start of the transfer)
+    unsigned long bulk_chunks; //chunks received in order
+    unsigned long bulk_discarded; //chunks received out of order or twice
+    cyg_handle_t threadsH[2]; //receiving and writing threads (created when the device is first connected)
+    cyg_thread threads[2];
+    char stack[2][STKSIZE];
+} station_;
+
+void station_start(int s);
+
+/*statistics of a mutex*/
+typedef struct lock_stats_
+{
+    unsigned long locks; //number of times the mutex was locked
+    unsigned long contended; //number of times the mutex was already locked by another thread
+    cyg_uint64 wait_us; //total time waiting for the mutex (microseconds)
+    cyg_uint32 max_wait_us; //maximum time waiting for the mutex (microseconds)
+} lock_stats_;
+
+/*statistics of a mailbox*/
+typedef struct mbox_stats_
+{
+    cyg_handle_t* handle; //mailbox
+    const char* name;
+    unsigned long puts; //number of messages put in the mailbox
+    int peak; //maximum number of messages in the mailbox
+} mbox_stats_;
+
+void mutex_lock_counted(cyg_mutex_t* mux, lock_stats_* stats);
+
+/*record of the console queue: text formatted by a thread, written to the console by the console thread*/
+typedef struct console_record_
+{
+    volatile cyg_uint32 sequence; //position p of the queue: p - free for p, p + 1 - text of p ready to be written
+    char text[CONSOLE_RECORD];
+} console_record_;
+
+/*export of registers to a file (command exp)*/
+typedef struct export_
+{
+    FILE* file;
+    int binary; //format (FALSE - CSV, TRUE - binary)
+    int used; //bytes of the buffer not written yet
+    int error; //TRUE if a write failed
+    unsigned long registers; //registers exported
+    unsigned long bytes; //bytes written
+    char buffer[EXPORT_BUFFER];
+} export_;
+
+void export_span(export_* e, const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity,
+    int n, cyg_int32* lo, cyg_int32* hi, int nranges);
+void export_flush(export_* e);
+char* export_number(char* p, int v);
+
+/*scheduler of the periodic transfers (bulk transfers) of station 0, only changed by the processing thread*/
+typedef struct transfer_scheduler_
+{
+    int period; //maximum minutes between two transfers (0 - periodic transfer disabled)
+    int nreg; //registers of the ring buffer of the device (0 - not known yet, asked with IREG)
+    float rate; //estimated registers produced by the device per second
+    unsigned long samples; //samples of the rate taken
+    cyg_tick_count_t empty; //time when the device was last known to have no register to transfer (0 - not known yet)
+    int received; //registers transferred since then
+    int waiting; //TRUE from a BTRC to the end of the bulk transfer
+    cyg_tick_count_t next; //time of the next PTRC (0 - none planned)
+    unsigned long transfers; //bulk transfers started
+    unsigned long idle; //transfers without registers
+    unsigned long timeouts; //times TRANSFER_TIMEOUT expired without a chunk
+} transfer_scheduler_;
+
 
 //list of commands available
 struct 	command_d {
@@ -107,7 +434,8 @@ struct 	command_d {
 } const commands[] = {
     {cmd_sos,  "sos","                 help"},
     {cmd_sair, "sair","                sair"},
-    {cmd_ini,  "ini","<d>              inicializar dispositivo (0/1) ser0/ser1"},
+    {cmd_ini,  "ini","<d>              inicializar dispositivo (0/1) ser0/ser1 for the station selected by st"},
+    {cmd_st,   "st","[<s>]             select station s for the commands to the device/information about the stations"},
     {cmd_rc,   "rc","                  read clock"},
     {cmd_sc,   "sc","<h><m><s>         set clock"},
     {cmd_rtl,  "rtl","                 read temperature and luminosity"},
@@ -121,13 +449,28 @@ struct 	command_d {
     {cmd_trc,  "trc","<n>              transfer n registers from current iread position"},
     {cmd_tri,  "tri","<n><i>           transfer n registers from index i (0 - oldest)"},
     {cmd_irl,  "irl","                 information about local registers (NRBUF, nr, iread, iwrite)"},
-    {cmd_lr,   "lr","<n><i>            list n registers (local memory) from index i (0 - oldest)"},
+    {cmd_pv,   "pv","[<v>]             check/modify protocol version (1 - SOM/EOM, 2 - length and byte stuffing)"},
+    {cmd_wr,   "wr","[<l>]             information about writer (writes, messages per write)/modify linger l (ticks)"},
+    {cmd_imp,  "imp","                 information about message pool (NMSG, in use, high-water, exhausted)"},
+    {cmd_lat,  "lat","[r]               latency of commands and reception per opcode (p50, p99, max)/reset (r)"},
+    {cmd_stats,"stats","[<p>]           statistics of threads, mailboxes and locks/print every p seconds (0 - stop)"},
+    {cmd_iq,   "iq","                  information about requests (in flight, sent, matched, timed out, late)"},
+    {cmd_lr,   "lr","<n><i>            list n registers of station 0 (local memory, history and log) from index i (0 - oldest)"},
+    {cmd_exp,  "exp","<f><c>[<t1>[<t2>]] export registers of station 0 (local memory, history and log) between t1 and t2 to file f (c: csv, bin)"},
     {cmd_dr,   "dr","                  delete registers (local memory)"},
+    {cmd_mrb,  "mrb","<n>              modify size of local memory (registers)"},
+    {cmd_log,  "log","[<d>]            start log of registers in directory d (stop if none), read by lr and pr"},
+    {cmd_hist, "hist","[<k>]           information about compressed history/keep k KB of it (0 - off), read by lr and pr"},
     {cmd_cpt,  "cpt","                 check period of transference"},
-    {cmd_mpt,  "mpt","<p>              modify period of transference (minutes - 0 deactivate)"},
+    {cmd_mpt,  "mpt","<p>              modify period of transference (maximum minutes, shorter as the device fills - 0 deactivate)"},
     {cmd_cttl, "cttl","                check threshold temperature and luminosity for processing"},
     {cmd_dttl, "dttl","<t><l>          define threshold temperature and luminosity for processing"},
-    {cmd_pr,   "pr","[<t1>[<t2>]]      transfer n registers from index i (0 - oldest)"}
+    {cmd_pr,   "pr","[<t1>[<t2>]]      process registers of station 0 (maximum, minimum and mean) between t1 and t2"},
+    {cmd_prd,  "prd","[<t1>[<t2>]]     process registers of station 0 (median, p90, p95, p99 and histogram of temperature and luminosity)"},
+    {cmd_cap,  "cap","[<f>]             start capture of serial traffic to file f (stop if none)"},
+    {cmd_rep,  "rep","<f>[<s>]          replay capture f through the receiving pipeline (s: 1 - recorded speed, 0 - fast)"},
+    {cmd_run,  "run","[<f>[<o>]]        run commands of script f (stdin if none or -), machine-readable output to file o"},
+    {cmd_bench,"bench","<t>[<n>]       run benchmark t n times (dec - frame decoder, ring - ring buffer readers/writer, agg - pr kernels, win - pr windows, hist - history codec, st - 1 to NSTATIONS stations, con - periodic transfer listing)"}
 };
 
 const char TitleMsg[] = "\n Weather Station Control Monitor\n";
@@ -138,12 +481,13 @@ char stack[NT][STKSIZE]; //stack for each thread
 cyg_handle_t threadsH[NT]; //thread handles
 cyg_thread threads[NT]; //threads
 
-cyg_mutex_t ring_buffer_mux;
+cyg_mutex_t ring_buffer_mux; //serializes the writers of the ring buffer (readers never take it)
+cyg_mutex_t ring_read_mux; //serializes the readers that consume registers (writers never take it)
 cyg_mutex_t print_mux;
+cyg_mutex_t request_mux;
+cyg_mutex_t capture_mux;
+cyg_sem_t request_slots; //free entries of the table of requests
 
-//mailbox for sending Task
-cyg_handle_t mbx_sendingTaskH;
-cyg_mbox mbx_sendingTask;
 //mailbox for processing task
 cyg_handle_t mbx_processingTaskH;
 cyg_mbox mbx_processingTask;
@@ -152,25 +496,147 @@ cyg_handle_t mbx_UITaskH;
 cyg_mbox mbx_UITask;
 
 Cyg_ErrNo err;
-cyg_io_handle_t serH; //device handler
-int NRBUF = 100; //size of ring buffer
-register_* RingBuffer;
-int nr = 0; //number of registers with information
-int iwrite = 0; //write index
-int iread = 0; //read index
-int num_unread_registers = 0; //number of not yet read registers (iwrite-iread)
+station_ stations[NSTATIONS]; //devices connected (station 0 at startup)
+station_* station = &stations[0]; //station the commands to the device are sent to (command st)
+ring_buffer_* volatile ring; //local ring buffer of registers (replaced by a new one when it is resized)
+volatile int ring_users = 0; //readers of the ring buffer between ring_acquire and ring_release
+
+unsigned char msg_pool[NMSG][MSG_BLOCK_SIZE]; //blocks of every message exchanged through the mailboxes
+unsigned char msg_pool_size[NMSG]; //size of the message held in each block
+unsigned char msg_pool_station[NMSG]; //station whose device sent the message held in each block (MSG_HOST - none)
+unsigned char* msg_pool_free[NMSG]; //stack of free blocks of the message pool
+int msg_pool_nfree = 0; //number of free blocks in the message pool
+int msg_pool_high_water = 0; //maximum number of blocks in use at the same time
+unsigned long msg_pool_exhausted = 0; //number of allocations that found the pool empty
+int protocol_version = PROTOCOL_VERSION; //frame format used to send messages to the device
+
+request_ requests[NREQUESTS]; //commands waiting for a response
+int request_next_id = 1; //ID of the next request
+int requests_in_flight = 0; //number of requests waiting for a response
+unsigned long requests_sent = 0; //number of commands sent
+unsigned long requests_matched = 0; //number of responses matched to a request
+unsigned long requests_timed_out = 0; //number of requests discarded without response
+unsigned long responses_late = 0; //number of responses without request (late or unsolicited)
+
+FILE* capture_file = NULL; //file where the serial traffic is captured (NULL - no capture)
+cyg_tick_count_t capture_start; //time when the capture started
+
+cyg_mutex_t log_mux; //register log (segment files and index)
+cyg_sem_t log_pending; //posted by the receiving thread when it writes registers to the ring buffer, while the log or the history is on
+char log_dir[LOG_PATH]; //directory of the segment files of the register log
+FILE* log_file = NULL; //segment file where the registers are appended (NULL - log stopped)
+FILE* log_reader = NULL; //segment file open to read registers
+int log_reader_segment; //segment open in log_reader
+cyg_uint32 log_written = 0; //number of registers in the log
+cyg_uint32 log_next = 0; //number in the ring buffer of the next register to append to the log
+unsigned long log_lost = 0; //registers overwritten in the ring buffer before they were appended to the log
+unsigned long log_errors = 0; //times the log was stopped because a record or a segment could not be written
+log_block_* log_index = NULL; //index of the log (entry b - registers b*LOG_BLOCK to (b+1)*LOG_BLOCK-1)
+int log_index_size = 0; //entries allocated for the index of the log
+log_run_ log_runs[LOG_RUNS]; //last runs of registers appended to the log, oldest first
+int log_nruns = 0; //number of runs in log_runs
+
+cyg_mutex_t hist_mux; //compressed register history (blocks and block being filled)
+unsigned long hist_budget = 0; //bytes of memory of the compressed history (0 - history off)
+hist_block_* hist_blocks = NULL; //compressed blocks, oldest first from hist_begin (circular)
+int hist_capacity = 0; //entries allocated for hist_blocks
+int hist_begin = 0; //entry of the oldest block
+int hist_nblocks = 0; //number of blocks
+cyg_int32 hist_time[HIST_BLOCK]; //block being filled, not compressed yet
+unsigned char hist_temperature[HIST_BLOCK];
+unsigned char hist_luminosity[HIST_BLOCK];
+int hist_staged = 0; //registers of the block being filled
+cyg_uint32 hist_next = 0; //number in the ring buffer of the next register to append to the history
+unsigned long hist_memory = 0; //bytes of memory used by the compressed blocks (code and entry)
+unsigned long hist_registers = 0; //registers in the compressed blocks
+unsigned long hist_lost = 0; //registers overwritten in the ring buffer before they were appended to the history
+unsigned long hist_decoded = 0; //registers decoded by lr and pr
+cyg_uint64 hist_decode_us = 0; //time spent decoding them (microseconds)
+const unsigned char* hist_cached = NULL; //code of the last block decoded (kept decoded by hist_load)
+
+cyg_mutex_t rollup_mux; //summaries of the registers per minute, hour and day
+rollup_ rollup_minutes[ROLLUP_MINUTES]; //summary of minute m in entry m % ROLLUP_MINUTES
+rollup_ rollup_hours[ROLLUP_HOURS]; //summary of hour h in entry h % ROLLUP_HOURS
+rollup_ rollup_days[ROLLUP_DAYS]; //summary of day d in entry d % ROLLUP_DAYS
+cyg_uint32 rollup_day = 0; //day of the last register received (days since startup, one more every time the time goes back)
+cyg_int32 rollup_last = 0; //time of the last register received
+cyg_uint32 rollup_minute = 0; //minute (key) of the last register received
+cyg_uint32 rollup_since = 0; //number in the ring buffer of the register after the last one not added to the rollups
+unsigned long rollup_reads = 0; //summaries read by the last pr
+//histograms of the summaries (bins 0 to NBINS-1 - temperature, NBINS to 2*NBINS-1 - luminosity, NULL - not allocated)
+cyg_uint32 (*rollup_minute_bins)[2*NBINS] = NULL;
+cyg_uint32 (*rollup_hour_bins)[2*NBINS] = NULL;
+cyg_uint32 (*rollup_day_bins)[2*NBINS] = NULL;
+cyg_uint32 rollup_binned = 0; //number in the ring buffer of the first register counted in the histograms
+cyg_uint32 prd_bins[2*NBINS]; //histograms of the registers of the last prd (processing thread)
+cyg_uint32 prd_part[2*NBINS]; //histograms of a part of the ring buffer counted by prd
+
+FILE* batch_out = NULL; //stream of the machine-readable records of the batch mode (NULL - interactive mode)
+
+console_record_ console_queue[CONSOLE_RECORDS]; //text waiting for the console thread (position p in p % CONSOLE_RECORDS)
+volatile cyg_uint32 console_head = 0; //position of the next record claimed by a thread that prints
+cyg_uint32 console_tail = 0; //position of the next record written by the console thread
+cyg_sem_t console_pending; //posted for every record ready to be written
+unsigned long console_written = 0; //records written to the console
+unsigned long console_dropped = 0; //records dropped because the queue was full
+int console_peak = 0; //maximum number of records in the queue
+
+/*histogram of the latencies of one opcode*/
+typedef struct latency_
+{
+    unsigned long count; //number of latencies recorded
+    unsigned long buckets[LAT_NBUCKETS]; //bucket k counts the latencies from 2^k to 2^(k+1)-1 microseconds
+    cyg_uint32 max; //maximum latency (microseconds)
+} latency_;
+
+latency_ latencies[2][LAT_NOPCODES]; //histograms of LAT_COMMAND and LAT_RECEIVE per opcode
+cyg_mutex_t lat_mux; //latency histograms (taken last, no other mutex is locked while holding it)
+cyg_mutex_t bench_rb_mux; //serializes the writer of the ring buffer benchmark (and its readers when they lock)
+lock_stats_ print_mux_stats; //statistics of print_mux
+lock_stats_ ring_buffer_mux_stats; //statistics of ring_buffer_mux
+mbox_stats_ mbox_stats[NMBOX] = {{&stations[0].mbx_sendingH, "SENDING"}, {&mbx_processingTaskH, "PROCESSING"}, {&mbx_UITaskH, "UI"}};
+int stats_period = 0; //seconds between two prints of the statistics by the reply thread (0 - no periodic print)
+cyg_tick_count_t stats_last = 0; //time when the statistics were last printed
+
+int writer_linger = 0; //ticks the writer waits for more messages before writing (0 - no wait)
+unsigned long writer_writes = 0; //number of writes to the device
+unsigned long writer_messages = 0; //number of messages written to the device
+unsigned long writer_batches[WRITER_NBATCH]; //number of writes with 1, 2, ... messages
+
+transfer_scheduler_ scheduler; //scheduler of the periodic transfers of station 0
 
 
 int main(void)
 {
+    int i;
+
     //create ring buffer
-    RingBuffer = (register_*)malloc(sizeof(register_)*NRBUF);
+    ring = (ring_buffer_*)malloc(sizeof(ring_buffer_));
+    ring_init(ring, NRBUF);
 
     cyg_mutex_init(&ring_buffer_mux);
+    cyg_mutex_init(&ring_read_mux);
     cyg_mutex_init(&print_mux);
+    cyg_mutex_init(&request_mux);
+    cyg_mutex_init(&capture_mux);
+    cyg_mutex_init(&log_mux);
+    cyg_mutex_init(&hist_mux);
+    cyg_mutex_init(&rollup_mux);
+    cyg_mutex_init(&lat_mux);
+    cyg_mutex_init(&bench_rb_mux);
+    cyg_semaphore_init(&log_pending, 0);
+    cyg_semaphore_init(&request_slots, NREQUESTS);
+    cyg_semaphore_init(&console_pending, 0);
+    for(i = 0; i < CONSOLE_RECORDS; i++)
+        console_queue[i].sequence = i;
+
+    //fill message pool
+    for(msg_pool_nfree = 0; msg_pool_nfree < NMSG; msg_pool_nfree++)
+        msg_pool_free[msg_pool_nfree] = msg_pool[msg_pool_nfree];
 
     //create mailboxes
-    cyg_mbox_create( &mbx_sendingTaskH, &mbx_sendingTask);
+    for(i = 0; i < NSTATIONS; i++)
+        cyg_mbox_create( &stations[i].mbx_sendingH, &stations[i].mbx_sending);
     cyg_mbox_create( &mbx_processingTaskH, &mbx_processingTask);
     cyg_mbox_create( &mbx_UITaskH, &mbx_UITask);
 
@@ -179,20 +645,24 @@ int main(void)
     "ProcessingThread", (void *) stack[0], STKSIZE,
     &threadsH[0], &threads[0]);
 
-    cyg_thread_create(PRI+1, (cyg_thread_entry_t*)writeToSerial, (cyg_addrword_t) 0,
-    "WriteThread", (void *) stack[1], STKSIZE,
+    cyg_thread_create(PRI+3, (cyg_thread_entry_t*)monitor, (cyg_addrword_t) 0,
+    "UIThread", (void *) stack[1], STKSIZE,
     &threadsH[1], &threads[1]);
 
-    cyg_thread_create(PRI+2, (cyg_thread_entry_t*)receiveFromSerial, (cyg_addrword_t) 0,
-    "ReceivingThread", (void *) stack[2], STKSIZE,
+    cyg_thread_create(PRI+3, (cyg_thread_entry_t*)replyTask, (cyg_addrword_t) 0,
+    "ReplyThread", (void *) stack[2], STKSIZE,
     &threadsH[2], &threads[2]);
 
-    cyg_thread_create(PRI+3, (cyg_thread_entry_t*)monitor, (cyg_addrword_t) 0,
-    "UIThread", (void *) stack[3], STKSIZE,
+    cyg_thread_create(PRI+4, (cyg_thread_entry_t*)logTask, (cyg_addrword_t) 0,
+    "LogThread", (void *) stack[3], STKSIZE,
     &threadsH[3], &threads[3]);
 
+    cyg_thread_create(PRI+5, (cyg_thread_entry_t*)consoleTask, (cyg_addrword_t) 0,
+    "ConsoleThread", (void *) stack[4], STKSIZE,
+    &threadsH[4], &threads[4]);
+
 
-    //initiate device
+    //initiate device of station 0 (starts its receiving and writing threads)
     cmd_ini(0, NULL);
 
     //start threads
@@ -200,6 +670,7 @@ int main(void)
     cyg_thread_resume(threadsH[1]);
     cyg_thread_resume(threadsH[2]);
     cyg_thread_resume(threadsH[3]);
+    cyg_thread_resume(threadsH[4]);
 
     return 0;
 }
@@ -212,12 +683,12 @@ void monitor (void)
     static char *argv[ARGVECSIZE+1], *p;
     int argc, i;
 
-    cyg_mutex_lock(&print_mux);
-    printf("%s Type sos for help\n", TitleMsg);
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("%s Type sos for help\n", TitleMsg);
     cyg_mutex_unlock(&print_mux);
     for (;;) {
-        cyg_mutex_lock(&print_mux);
-        printf("\nCmd> ");
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("\nCmd> ");
         cyg_mutex_unlock(&print_mux);
         /* Reading and parsing command line  ----------------------------------*/
         if ((argc = my_getline(argv, ARGVECSIZE)) > 0) {
@@ -226,35 +697,238 @@ void monitor (void)
             if (strcmp(argv[0], commands[i].cmd_name) == 0)
             break;
             /* Executing commands -----------------------------------------------*/
+            //commands do not wait for the response, which is matched and printed by the reply thread
             if (i < NCOMMANDS)
+                commands[i].cmd_fnct (argc, argv); //execute function corresponding to command typed
+            else
             {
-                unsigned char* m;
+                mutex_lock_counted(&print_mux, &print_mux_stats);
+                console_printf("%s", InvalMsg);
+                cyg_mutex_unlock(&print_mux);
+            }
+        } /* if my_getline */
+    } /* forever */
 
-                //empty mailbox
-                do {
-                    m = cyg_mbox_tryget(mbx_UITaskH);
-                } while(m != NULL);
+}
 
-                commands[i].cmd_fnct (argc, argv); //execute function corresponding to command typed
+/*-------------------------------------------------------------------------+
+| Function: send_command   (called from the cmd_* functions)
++--------------------------------------------------------------------------*/
+//register command m as a request waiting for a response and send it to the communication task of station s or to
+//the processing task (s is MSG_HOST)
+void send_command(int s, unsigned char* m)
+{
+    cyg_semaphore_wait(&request_slots); //wait for a free entry in the table of requests
+    request_add(s, m[1], FALSE);
+    mbox_put(s == MSG_HOST ? mbx_processingTaskH : stations[s].mbx_sendingH, (void*)m);
+}
 
-                m = cyg_mbox_timed_get(mbx_UITaskH, cyg_current_time()+TIMEOUT); //get response of command from mailbox with timeout
+//add to the table of requests a command with "opcode" sent to station s (the caller took a free entry from request_slots)
+void request_add(int s, unsigned char opcode, int scheduler)
+{
+    int i;
+    cyg_mutex_lock(&request_mux);
+    for(i = 0; requests[i].id != 0; i++)
+    {}
+    requests[i].id = request_next_id++;
+    requests[i].opcode = opcode;
+    requests[i].station = s;
+    requests[i].scheduler = scheduler;
+    requests[i].sent = requests[i].moved = cyg_current_time();
+    requests[i].sent_us = current_time_us();
+    requests_in_flight++;
+    requests_sent++;
+    cyg_mutex_unlock(&request_mux);
+}
 
-                if(m)
-                {
-                    process_message(m, bufflen(m)); //process message received
-                    free(m);
-                }
+//send the command with "opcode" and the arguments of the command line (argv[1] ... argv[argc-1]) to the device of the
+//selected station or to the processing task, as the protocol table says
+void send_arguments(unsigned char opcode, int argc, char **argv)
+{
+    unsigned char arguments[ARGVECSIZE];
+    unsigned char* m;
+    int i;
+    if (!protocol_valid(opcode, argc - 1, FALSE)) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    for(i = 1; i < argc; i++)
+        arguments[i-1] = atoi(argv[i]);
+    if((m = msg_encode(opcode, arguments, argc - 1, FALSE)) != NULL)
+        send_command(protocol_where(opcode) == PROTOCOL_DEVICE ? (int)(station - stations) : MSG_HOST, m);
+}
+
+//remove from the table of requests the oldest request with the given opcode sent to station s and copy it to "request"
+//the requests sent after it to station s, queued behind it, wait for TIMEOUT from now
+//returns FALSE if there is no such request
+int match_request(unsigned char opcode, int s, request_* request)
+{
+    int i;
+    int oldest = -1;
+    cyg_tick_count_t now = cyg_current_time();
+    cyg_mutex_lock(&request_mux);
+    for(i = 0; i < NREQUESTS; i++)
+        if(requests[i].id != 0 && requests[i].opcode == opcode && requests[i].station == s &&
+            (oldest < 0 || requests[i].id < requests[oldest].id))
+            oldest = i;
+    if(oldest >= 0)
+    {
+        *request = requests[oldest];
+        requests[oldest].id = 0;
+        requests_in_flight--;
+        requests_matched++;
+        cyg_semaphore_post(&request_slots);
+        for(i = 0; i < NREQUESTS; i++)
+            if(requests[i].id > request->id && requests[i].station == s)
+                requests[i].moved = now;
+    }
+    else
+        responses_late++;
+    cyg_mutex_unlock(&request_mux);
+    return oldest >= 0;
+}
+
+//discard the requests that did not get a response for TIMEOUT
+//each request times out on its own: the time counts from when it was sent, or from the last response to a request
+//sent before it to the same station, so that requests queued behind slow ones survive while the ones before them
+//are answered (responses to later requests or to other stations do not keep a lost request)
+void expire_requests(void)
+{
+    int i;
+    cyg_tick_count_t now = cyg_current_time();
+    cyg_mutex_lock(&request_mux);
+    for(i = 0; i < NREQUESTS; i++)
+    {
+        if(requests[i].id != 0 && now - requests[i].moved > TIMEOUT)
+        {
+            if(batch_out && !requests[i].scheduler)
+            {
+                mutex_lock_counted(&print_mux, &print_mux_stats);
+                fprintf(batch_out, "TMO %d %d\n", requests[i].id, requests[i].opcode);
+                cyg_mutex_unlock(&print_mux);
+            }
+            requests[i].id = 0;
+            requests_in_flight--;
+            requests_timed_out++;
+            cyg_semaphore_post(&request_slots);
+        }
+    }
+    cyg_mutex_unlock(&request_mux);
+}
 
+/*-------------------------------------------------------------------------+
+| Function: replyTask      (executed in reply thread)
++--------------------------------------------------------------------------*/
+//match the responses of the commands as they arrive and print them
+void replyTask(void)
+{
+    request_ request;
+    unsigned char* m;
+    int i;
+    for (;;) {
+        m = cyg_mbox_timed_get(mbx_UITaskH, cyg_current_time()+TIMEOUT); //get response of command from mailbox with timeout
+        if(m)
+        {
+            if(!match_request(m[1], msg_station(m), &request))
+                request.id = 0;
+            if(request.id && request.scheduler) //response to the scheduler of the periodic transfers
+            {
+                mbox_put(mbx_processingTaskH, m);
+                m = NULL;
             }
-            else
+            else if(batch_out) //machine-readable record: request ID, opcode, ticks since the request, arguments
             {
-                cyg_mutex_lock(&print_mux);
-                printf("%s", InvalMsg);
+                mutex_lock_counted(&print_mux, &print_mux_stats);
+                fprintf(batch_out, "RSP %d %d %d", request.id, m[1], request.id ? (int)(cyg_current_time() - request.sent) : -1);
+                for(i = 2; i < msg_size(m) - 1; i++)
+                    fprintf(batch_out, " %d", m[i]);
+                fprintf(batch_out, "\n");
                 cyg_mutex_unlock(&print_mux);
             }
-        } /* if my_getline */
-    } /* forever */
+            else
+                process_message(m, msg_size(m)); //process message received
+            if(m != NULL)
+            {
+                if(request.id)
+                    latency_record(LAT_COMMAND, m[1], request.sent_us);
+                msg_free(m);
+            }
+        }
+        expire_requests();
+        if(stats_period > 0 && cyg_current_time() - stats_last >= stats_period*TICKS_PER_SECOND)
+            print_stats();
+    }
+}
+
+/*-------------------------------------------------------------------------+
+| Function: consoleTask    (executed in console thread)
++--------------------------------------------------------------------------*/
+//the threads never write to the console: console_printf formats the text in a record of the console queue and the
+//console thread, the one with the lowest priority, writes the records in order, so that a slow console does not hold
+//back the receiving and processing threads
+//the queue is lock-free for the threads that print: a record is claimed by moving console_head forward with a
+//compare and swap, and it is ready when its sequence says so; the threads still take print_mux so that the records of
+//a response are not mixed with those of another, but they only wait for each other to format text
+//when the queue is full the record is dropped and counted
+
+//format a record and queue it for the console thread (the arguments of printf)
+//returns the number of characters of the text, -1 if it was dropped
+int console_printf(const char* format, ...)
+{
+    console_record_* r;
+    cyg_uint32 pos;
+    va_list args;
+    int n;
+    for(;;)
+    {
+        pos = console_head;
+        r = &console_queue[pos % CONSOLE_RECORDS];
+        if((cyg_int32)(r->sequence - pos) < 0) //record of the previous lap not written yet
+        {
+            __sync_fetch_and_add(&console_dropped, 1);
+            return -1;
+        }
+        if(r->sequence == pos && __sync_bool_compare_and_swap(&console_head, pos, pos + 1))
+            break;
+    }
+    if((int)(pos + 1 - console_tail) > console_peak)
+        console_peak = pos + 1 - console_tail;
+    va_start(args, format);
+    n = vsnprintf(r->text, CONSOLE_RECORD, format, args);
+    va_end(args);
+    __sync_synchronize();
+    r->sequence = pos + 1; //ready
+    cyg_semaphore_post(&console_pending);
+    return n;
+}
+
+//thread that writes the records of the console queue to the console in the order they were claimed
+void consoleTask(void)
+{
+    console_record_* r;
+    for(;;)
+    {
+        cyg_semaphore_wait(&console_pending);
+        r = &console_queue[console_tail % CONSOLE_RECORDS];
+        while(r->sequence != console_tail + 1) //claimed before the record posted, and still being formatted
+            cyg_thread_delay(1);
+        fputs(r->text, stdout);
+        __sync_synchronize();
+        r->sequence = console_tail + CONSOLE_RECORDS; //free for the next lap
+        console_tail++;
+        console_written++;
+        if(console_head == console_tail)
+            fflush(stdout);
+    }
+}
 
+//wait until the console thread wrote every record queued
+void console_flush(void)
+{
+    while(console_tail != console_head)
+        cyg_thread_delay(1);
 }
 
 /*-------------------------------------------------------------------------+
@@ -263,11 +937,23 @@ void monitor (void)
 int my_getline (char** argv, int argvsize)
 {
     static char line[MAX_LINE];
+
+    if(fgets(line, MAX_LINE, stdin) == NULL) //end of input, nothing to read
+    {
+        cyg_thread_delay(TIMEOUT);
+        return 0;
+    }
+    return split_line(line, argv, argvsize);
+}
+
+/*-------------------------------------------------------------------------+
+| Function: split_line     (called from my_getline and cmd_run)
++--------------------------------------------------------------------------*/
+int split_line (char* line, char** argv, int argvsize)
+{
     char *p;
     int argc;
 
-    fgets(line, MAX_LINE, stdin);
-
     /* Break command line into an o.s. like argument vector,
     i.e. compliant with the (int argc, char **argv) specification --------*/
 
@@ -286,115 +972,121 @@ void process_message(unsigned char* message, int size)
 {
     if(message[0] != SOM) //messages must start with SOM
     return;
-    cyg_mutex_lock(&print_mux);
+    mutex_lock_counted(&print_mux, &print_mux_stats);
     switch(message[1]) //next comes the command code
     {
         case RCLK:
             if(message[2] == CMD_ERROR)
-                printf("READ CLOCK: ERROR\n");
+                console_printf("READ CLOCK: ERROR\n");
             else
-                printf("READ CLOCK: Hours - %d, Minutes - %d, Seconds - %d\n", message[2], message[3], message[4]);
+                console_printf("READ CLOCK: Hours - %d, Minutes - %d, Seconds - %d\n", message[2], message[3], message[4]);
             break;
         case SCLK:
             if(message[2] == CMD_OK)
-                printf("SET CLOCK: OK\n");
+                console_printf("SET CLOCK: OK\n");
             else if(message[2] == CMD_ERROR)
-                printf("SET CLOCK: ERROR\n");
+                console_printf("SET CLOCK: ERROR\n");
             break;
         case RTL:
             if(message[2] == CMD_ERROR)
-                printf("READ TEMPERATURE AND LUMINOSITY: ERROR\n");
+                console_printf("READ TEMPERATURE AND LUMINOSITY: ERROR\n");
             else
-                printf("READ TEMPERATURE AND LUMINOSITY: Temperature - %d, Luminosity - %d\n", message[2], message[3]);
+                console_printf("READ TEMPERATURE AND LUMINOSITY: Temperature - %d, Luminosity - %d\n", message[2], message[3]);
             break;
         case RPAR:
             if(message[2] == CMD_ERROR)
-                printf("READ PARAMETERS: ERROR\n");
+                console_printf("READ PARAMETERS: ERROR\n");
             else
-                printf("READ PARAMETERS: PMON - %d, TALA - %d\n", message[2], message[3]);
+                console_printf("READ PARAMETERS: PMON - %d, TALA - %d\n", message[2], message[3]);
             break;
         case MMP:
             if(message[2] == CMD_OK)
-                printf("MODIFY MONITORING PERIOD: OK\n");
+                console_printf("MODIFY MONITORING PERIOD: OK\n");
             else if(message[2] == CMD_ERROR)
-                printf("MODIFY MONITORING PERIOD: ERROR\n");
+                console_printf("MODIFY MONITORING PERIOD: ERROR\n");
             break;
         case MTA:
             if(message[2] == CMD_OK)
-                printf("MODIFY TIME ALARM: OK\n");
+                console_printf("MODIFY TIME ALARM: OK\n");
             else if(message[2] == CMD_ERROR)
-                printf("MODIFY TIME ALARM: ERROR\n");
+                console_printf("MODIFY TIME ALARM: ERROR\n");
             break;
         case RALA:
             if(message[2] == CMD_ERROR)
-                printf("READ ALARMS: ERROR\n");
+                console_printf("READ ALARMS: ERROR\n");
             else
-                printf("READ ALARMS: TEMPERATURE - %d, LUMINOSITY - %d, ACTIVE/INACTIVE - %d\n", message[2], message[3], message[4]);
+                console_printf("READ ALARMS: TEMPERATURE - %d, LUMINOSITY - %d, ACTIVE/INACTIVE - %d\n", message[2], message[3], message[4]);
             break;
         case DATL:
             if(message[2] == CMD_OK)
-                printf("DEFINE ALARM TEMPERATURE AND LUMINOSITY: OK\n");
+                console_printf("DEFINE ALARM TEMPERATURE AND LUMINOSITY: OK\n");
             else if(message[2] == CMD_ERROR)
-                printf("DEFINE ALARM TEMPERATURE AND LUMINOSITY: ERROR\n");
+                console_printf("DEFINE ALARM TEMPERATURE AND LUMINOSITY: ERROR\n");
             break;
         case AALA:
             if(message[2] == CMD_OK)
-                printf("ACTIVATE/DEACTIVATE ALARMS: OK\n");
+                console_printf("ACTIVATE/DEACTIVATE ALARMS: OK\n");
             else if(message[2] == CMD_ERROR)
-                printf("ACTIVATE/DEACTIVATE ALARMS: ERROR\n");
+                console_printf("ACTIVATE/DEACTIVATE ALARMS: ERROR\n");
             break;
         case IREG:
             if(message[2] == CMD_ERROR)
-                printf("INFORMATION ABOUT REGISTERS: ERROR\n");
+                console_printf("INFORMATION ABOUT REGISTERS: ERROR\n");
             else
             {
-                printf("INFORMATION ABOUT REGISTERS: NREG - %d, nr - %d, iread - %d, iwrite - %d\n", message[2], message[3], message[4], message[5]);
+                console_printf("INFORMATION ABOUT REGISTERS: NREG - %d, nr - %d, iread - %d, iwrite - %d\n", message[2], message[3], message[4], message[5]);
             }
             break;
         case TRGC:
             if(message[2] == CMD_OK)
-                printf("TRANSFERED REGISTERS FROM CURRENT IREAD POSITION: OK\n");
+                console_printf("TRANSFERED REGISTERS FROM CURRENT IREAD POSITION: OK\n");
             else if(message[2] == CMD_ERROR)
-                printf("TRANSFERED REGISTERS FROM CURRENT IREAD POSITION: ERROR\n");
+                console_printf("TRANSFERED REGISTERS FROM CURRENT IREAD POSITION: ERROR\n");
             break;
         case TRGI:
             if(message[2] == CMD_OK)
-                printf("TRANSFERED REGISTERS FROM INDEX i: OK\n");
+                console_printf("TRANSFERED REGISTERS FROM INDEX i: OK\n");
             else if(message[2] == CMD_ERROR)
-                printf("TRANSFERED REGISTERS FROM INDEX i: ERROR\n");
+                console_printf("TRANSFERED REGISTERS FROM INDEX i: ERROR\n");
             break;
 
         case CPT:
             if(message[2] == CMD_ERROR)
-                printf("CHECK PERIOD OF TRANSFERENCE: ERROR\n");
+                console_printf("CHECK PERIOD OF TRANSFERENCE: ERROR\n");
             else if(message[2] == 0)
-                printf("CHECK PERIOD OF TRANSFERENCE: DISABLED\n");
+                console_printf("CHECK PERIOD OF TRANSFERENCE: DISABLED\n");
             else
-                printf("CHECK PERIOD OF TRANSFERENCE: %d minutes\n", message[2]);
+                console_printf("CHECK PERIOD OF TRANSFERENCE: %d minutes\n", message[2]);
             break;
         case MPT:
             if(message[2] == CMD_ERROR)
-                printf("MODIFY PERIOD OF TRANSFERENCE: ERROR\n");
+                console_printf("MODIFY PERIOD OF TRANSFERENCE: ERROR\n");
             else if(message[2] == CMD_OK)
-                printf("MODIFY PERIOD OF TRANSFERENCE: OK\n");
+                console_printf("MODIFY PERIOD OF TRANSFERENCE: OK\n");
             break;
         case CTTL:
             if(message[2] == CMD_ERROR)
-                printf("CHECK THRESHOLD TEMPERATURE AND LUMINOSITY FOR PROCESSING: ERROR\n");
+                console_printf("CHECK THRESHOLD TEMPERATURE AND LUMINOSITY FOR PROCESSING: ERROR\n");
             else
-                printf("CHECK THRESHOLD TEMPERATURE - %d - AND LUMINOSITY - %d - FOR PROCESSING\n", message[2], message[3]);
+                console_printf("CHECK THRESHOLD TEMPERATURE - %d - AND LUMINOSITY - %d - FOR PROCESSING\n", message[2], message[3]);
             break;
         case DTTL:
             if(message[2] == CMD_ERROR)
-                printf("DEFINE THRESHOLD TEMPERATURE AND LUMINOSITY FOR PROCESSING: ERROR\n");
+                console_printf("DEFINE THRESHOLD TEMPERATURE AND LUMINOSITY FOR PROCESSING: ERROR\n");
             else if(message[2] == CMD_OK)
-                printf("DEFINE THRESHOLD TEMPERATURE AND LUMINOSITY FOR PROCESSING: OK\n");
+                console_printf("DEFINE THRESHOLD TEMPERATURE AND LUMINOSITY FOR PROCESSING: OK\n");
             break;
         case PR:
             if(message[2] == CMD_ERROR)
-                printf("PROCESS REGISTERS BETWEEN INSTANTS T1 AND T2: ERROR\n");
+                console_printf("PROCESS REGISTERS BETWEEN INSTANTS T1 AND T2: ERROR\n");
+            else
+                console_printf("PROCESS REGISTERS BETWEEN INSTANTS T1 AND T2: TEMPERATURE - MAX %d - MIN %d - MEAN %d; LUMINOSITY - MAX %d - MIN %d - MEAN %d\n", message[2], message[3], message[4], message[5], message[6], message[7]);
+            break;
+        case PRD:
+            if(message[2] == CMD_ERROR && size == 4)
+                console_printf("PROCESS REGISTERS BETWEEN INSTANTS T1 AND T2: ERROR\n");
             else
-                printf("PROCESS REGISTERS BETWEEN INSTANTS T1 AND T2: TEMPERATURE - MAX %d - MIN %d - MEAN %d; LUMINOSITY - MAX %d - MIN %d - MEAN %d\n", message[2], message[3], message[4], message[5], message[6], message[7]);
+                console_printf("PROCESS REGISTERS BETWEEN INSTANTS T1 AND T2: TEMPERATURE - MEDIAN %d - P90 %d - P95 %d - P99 %d; LUMINOSITY - MEDIAN %d - P90 %d - P95 %d - P99 %d\n", message[2], message[3], message[4], message[5], message[6], message[7], message[8], message[9]);
             break;
 
     }
@@ -406,932 +1098,4437 @@ void process_message(unsigned char* message, int size)
 +--------------------------------------------------------------------------*/
 void cmd_sair (int argc, char **argv)
 {
+    console_flush();
     exit(0);
 }
 
 /*-------------------------------------------------------------------------+
 | Function: cmd_ini - inicializar dispositivo
 +--------------------------------------------------------------------------*/
+//open device d for the station selected by st (a device is open by one station at a time)
+//the receiving and writing threads of the station are started the first time it gets a device
 void cmd_ini(int argc, char **argv)
 {
-    cyg_mutex_lock(&print_mux);
-    printf("io_lookup\n");
+    char name[24];
+    cyg_io_handle_t h;
+    int d = (argc > 1) ? atoi(argv[1]) : 0;
+    int s = station - stations;
+    int i;
+    if(d < 0)
+    {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    for(i = 0; i < NSTATIONS; i++)
+    {
+        if(i != s && stations[i].serH != 0 && stations[i].device == d)
+        {
+            mutex_lock_counted(&print_mux, &print_mux_stats);
+            console_printf("DEVICE %d IN USE BY STATION %d\n", d, i);
+            cyg_mutex_unlock(&print_mux);
+            return;
+        }
+    }
+    if(s > 0 && station->ring == NULL)
+    {
+        station->ring = (ring_buffer_*)malloc(sizeof(ring_buffer_));
+        if(station->ring == NULL || !ring_init(station->ring, NRBUF))
+        {
+            if(station->ring != NULL)
+                ring_free(station->ring);
+            free(station->ring);
+            station->ring = NULL;
+            mutex_lock_counted(&print_mux, &print_mux_stats);
+            console_printf("STATION %d: NOT ENOUGH MEMORY\n", s);
+            cyg_mutex_unlock(&print_mux);
+            return;
+        }
+    }
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("io_lookup\n");
     cyg_mutex_unlock(&print_mux);
-    if ((argc > 1) && (argv[1][0] = '1'))
-    err = cyg_io_lookup("/dev/ser1", &serH);
-    else err = cyg_io_lookup("/dev/ser0", &serH);
-    cyg_mutex_lock(&print_mux);
-    printf("lookup err=%x\n", err);
+    snprintf(name, sizeof(name), "/dev/ser%d", d);
+    err = cyg_io_lookup(name, &h);
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("lookup err=%x\n", err);
     cyg_mutex_unlock(&print_mux);
+    if(err != ENOERR)
+        return;
+    station->device = d;
+    if(station->serH == 0)
+    {
+        station->serH = h;
+        station_start(s);
+    }
+    else
+        station->serH = h;
 }
 
-//send to communication task the command rc (read clock)
-void cmd_rc(int argc, char **argv)
+//create and start the receiving and writing threads of station s
+void station_start(int s)
 {
+    cyg_thread_create(PRI+1, (cyg_thread_entry_t*)writeToSerial, (cyg_addrword_t) s,
+    "WriteThread", (void *) stations[s].stack[0], STKSIZE,
+    &stations[s].threadsH[0], &stations[s].threads[0]);
 
-    if (argc == 1) {
-        unsigned char* buffer=(unsigned char*)malloc(3*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=RCLK;
-        buffer[2]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
+    cyg_thread_create(PRI+2, (cyg_thread_entry_t*)receiveFromSerial, (cyg_addrword_t) s,
+    "ReceivingThread", (void *) stations[s].stack[1], STKSIZE,
+    &stations[s].threadsH[1], &stations[s].threads[1]);
+
+    cyg_thread_resume(stations[s].threadsH[0]);
+    cyg_thread_resume(stations[s].threadsH[1]);
+}
+
+//execute the command st (select station s for the commands to the device/information about the stations)
+//the registers per second are counted since the last st, so that the ingestion of all the stations can be compared
+//with the number of stations connected
+void cmd_st(int argc, char **argv)
+{
+    static cyg_tick_count_t last = 0;
+    cyg_tick_count_t now = cyg_current_time();
+    unsigned long registers, rate, total = 0, total_rate = 0;
+    ring_buffer_* rb;
+    int i, n;
+    if (argc == 2 && atoi(argv[1]) >= 0 && atoi(argv[1]) < NSTATIONS) {
+        station = &stations[atoi(argv[1])];
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("SELECT STATION: OK%s\n", station->serH ? "" : " (NOT CONNECTED, INI CONNECTS IT)");
+        cyg_mutex_unlock(&print_mux);
+    }
+    else if (argc == 1) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        for(i = 0; i < NSTATIONS; i++)
+        {
+            if(stations[i].serH == 0)
+            {
+                console_printf("STATION %d%s: NOT CONNECTED\n", i, &stations[i] == station ? " (SELECTED)" : "");
+                continue;
+            }
+            rb = (i == 0) ? ring_acquire() : stations[i].ring;
+            n = (int)(rb->written - ring_oldest(rb, rb->written));
+            if(i == 0)
+                ring_release();
+            registers = stations[i].registers_ingested;
+            rate = (last && now > last) ? (registers - stations[i].last_registers)*TICKS_PER_SECOND/(unsigned long)(now - last) : 0;
+            console_printf("STATION %d%s: device - /dev/ser%d, bytes in - %lu, out - %lu, frames - %lu, dropped - %lu, "
+                "registers - %lu (%d in ring buffer), per second - %lu\n", i, &stations[i] == station ? " (SELECTED)" : "",
+                stations[i].device, stations[i].bytes_received, stations[i].bytes_sent, stations[i].decoder.frames,
+                stations[i].decoder.dropped, registers, n, rate);
+            stations[i].last_registers = registers;
+            total += registers;
+            total_rate += rate;
+        }
+        console_printf("ALL STATIONS: registers - %lu, per second - %lu\n", total, total_rate);
+        cyg_mutex_unlock(&print_mux);
+        last = now;
     }
     else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
         cyg_mutex_unlock(&print_mux);
     }
 }
 
+//send to communication task the command rc (read clock)
+void cmd_rc(int argc, char **argv)
+{
+    send_arguments(RCLK, argc, argv);
+}
+
 //send to communication task the command sc (set clock)
 void cmd_sc(int argc, char **argv)
 {
-
-    if (argc == 4) {
-        unsigned char* buffer = (unsigned char*)malloc(6*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=SCLK;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=atoi(argv[2]);
-        buffer[4]=atoi(argv[3]);
-        buffer[5]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(SCLK, argc, argv);
 }
 
 //send to communication task the command rc (read temperature and luminosity)
 void cmd_rtl(int argc, char **argv)
 {
-
-    if (argc == 1) {
-        unsigned char* buffer=(unsigned char*)malloc(3*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=RTL;
-        buffer[2]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(RTL, argc, argv);
 }
 
 //send to communication task the command rp (read parameters)
 void cmd_rp(int argc, char **argv)
 {
-
-    if (argc == 1) {
-        unsigned char* buffer=(unsigned char*)malloc(3*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=RPAR;
-        buffer[2]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(RPAR, argc, argv);
 }
 
 //send to communication task the command mmp (modify monitoring period)
 void cmd_mmp(int argc, char **argv)
 {
-
-    if (argc == 2) {
-        unsigned char* buffer=(unsigned char*)malloc(4*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=MMP;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(MMP, argc, argv);
 }
 
 //send to communication task the command mta (modify time alarm)
 void cmd_mta(int argc, char **argv)
 {
-
-    if (argc == 2) {
-        unsigned char* buffer=(unsigned char*)malloc(4*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=MTA;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(MTA, argc, argv);
 }
 
 //send to communication task the command ra (read alarms)
 void cmd_ra(int argc, char **argv)
 {
-
-    if (argc == 1) {
-        unsigned char* buffer=(unsigned char*)malloc(3*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=RALA;
-        buffer[2]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(RALA, argc, argv);
 }
 
 //send to communication task the command dtl (define alarm temperature and luminosity)
 void cmd_dtl(int argc, char **argv)
 {
-
-    if (argc == 3) {
-        unsigned char* buffer=(unsigned char*)malloc(5*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=DATL;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=atoi(argv[2]);
-        buffer[4]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(DATL, argc, argv);
 }
 
 //send to communication task the command aa (activate/deactivate alarm)
 void cmd_aa(int argc, char **argv)
 {
-
-    if (argc == 2) {
-        unsigned char* buffer=(unsigned char*)malloc(4*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=AALA;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(AALA, argc, argv);
 }
 
 //send to communication task the command ir (information about registers)
 void cmd_ir(int argc, char **argv)
 {
-
-    if (argc == 1) {
-        unsigned char* buffer=(unsigned char*)malloc(3*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=IREG;
-        buffer[2]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(IREG, argc, argv);
 }
 
 //send to communication task the command trc (transfer n registers from current iread position)
 void cmd_trc(int argc, char **argv)
 {
-
-    if (argc == 2) {
-        unsigned char* buffer = (unsigned char*)malloc(4*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=TRGC;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(TRGC, argc, argv);
 }
 
 //send to communication task the command tri (transfer n registers from index i (0 - oldest))
 void cmd_tri(int argc, char **argv)
 {
-
-    if (argc == 3) {
-        unsigned char* buffer=(unsigned char*)malloc(5*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=TRGI;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=atoi(argv[2]);
-        buffer[4]=EOM;
-        cyg_mbox_put(mbx_sendingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    send_arguments(TRGI, argc, argv);
 }
 
 //execute the command irl (information about local registers)
 void cmd_irl(int argc, char **argv)
 {
     if (argc == 1) {
-        cyg_mutex_lock(&ring_buffer_mux);
-        cyg_mutex_lock(&print_mux);
-        printf("INFORMATION ABOUT LOCAL REGISTERS: NRBUF - %d, nr - %d, iread - %d, iwrite - %d\n", NRBUF, nr, iread, iwrite);
+        ring_buffer_* rb = ring_acquire();
+        cyg_uint32 written = rb->written;
+        cyg_uint32 oldest = ring_oldest(rb, written);
+        cyg_uint32 read = (written - rb->read > written - oldest) ? oldest : rb->read;
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("INFORMATION ABOUT LOCAL REGISTERS: NRBUF - %d, nr - %d, iread - %d, iwrite - %d\n", rb->size,
+            (int)(written - oldest), (int)(read % rb->size), (int)(written % rb->size));
         cyg_mutex_unlock(&print_mux);
-        cyg_mutex_unlock(&ring_buffer_mux);
+        ring_release();
     }
     else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
         cyg_mutex_unlock(&print_mux);
     }
 }
 
-//execute the command lr (list n registers)
-void cmd_lr(int argc, char **argv)
+//execute the command pv (check/modify protocol version used to send messages to the device)
+void cmd_pv(int argc, char **argv)
 {
-    int n;
-    int num_reads = 0;
-    int i;
-    if (argc == 2) { //list n registers from index iread
-        n = atoi(argv[1]); //number of registers is the first argument
-
-        cyg_mutex_lock(&print_mux);
-        cyg_mutex_lock(&ring_buffer_mux); //lock buffer
-        while(n > 0 && num_unread_registers > 0 && num_reads < n)
-        {
-            //print registers starting at iread
-            printf("\nREGISTER:\n");
-            printf("HOURS: %d\n", RingBuffer[iread].hours);
-            printf("MINUTES: %d\n", RingBuffer[iread].minutes);
-            printf("SECONDS: %d\n", RingBuffer[iread].seconds);
-            printf("TEMPERATURE: %d\n", RingBuffer[iread].temperature);
-            printf("LUMINOSITY: %d\n", RingBuffer[iread].luminosity);
-            num_reads++;
-            iread++;
-            if(iread >= NRBUF)
-                iread = 0;
-            num_unread_registers--;
-        }
-        cyg_mutex_unlock(&ring_buffer_mux); //unlock buffer
-        printf("\nREAD %d REGISTERS FROM LOCAL BUFFER\n", num_reads);
+    if (argc == 1) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("PROTOCOL VERSION: %d\n", protocol_version);
         cyg_mutex_unlock(&print_mux);
-
     }
-    else if(argc == 3) //list n registers from index i
-    {
-        n = atoi(argv[1]);
-        i = atoi(argv[2]);
-        cyg_mutex_lock(&ring_buffer_mux); //lock buffer
-        //read index starts at iwrite-nr+i
-        int aux_iread = (iwrite - nr);
-        while(aux_iread < 0)
-            aux_iread = aux_iread + NRBUF;
-
-        aux_iread = (aux_iread + i);
-        while(aux_iread >= NRBUF)
-            aux_iread = aux_iread - NRBUF;
-
-        cyg_mutex_lock(&print_mux);
-        while(nr > 0 && n > 0 && num_reads < n)
-        {
-            printf("\nREGISTER:\n");
-            printf("HOURS: %d\n", RingBuffer[aux_iread].hours);
-            printf("MINUTES: %d\n", RingBuffer[aux_iread].minutes);
-            printf("SECONDS: %d\n", RingBuffer[aux_iread].seconds);
-            printf("TEMPERATURE: %d\n", RingBuffer[aux_iread].temperature);
-            printf("LUMINOSITY: %d\n", RingBuffer[aux_iread].luminosity);
-            num_reads++;
-
-            if(aux_iread == iread) //if aux read index intersects iread, increment iread
-            {
-                iread++;
-                num_unread_registers--;
-                if(iread >= NRBUF)
-                    iread = 0;
-            }
-            aux_iread++;
-            if(aux_iread >= NRBUF)
-                aux_iread = 0;
-
-            if(aux_iread == iwrite)
-                break;
-
-        }
-        cyg_mutex_unlock(&ring_buffer_mux); //unlock buffer
-
-        printf("\nREAD %d REGISTERS FROM LOCAL BUFFER\n", num_reads);
+    else if (argc == 2 && (atoi(argv[1]) == 1 || atoi(argv[1]) == 2)) {
+        protocol_version = atoi(argv[1]);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("PROTOCOL VERSION: OK\n");
         cyg_mutex_unlock(&print_mux);
-
     }
     else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
         cyg_mutex_unlock(&print_mux);
     }
 }
 
-/*-------------------------------------------------------------------------+
-| Function: cmd_sos - provides a rudimentary help
-+--------------------------------------------------------------------------*/
-void cmd_sos (int argc, char **argv)
+//execute the command wr (information about writer / modify linger window of the writer)
+void cmd_wr(int argc, char **argv)
 {
     int i;
-
-    cyg_mutex_lock(&print_mux);
-    printf("%s\n", TitleMsg);
-    for (i=0; i<NCOMMANDS; i++)
-    printf("%s %s\n", commands[i].cmd_name, commands[i].cmd_help);
-    cyg_mutex_unlock(&print_mux);
-}
-
-//executes command dr (delete local registers)
-void cmd_dr(int argc, char **argv)
-{
     if (argc == 1) {
-        cyg_mutex_lock(&ring_buffer_mux);
-        nr = 0;
-        iwrite = 0;
-        iread = 0;
-        num_unread_registers = 0;
-        cyg_mutex_unlock(&ring_buffer_mux);
-        cyg_mutex_lock(&print_mux);
-        printf("LOCAL REGISTERS DELETED\n");
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("INFORMATION ABOUT WRITER: linger - %d, writes - %lu, messages - %lu, messages per write -", writer_linger, writer_writes, writer_messages);
+        for(i = 0; i < WRITER_NBATCH; i++)
+            console_printf(" %d%s:%lu", i+1, (i == WRITER_NBATCH-1) ? "+" : "", writer_batches[i]);
+        console_printf("\n");
+        cyg_mutex_unlock(&print_mux);
+    }
+    else if (argc == 2 && atoi(argv[1]) >= 0) {
+        writer_linger = atoi(argv[1]);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("WRITER LINGER: OK\n");
         cyg_mutex_unlock(&print_mux);
     }
     else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
         cyg_mutex_unlock(&print_mux);
     }
 }
 
-//send to processing task the command cpt (check period of tranference)
-void cmd_cpt(int argc, char **argv)
+//execute the command iq (information about requests)
+void cmd_iq(int argc, char **argv)
 {
-
     if (argc == 1) {
-        unsigned char* buffer=(unsigned char*)malloc(3*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=CPT;
-        buffer[2]=EOM;
-        cyg_mbox_put(mbx_processingTaskH,(void*)buffer);
+        cyg_mutex_lock(&request_mux);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("INFORMATION ABOUT REQUESTS: in flight - %d, sent - %lu, matched - %lu, timed out - %lu, late - %lu\n",
+            requests_in_flight, requests_sent, requests_matched, requests_timed_out, responses_late);
+        cyg_mutex_unlock(&print_mux);
+        cyg_mutex_unlock(&request_mux);
     }
     else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
         cyg_mutex_unlock(&print_mux);
     }
 }
 
-//send to processing task the command mpt (modify period of transference)
-void cmd_mpt(int argc, char **argv)
+//execute the command imp (information about message pool)
+void cmd_imp(int argc, char **argv)
 {
-
-    if (argc == 2) {
-        unsigned char* buffer=(unsigned char*)malloc(4*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=MPT;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=EOM;
-        cyg_mbox_put(mbx_processingTaskH,(void*)buffer);
+    if (argc == 1) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("INFORMATION ABOUT MESSAGE POOL: NMSG - %d, in use - %d, high-water - %d, exhausted - %lu\n",
+            NMSG, NMSG - msg_pool_nfree, msg_pool_high_water, msg_pool_exhausted);
+        cyg_mutex_unlock(&print_mux);
     }
     else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
         cyg_mutex_unlock(&print_mux);
     }
 }
 
-//send to processing task the command cttl (check threshold temperature and luminosity for processing)
-void cmd_cttl(int argc, char **argv)
+//time since startup in microseconds, with the resolution of the hardware clock (a tick is too coarse for latencies)
+cyg_uint64 current_time_us(void)
 {
-
-    if (argc == 1) {
-        unsigned char* buffer=(unsigned char*)malloc(3*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=CTTL;
-        buffer[2]=EOM;
-        cyg_mbox_put(mbx_processingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
-    }
+    cyg_tick_count_t ticks;
+    cyg_uint32 count;
+    do { //the clock counter restarts on every tick
+        ticks = cyg_current_time();
+        HAL_CLOCK_READ(&count);
+    } while(ticks != cyg_current_time());
+    return ticks*(1000000/TICKS_PER_SECOND) + (cyg_uint64)count*(1000000/TICKS_PER_SECOND)/CYGNUM_HAL_RTC_PERIOD;
 }
 
-//send to processing task the command dttl (define threshold temperature and luminosity for processing)
-void cmd_dttl(int argc, char **argv)
+//record in the histogram of "opcode" the latency from "start" to now
+//called by the reply thread, the receiving thread of every station and the UI thread (replays), hence lat_mux
+void latency_record(int stage, unsigned char opcode, cyg_uint64 start)
 {
+    latency_* l;
+    cyg_uint32 us;
+    int k = 0;
+    if(opcode < LAT_FIRST_OPCODE || opcode >= LAT_FIRST_OPCODE + LAT_NOPCODES)
+        return;
+    l = &latencies[stage][opcode - LAT_FIRST_OPCODE];
+    us = (cyg_uint32)(current_time_us() - start);
+    while(k < LAT_NBUCKETS-1 && (us >> (k+1)) != 0)
+        k++;
+    cyg_mutex_lock(&lat_mux);
+    l->buckets[k]++;
+    l->count++;
+    if(us > l->max)
+        l->max = us;
+    cyg_mutex_unlock(&lat_mux);
+}
 
-    if (argc == 3) {
-        unsigned char* buffer=(unsigned char*)malloc(5*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=DTTL;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=atoi(argv[2]);
-        buffer[4]=EOM;
-        cyg_mbox_put(mbx_processingTaskH,(void*)buffer);
-    }
-    else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
-        cyg_mutex_unlock(&print_mux);
+//latency below which are "percent" % of the latencies of the histogram (upper bound of the bucket, at most the maximum)
+cyg_uint32 latency_percentile(latency_* l, int percent)
+{
+    unsigned long n = 0;
+    int k;
+    for(k = 0; k < LAT_NBUCKETS-1; k++)
+    {
+        n += l->buckets[k];
+        if(n*100 >= l->count*percent)
+            break;
     }
+    return ((cyg_uint32)2 << k) - 1 < l->max ? ((cyg_uint32)2 << k) - 1 : l->max;
 }
 
-//send to processing task the command pr ( process registers (max, min, mean) between instants t1 and t2 (h,m,s))
-void cmd_pr(int argc, char **argv)
+//execute the command lat (latency of commands and reception per opcode)
+void cmd_lat(int argc, char **argv)
 {
-    if (argc == 7) {
-        unsigned char* buffer=(unsigned char*)malloc(9*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=PR;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=atoi(argv[2]);
-        buffer[4]=atoi(argv[3]);
-        buffer[5]=atoi(argv[4]);
-        buffer[6]=atoi(argv[5]);
-        buffer[7]=atoi(argv[6]);
-        buffer[8]=EOM;
-        cyg_mbox_put(mbx_processingTaskH,(void*)buffer);
-    }
-    else if(argc == 4)
-    {
-        unsigned char* buffer=(unsigned char*)malloc(6*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=PR;
-        buffer[2]=atoi(argv[1]);
-        buffer[3]=atoi(argv[2]);
-        buffer[4]=atoi(argv[3]);
-        buffer[5]=EOM;
-        cyg_mbox_put(mbx_processingTaskH,(void*)buffer);
-    }
-    else if(argc == 1)
-    {
-        unsigned char* buffer=(unsigned char*)malloc(3*sizeof(unsigned char));
-        buffer[0]=SOM;
-        buffer[1]=PR;
-        buffer[5]=EOM;
-        cyg_mbox_put(mbx_processingTaskH,(void*)buffer);
+    static const char* stages[2] = {"COMMAND SENT TO RESPONSE PRINTED", "FRAME READ TO MESSAGE IN MAILBOX"};
+    latency_* l;
+    int stage, i;
+    if (argc == 2 && strcmp(argv[1], "r") == 0) {
+        cyg_mutex_lock(&lat_mux);
+        memset(latencies, 0, sizeof(latencies));
+        cyg_mutex_unlock(&lat_mux);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("LATENCY: RESET\n");
+        cyg_mutex_unlock(&print_mux);
+    }
+    else if (argc == 1) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        cyg_mutex_lock(&lat_mux);
+        for(stage = LAT_COMMAND; stage <= LAT_RECEIVE; stage++)
+        {
+            if(!batch_out)
+                console_printf("LATENCY (MICROSECONDS) FROM %s:\n", stages[stage]);
+            for(i = 0; i < LAT_NOPCODES; i++)
+            {
+                l = &latencies[stage][i];
+                if(l->count == 0)
+                    continue;
+                if(batch_out) //machine-readable record: stage, opcode, count, p50, p99, max
+                    fprintf(batch_out, "LAT %d %d %lu %u %u %u\n", stage, LAT_FIRST_OPCODE + i, l->count,
+                        (unsigned)latency_percentile(l, 50), (unsigned)latency_percentile(l, 99), (unsigned)l->max);
+                else
+                    console_printf("%-6s - n %lu, p50 %u, p99 %u, max %u\n", protocol_name(LAT_FIRST_OPCODE + i) ? protocol_name(LAT_FIRST_OPCODE + i) : "?", l->count,
+                        (unsigned)latency_percentile(l, 50), (unsigned)latency_percentile(l, 99), (unsigned)l->max);
+            }
+        }
+        cyg_mutex_unlock(&lat_mux);
+        cyg_mutex_unlock(&print_mux);
     }
     else {
-        cyg_mutex_lock(&print_mux);
-        printf("Wrong arguments");
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
         cyg_mutex_unlock(&print_mux);
     }
 }
 
-
-//copy "num_registers" from "registers" to the ring buffer
-void copyToRingBuffer(unsigned char* registers, int num_registers)
+//lock a mutex counting the times it was already locked by another thread and the time waiting for it
+void mutex_lock_counted(cyg_mutex_t* mux, lock_stats_* stats)
 {
-    int j = 0;
-    while(j < num_registers)
+    cyg_uint64 start;
+    cyg_uint32 wait;
+    if(!cyg_mutex_trylock(mux))
     {
-        RingBuffer[iwrite].hours = registers[j*5];
-        RingBuffer[iwrite].minutes = registers[j*5+1];
-        RingBuffer[iwrite].seconds = registers[j*5+2];
-        RingBuffer[iwrite].temperature = registers[j*5+3];
-        RingBuffer[iwrite].luminosity = registers[j*5+4];
-
-        iwrite++;
-        if(iwrite >= NRBUF)
-            iwrite = 0;
-
-        if(num_unread_registers < NRBUF)
-            num_unread_registers++; //num_unread_registers is at maximum NRBUF
+        start = current_time_us();
+        cyg_mutex_lock(mux);
+        wait = (cyg_uint32)(current_time_us() - start);
+        stats->contended++;
+        stats->wait_us += wait;
+        if(wait > stats->max_wait_us)
+            stats->max_wait_us = wait;
+    }
+    stats->locks++; //the statistics are protected by the mutex itself
+}
 
-        if(num_unread_registers == NRBUF)
+//put message m in a mailbox, keeping the number of messages and the peak depth of the mailbox
+void mbox_put(cyg_handle_t mbox, void* m)
+{
+    int i, depth;
+    cyg_mbox_put(mbox, m);
+    depth = cyg_mbox_peek(mbox);
+    for(i = 0; i < NMBOX; i++)
+    {
+        if(*mbox_stats[i].handle == mbox)
         {
-            iread = iwrite; //when the iwrite reaches iread, iread has to increment
+            mbox_stats[i].puts++;
+            if(depth > mbox_stats[i].peak)
+                mbox_stats[i].peak = depth;
         }
+    }
+}
 
-        if(nr < NRBUF)
-            nr++; //nr is at maximum NRBUF
+//print the state, priority and stack use of a thread (of station s, -1 if none) (called with print_mux locked)
+void print_thread(cyg_handle_t h, int s)
+{
+    cyg_thread_info info;
+    if(!cyg_thread_get_info(h, cyg_thread_get_id(h), &info))
+        return;
+    console_printf("THREAD %s", info.name);
+    if(s >= 0)
+        console_printf(" OF STATION %d", s);
+    console_printf(": state - %s, priority - %d, stack used - %lu of %lu\n",
+        info.state == 0 ? "RUNNING" : (info.state & 4) ? "SUSPENDED" : (info.state & 16) ? "EXITED" : "SLEEPING",
+        (int)info.cur_pri, (unsigned long)info.stack_used, (unsigned long)info.stack_size);
+}
 
-        j++;
+//print the statistics of the frames, mailboxes, locks and threads
+void print_stats(void)
+{
+    static const lock_stats_* locks[2] = {&print_mux_stats, &ring_buffer_mux_stats};
+    static const char* lock_names[2] = {"print_mux", "ring_buffer_mux"};
+    static unsigned long last_registers = 0;
+    cyg_tick_count_t now = cyg_current_time();
+    unsigned long frames = 0, dropped = 0, malformed = 0, bytes_received = 0, bytes_sent = 0, registers_ingested = 0;
+    int i, j;
+
+    for(i = 0; i < NSTATIONS; i++) //all the stations together (command st shows each one)
+    {
+        frames += stations[i].decoder.frames;
+        dropped += stations[i].decoder.dropped;
+        malformed += stations[i].decoder.malformed;
+        bytes_received += stations[i].bytes_received;
+        bytes_sent += stations[i].bytes_sent;
+        registers_ingested += stations[i].registers_ingested;
+    }
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("\nSTATISTICS:\n");
+    console_printf("FRAMES: received - %lu, decoded - %lu, dropped - %lu, malformed - %lu\n",
+        frames + malformed, frames, dropped, malformed);
+    console_printf("BYTES: in - %lu, out - %lu\n", bytes_received, bytes_sent);
+    console_printf("CONSOLE: records written - %lu, dropped - %lu, queued - %d, peak - %d of %d\n", console_written,
+        console_dropped, (int)(console_head - console_tail), console_peak, CONSOLE_RECORDS);
+    console_printf("REGISTERS: ingested - %lu, per second - %lu\n", registers_ingested,
+        stats_last && now > stats_last ? (registers_ingested - last_registers)*TICKS_PER_SECOND/(unsigned long)(now - stats_last) : 0);
+    for(i = 0; i < NMBOX; i++)
+        console_printf("MAILBOX %s: depth - %d, peak - %d, messages - %lu\n", mbox_stats[i].name,
+            cyg_mbox_peek(*mbox_stats[i].handle), mbox_stats[i].peak, mbox_stats[i].puts);
+    if(log_file != NULL || log_errors > 0)
+        console_printf("LOG: registers - %lu, segments - %lu, lost - %lu, errors - %lu\n", (unsigned long)log_written,
+            (unsigned long)(log_written/LOG_SEGMENT + 1), log_lost, log_errors);
+    if(hist_budget > 0)
+        hist_print();
+    console_printf("ROLLUPS: days - %lu, summaries read by the last pr - %lu\n", (unsigned long)rollup_day + 1, rollup_reads);
+    if(scheduler.transfers > 0 || scheduler.period > 0)
+        console_printf("TRANSFERS: bulk - %lu, idle - %lu, timeouts - %lu, chunks - %lu, discarded - %lu, rate - %d registers/min, "
+            "device registers - %d, next in - %d s\n", scheduler.transfers, scheduler.idle, scheduler.timeouts,
+            stations[0].bulk_chunks, stations[0].bulk_discarded, (int)(scheduler.rate*60), scheduler.nreg,
+            scheduler.next > now ? (int)((scheduler.next - now)/TICKS_PER_SECOND) : 0);
+    for(i = 0; i < 2; i++)
+        console_printf("LOCK %s: locks - %lu, contended - %lu, wait - %lu us (max %lu us)\n", lock_names[i], locks[i]->locks,
+            locks[i]->contended, (unsigned long)locks[i]->wait_us, (unsigned long)locks[i]->max_wait_us);
+    for(i = 0; i < NT; i++)
+        print_thread(threadsH[i], -1);
+    for(i = 0; i < NSTATIONS; i++)
+    {
+        for(j = 0; j < 2 && stations[i].serH != 0; j++)
+            print_thread(stations[i].threadsH[j], i);
     }
+    cyg_mutex_unlock(&print_mux);
+    last_registers = registers_ingested;
+    stats_last = now;
 }
 
-//pre-process message in receiving thread before sending it to the UI/processing thread
-void pre_process_message(unsigned char* message_received, int index_message_received)
+//execute the command stats (statistics of threads, mailboxes and locks, once or every p seconds)
+void cmd_stats(int argc, char **argv)
 {
-    //if it is a message of type transference, copy to ring buffer
-    if(message_received[1] == TRGC || message_received[1] == TRGI || message_received[1] == TRCACK)
+    if (argc == 1)
+        print_stats();
+    else if (argc == 2 && atoi(argv[1]) >= 0) {
+        stats_period = atoi(argv[1]);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("STATISTICS PERIOD: OK\n");
+        cyg_mutex_unlock(&print_mux);
+    }
+    else {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+    }
+}
+
+//print a register of the local ring buffer (one machine-readable record in batch mode)
+void print_register(register_* r)
+{
+    if(batch_out)
     {
-        unsigned char* m_ = (unsigned char*)malloc(4*sizeof(unsigned char)); //message to send to UI/processing
-        m_[0]=SOM;
-        m_[1] = message_received[1];
-        if(message_received[2] == CMD_ERROR)
+        fprintf(batch_out, "REG %d %d %d %d %d\n", r->hours, r->minutes, r->seconds, r->temperature, r->luminosity);
+        return;
+    }
+    console_printf("\nREGISTER:\nHOURS: %d\nMINUTES: %d\nSECONDS: %d\nTEMPERATURE: %d\nLUMINOSITY: %d\n", r->hours,
+        r->minutes, r->seconds, r->temperature, r->luminosity);
+}
+
+//execute the command lr (list n registers)
+//the registers are copied from the ring buffer one at a time, so printing never holds back the receiving thread
+void cmd_lr(int argc, char **argv)
+{
+    ring_buffer_* rb;
+    register_ r;
+    cyg_uint32 k, written, oldest, read, end, h, o;
+    int n;
+    int num_reads = 0;
+    int i;
+    if (argc == 2) { //list n registers from index iread
+        n = atoi(argv[1]); //number of registers is the first argument
+        rb = ring_acquire();
+        n = ring_consume(rb, n > 0 ? n : 0, &k);
+
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        for(i = 0; i < n; i++)
         {
-            m_[2] = CMD_ERROR;
+            if(ring_get(rb, k + i, &r)) //registers overwritten meanwhile are skipped
+            {
+                print_register(&r);
+                num_reads++;
+            }
         }
-        else
+        if(!batch_out)
+            console_printf("\nREAD %d REGISTERS FROM LOCAL BUFFER\n", num_reads);
+        cyg_mutex_unlock(&print_mux);
+        ring_release();
+
+    }
+    else if(argc == 3) //list n registers from index i
+    {
+        n = atoi(argv[1]);
+        i = atoi(argv[2]);
+        rb = ring_acquire();
+        cyg_mutex_lock(&ring_read_mux);
+        //registers from the oldest (in the log or the history, if they are on) + i up to the last written
+        //registers from o up to the oldest of the ring buffer are in the history, and register k before o is register
+        //h - (o - k) of the log
+        written = rb->written;
+        oldest = ring_oldest(rb, written);
+        o = hist_oldest(oldest);
+        cyg_mutex_lock(&log_mux);
+        h = log_end(o);
+        cyg_mutex_unlock(&log_mux);
+        k = (i >= 0 && (cyg_uint32)i < h + (written - o)) ? o - h + i : written;
+        end = (n > 0 && (cyg_uint32)n < written - k) ? k + n : written;
+        //if the registers listed include iread, they are read
+        read = (written - rb->read > written - oldest) ? oldest : rb->read;
+        if(read - k < end - k)
+            rb->read = end;
+        cyg_mutex_unlock(&ring_read_mux);
+
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        for(; k != end; k++)
         {
-            int num_reg = (index_message_received + 1 - 3)/5; //number of registers received
-            cyg_mutex_lock(&ring_buffer_mux); //lock buffer
-            copyToRingBuffer(message_received+2, num_reg);
-            cyg_mutex_unlock(&ring_buffer_mux); //unlock buffer
-            m_[2] = CMD_OK;
+            if((cyg_int32)(k - oldest) >= 0 ? ring_get(rb, k, &r) :
+                (cyg_int32)(k - o) >= 0 ? hist_get(k, &r) : log_get(h - (o - k), &r))
+            {
+                print_register(&r);
+                num_reads++;
+            }
         }
-        m_[3] = EOM;
-        if(message_received[1] == TRGC || message_received[1] == TRGI)
-            cyg_mbox_put(mbx_UITaskH, m_); //TRGC and TRGI messages go to UI thread
-        else if(message_received[1] == TRCACK)
-            cyg_mbox_put(mbx_processingTaskH, m_); //TRCACK messages go to precessing task
-        free(message_received);
+        if(!batch_out)
+            console_printf("\nREAD %d REGISTERS FROM LOCAL BUFFER\n", num_reads);
+        cyg_mutex_unlock(&print_mux);
+        ring_release();
+
     }
-    else if(message_received[1] == NMFL)
-    {
-        cyg_mbox_put(mbx_processingTaskH, message_received);//NMFL message goes to processing task
+    else {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
     }
-    else
-        cyg_mbox_put(mbx_UITaskH, message_received); //all other messages go to UI task
 }
 
-//thread to receive messages from the device
-void receiveFromSerial(cyg_addrword_t data)
+/*-------------------------------------------------------------------------+
+| Function: cmd_run - executa um script de comandos
++--------------------------------------------------------------------------*/
+//runs the commands of a script back to back, without waiting for the responses, and writes machine-readable records
+//(a line "wait" waits for the responses of the previous commands, a line "end" ends the script):
+//CMD <n> <request ID> <ticks> <command> - command n of the script, its request ID (0 - local command) and execution time
+//RSP <request ID> <opcode> <ticks> <arguments> - response and ticks since the request was sent
+//TMO <request ID> <opcode> - request without response
+//REG <h> <m> <s> <t> <l> - register listed by lr
+//END <commands> <ticks> - end of the script, after every response arrived or timed out
+void cmd_run(int argc, char **argv)
 {
-    int receiving_message = FALSE; //tells wether we're currently receiving a message
-    int index_message_received = 0; //current index of the received message
-    unsigned char* message_received = NULL;
-    unsigned char bit_received;
-    int n = 1;
-    while(1)
-    {
-        err = cyg_io_read(serH, &bit_received, (cyg_uint32 *)&n);
-        if(err != ENOERR)
+    static char line[MAX_LINE];
+    static char *argv_[ARGVECSIZE+1];
+    FILE* script = stdin;
+    FILE* out = stdout;
+    cyg_tick_count_t start, t;
+    unsigned long sent;
+    int argc_, i;
+    int n = 0;
+    char* p;
+
+    if (argc > 3 || batch_out != NULL) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    if (argc > 1 && strcmp(argv[1], "-") != 0 && (script = fopen(argv[1], "r")) == NULL) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("RUN: CAN NOT OPEN %s\n", argv[1]);
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    if (argc > 2 && (out = fopen(argv[2], "w")) == NULL) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("RUN: CAN NOT OPEN %s\n", argv[2]);
+        cyg_mutex_unlock(&print_mux);
+        if(script != stdin)
+            fclose(script);
+        return;
+    }
+
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    batch_out = out;
+    cyg_mutex_unlock(&print_mux);
+    start = cyg_current_time();
+    while (fgets(line, MAX_LINE, script) != NULL) {
+        if ((argc_ = split_line(line, argv_, ARGVECSIZE)) == 0 || argv_[0][0] == '#')
+            continue;
+        for (p=argv_[0]; *p != '\0'; *p=tolower(*p), p++);
+        if (strcmp(argv_[0], "end") == 0)
+            break;
+        if (strcmp(argv_[0], "wait") == 0) { //wait for the responses of the previous commands
+            while (requests_in_flight > 0)
+                cyg_thread_delay(1);
             continue;
-        //printf("io_read err=%x, n=%d buf=%x\n", err, n, bit_received);
-        if(bit_received == SOM) //message starts with SOM
-        {
-            message_received = (unsigned char*) malloc(MAX_MESSAGE*sizeof(unsigned char)); //start new message
-            receiving_message = TRUE;
-            index_message_received = 0;
-            message_received[index_message_received] = SOM;
-            index_message_received++;
-        }
-        else if(bit_received == EOM || index_message_received == MAX_MESSAGE-2) //message ends with EOM
-        {
-            receiving_message = FALSE;
-            message_received[index_message_received] = EOM;
-            pre_process_message(message_received, index_message_received); //pre-process and send the message to right thread
-            index_message_received = 0;
         }
-        else if(receiving_message)
-        {
-            message_received[index_message_received] = bit_received;
-            index_message_received++;
+        for (i = 0; i < NCOMMANDS; i++)
+            if (strcmp(argv_[0], commands[i].cmd_name) == 0)
+                break;
+        n++;
+        if (i == NCOMMANDS || commands[i].cmd_fnct == cmd_run) {
+            mutex_lock_counted(&print_mux, &print_mux_stats);
+            fprintf(out, "ERR %d %s\n", n, argv_[0]);
+            cyg_mutex_unlock(&print_mux);
+            continue;
         }
+        sent = requests_sent;
+        t = cyg_current_time();
+        commands[i].cmd_fnct (argc_, argv_);
+        t = cyg_current_time() - t;
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        fprintf(out, "CMD %d %d %d %s\n", n, (requests_sent != sent) ? request_next_id - 1 : 0, (int)t, argv_[0]);
+        cyg_mutex_unlock(&print_mux);
+    }
+
+    //wait for the responses of every command of the script
+    while (requests_in_flight > 0)
+        cyg_thread_delay(1);
+
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    fprintf(out, "END %d %d\n", n, (int)(cyg_current_time() - start));
+    batch_out = NULL;
+    cyg_mutex_unlock(&print_mux);
+    if (script != stdin)
+        fclose(script);
+    if (out != stdout)
+        fclose(out);
+}
+
+/*-------------------------------------------------------------------------+
+| Function: cmd_sos - provides a rudimentary help
++--------------------------------------------------------------------------*/
+void cmd_sos (int argc, char **argv)
+{
+    int i;
+
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("%s\n", TitleMsg);
+    for (i=0; i<NCOMMANDS; i++)
+    console_printf("%s %s\n", commands[i].cmd_name, commands[i].cmd_help);
+    cyg_mutex_unlock(&print_mux);
+}
 
+//executes command dr (delete local registers)
+void cmd_dr(int argc, char **argv)
+{
+    if (argc == 1) {
+        cyg_mutex_lock(&ring_read_mux);
+        ring->first = ring->written;
+        ring->read = ring->first;
+        rollup_reset(ring->first); //pr does not count the registers deleted
+        cyg_mutex_unlock(&ring_read_mux);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("LOCAL REGISTERS DELETED\n");
+        cyg_mutex_unlock(&print_mux);
+    }
+    else {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
     }
 }
 
-//size of a message
-int bufflen(unsigned char * buff)
+//executes command mrb (modify size of local memory)
+void cmd_mrb(int argc, char **argv)
 {
-    int count;
-    for(count=0;buff[count]!=EOM;count++)
-    {}
-    return count+1;
+    int n;
+    if (argc == 2 && (n = atoi(argv[1])) > 0) {
+        n = ring_resize(n);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("MODIFY SIZE OF LOCAL MEMORY: %s\n", n ? "OK" : "NOT ENOUGH MEMORY");
+        cyg_mutex_unlock(&print_mux);
+    }
+    else {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+    }
 }
 
-//thread to write to device
-void writeToSerial (void)
+//send to processing task the command cpt (check period of tranference)
+void cmd_cpt(int argc, char **argv)
 {
-    while(1)
-    {
+    send_arguments(CPT, argc, argv);
+}
 
-        unsigned char* m;
-        m=cyg_mbox_get(mbx_sendingTaskH); //get message from mailbox
-        int n=bufflen(m);
-        err=cyg_io_write(serH,m,(cyg_uint32 *)&n); //send to device
-        /*int i = 0;
-        for(i=0; i<n;i++)
-        {
-        printf("SENT: %x\n", m[i]);
-        }*/
-        free(m);
+//send to processing task the command mpt (modify period of transference)
+void cmd_mpt(int argc, char **argv)
+{
+    send_arguments(MPT, argc, argv);
+}
+
+//send to processing task the command cttl (check threshold temperature and luminosity for processing)
+void cmd_cttl(int argc, char **argv)
+{
+    send_arguments(CTTL, argc, argv);
+}
+
+//send to processing task the command dttl (define threshold temperature and luminosity for processing)
+void cmd_dttl(int argc, char **argv)
+{
+    send_arguments(DTTL, argc, argv);
+}
+
+//send to processing task the command pr ( process registers (max, min, mean) between instants t1 and t2 (h,m,s))
+void cmd_pr(int argc, char **argv)
+{
+    send_arguments(PR, argc, argv);
+}
+
+//send to processing task the command prd (process registers (median, p90, p95, p99, histogram) between instants t1 and t2)
+void cmd_prd(int argc, char **argv)
+{
+    send_arguments(PRD, argc, argv);
+}
+
+
+//allocate the pages of the columns and the summary tree of a ring buffer of "size" registers
+//returns FALSE if there is not enough memory (what was allocated is freed by ring_free)
+int ring_init(ring_buffer_* rb, int size)
+{
+    int i, n, ok;
+    rb->size = size;
+    rb->pages = (size + RING_PAGE - 1)/RING_PAGE;
+    rb->time = (cyg_int32**)calloc(rb->pages, sizeof(cyg_int32*));
+    rb->temperature = (unsigned char**)calloc(rb->pages, sizeof(unsigned char*));
+    rb->luminosity = (unsigned char**)calloc(rb->pages, sizeof(unsigned char*));
+    ok = rb->time != NULL && rb->temperature != NULL && rb->luminosity != NULL;
+    for(i = 0; ok && i < rb->pages; i++)
+    {
+        n = (size - i*RING_PAGE < RING_PAGE) ? size - i*RING_PAGE : RING_PAGE;
+        rb->time[i] = (cyg_int32*)calloc(n, sizeof(cyg_int32));
+        rb->temperature[i] = (unsigned char*)calloc(n, 1);
+        rb->luminosity[i] = (unsigned char*)calloc(n, 1);
+        ok = rb->time[i] != NULL && rb->temperature[i] != NULL && rb->luminosity[i] != NULL;
     }
+    rb->written = 0;
+    rb->writing = 0;
+    rb->first = 0;
+    rb->read = 0;
+    rb->runs = 0;
+    rb->last_time = 0;
+    for(rb->leaves = 1; rb->leaves*RING_BLOCK < size; rb->leaves *= 2)
+        ;
+    rb->tree = (aggregate_*)malloc(2*rb->leaves*sizeof(aggregate_));
+    if(rb->tree != NULL)
+        for(i = 0; i < 2*rb->leaves; i++)
+            aggregate_init(&rb->tree[i]);
+    return ok && rb->tree != NULL;
 }
 
-//function associated with an alarm that periodically sends to the communication task the message PTRC (start periodic tranfer)
-void alarm_func(cyg_handle_t alarmH, cyg_addrword_t data)
+//free the pages of the columns and the summary tree of a ring buffer
+void ring_free(ring_buffer_* rb)
 {
-    unsigned char* buffer=(unsigned char*)malloc(3*sizeof(unsigned char));
-    buffer[0]=SOM;
-    buffer[1]=PTRC;
-    buffer[2]=EOM;
-    cyg_mbox_put(mbx_processingTaskH,(void*)buffer);
+    int i;
+    for(i = 0; i < rb->pages; i++)
+    {
+        if(rb->time != NULL) free(rb->time[i]);
+        if(rb->temperature != NULL) free(rb->temperature[i]);
+        if(rb->luminosity != NULL) free(rb->luminosity[i]);
+    }
+    free(rb->time);
+    free(rb->temperature);
+    free(rb->luminosity);
+    free(rb->tree);
 }
 
-//determines if a given time (hour,minute,second) is between two other times (hourT1, minuteT1, secondT1) and (hourT2,minuteT2,secondT2).
-//the value NONE can be used to express that a field does not exist
-int isBetweenT1andT2(unsigned char hourT1, unsigned char minuteT1, unsigned char secondT1, unsigned char hourT2, unsigned char minuteT2, unsigned char secondT2, unsigned char hour, unsigned char minute, unsigned char second)
+//summarize again block b of the ring buffer and the nodes of the summary tree above it
+void ring_update_block(ring_buffer_* rb, int b)
 {
-    if(hourT2 == NONE && minuteT2 == NONE && secondT2 == NONE && hourT1 == NONE && minuteT1 == NONE && secondT1 == NONE)
+    int p = b*RING_BLOCK;
+    int n = (rb->size - p < RING_BLOCK) ? rb->size - p : RING_BLOCK;
+    int i = rb->leaves + b;
+    aggregate_init(&rb->tree[i]);
+    ring_span(rb, p, p + n, 0, 0x7FFFFFFF, &rb->tree[i]);
+    for(i /= 2; i >= 1; i /= 2)
     {
-        return TRUE;
+        aggregate_init(&rb->tree[i]);
+        aggregate_merge(&rb->tree[i], &rb->tree[2*i]);
+        aggregate_merge(&rb->tree[i], &rb->tree[2*i+1]);
     }
-    if(hourT2 == NONE && minuteT2 == NONE && secondT2 == NONE)
+}
+
+//copy "num_registers" from "registers" to the ring buffer
+//a reader that copies register k without locking is told that the copy is torn by the two counters alone: the slot of
+//register k is only written again for register k + size, and "writing" passes k + size before that store (full
+//barrier in between), while the reader loads "written" (barrier), then the slot, then (barrier) "writing"; so if the
+//copy saw any store of a later register, the last load sees writing - k > size and the copy is dropped (one writer at a
+//time, and the counters do not wrap while a copy is in progress)
+void copyToRingBuffer(ring_buffer_* rb, unsigned char* registers, int num_registers)
+{
+    cyg_uint32 k = rb->written;
+    cyg_uint32 i;
+    cyg_int32 time;
+    int j;
+    rb->writing = k + num_registers;
+    __sync_synchronize();
+    for(j = 0; j < num_registers; j++, k++)
     {
-        //determine times in seconds to compare
-        int time1 = 60*60*hourT1 + 60*minuteT1 + secondT1;
-        int time_ = 60*60*hour + 60*minute + second;
-        if(time_ >= time1)
-        return TRUE;
-        else
-        return FALSE;
+        i = k % rb->size;
+        time = 60*60*registers[j*5] + 60*registers[j*5+1] + registers[j*5+2];
+        if(rb->runs == 0 || time < rb->last_time) //a new run
+        {
+            rb->run_start[rb->runs % NRUNS] = k;
+            __sync_synchronize();
+            rb->runs++;
+        }
+        rb->last_time = time;
+        rb->time[i/RING_PAGE][i%RING_PAGE] = time;
+        rb->temperature[i/RING_PAGE][i%RING_PAGE] = registers[j*5+3];
+        rb->luminosity[i/RING_PAGE][i%RING_PAGE] = registers[j*5+4];
+        if(i % RING_BLOCK == RING_BLOCK - 1 || i == (cyg_uint32)rb->size - 1 || j == num_registers - 1) //end of a block
+            ring_update_block(rb, i/RING_BLOCK);
     }
-    int time1 = 60*60*hourT1 + 60*minuteT1 + secondT1;
-    int time2 = 60*60*hourT2 + 60*minuteT2 + secondT2;
-    int time_ = 60*60*hour + 60*minute + second;
+    __sync_synchronize();
+    rb->written = k; //publish the registers
+}
 
-    if(time1<=time2 && time_>=time1 && time_<=time2)
-        return TRUE;
-    else if(time1>time2 && (time_>=time1 || time_<=time2))
-        return TRUE;
-    else return FALSE;
+//copy register k (number since startup) of the ring buffer to r
+//returns FALSE if the register was overwritten (or is not written yet)
+//the time is kept in seconds of the day, so minutes and seconds above 59 from a faulty device are not kept as received
+int ring_get(ring_buffer_* rb, cyg_uint32 k, register_* r)
+{
+    cyg_uint32 i = k % rb->size;
+    cyg_int32 time;
+    if(rb->written - k - 1 >= (cyg_uint32)rb->size) //not written yet or already overwritten
+        return FALSE;
+    __sync_synchronize(); //the slot is loaded after "written"
+    time = rb->time[i/RING_PAGE][i%RING_PAGE];
+    r->temperature = rb->temperature[i/RING_PAGE][i%RING_PAGE];
+    r->luminosity = rb->luminosity[i/RING_PAGE][i%RING_PAGE];
+    __sync_synchronize();
+    if(rb->writing - k > (cyg_uint32)rb->size) //overwritten while it was copied
+        return FALSE;
+    r->hours = time/3600;
+    r->minutes = time/60%60;
+    r->seconds = time%60;
+    return TRUE;
+}
+
+//number of the oldest register in the ring buffer, when "written" registers were written
+cyg_uint32 ring_oldest(ring_buffer_* rb, cyg_uint32 written)
+{
+    return (written - rb->first > (cyg_uint32)rb->size) ? written - rb->size : rb->first;
 }
 
-//updates the alarm according to the period specified. a period of 0 corresponds to turning off the alarm
-void updateTransferAlarm(cyg_handle_t alarmH, int period_of_transference)
+//copy to the columns up to "count" registers of the ring buffer from number *k, a page at a time, moving *k past the
+//registers deleted or overwritten (before or while they were copied); returns the number of registers copied
+int ring_copy(ring_buffer_* rb, cyg_uint32* k, int count, cyg_int32* time, unsigned char* temperature,
+    unsigned char* luminosity)
 {
-    if(period_of_transference != 0)
+    cyg_uint32 written = rb->written;
+    cyg_uint32 oldest = ring_oldest(rb, written);
+    cyg_uint32 i;
+    cyg_int32 lost;
+    int j, m;
+    if((cyg_int32)(*k - oldest) < 0)
+        *k = oldest;
+    if(written - *k < (cyg_uint32)count)
+        count = written - *k;
+    __sync_synchronize(); //the slots are loaded after "written"
+    for(j = 0; j < count; j += m)
     {
-        //printf("PERIOD OF TRANSFERENCE CHANGED TO: %d minutes\n", period_of_transference);
-        cyg_alarm_initialize(alarmH, cyg_current_time() + period_of_transference*100*60, period_of_transference*100*60);
-        cyg_alarm_enable(alarmH);
+        i = (*k + j) % rb->size;
+        m = RING_PAGE - i%RING_PAGE;
+        if(m > rb->size - (int)i)
+            m = rb->size - i;
+        if(m > count - j)
+            m = count - j;
+        memcpy(time + j, &rb->time[i/RING_PAGE][i%RING_PAGE], m*sizeof(cyg_int32));
+        memcpy(temperature + j, &rb->temperature[i/RING_PAGE][i%RING_PAGE], m);
+        memcpy(luminosity + j, &rb->luminosity[i/RING_PAGE][i%RING_PAGE], m);
     }
-    else
+    __sync_synchronize();
+    lost = rb->writing - rb->size - *k; //registers overwritten while they were copied
+    if(lost > 0)
     {
-        //printf("PERIOD OF TRANSFERENCE DISABLED\n");
-        cyg_alarm_disable(alarmH);
+        if(lost > count)
+            lost = count;
+        count -= lost;
+        memmove(time, time + lost, count*sizeof(cyg_int32));
+        memmove(temperature, temperature + lost, count);
+        memmove(luminosity, luminosity + lost, count);
+        *k += lost;
     }
+    return count;
 }
 
-//function executed in the processing task
-void processingTask(void)
+//mark as read up to n registers not yet read (all if n < 0)
+//returns the number of registers and puts in "first" the number of the first one
+int ring_consume(ring_buffer_* rb, int n, cyg_uint32* first)
 {
+    cyg_uint32 written, oldest, start;
+    cyg_mutex_lock(&ring_read_mux);
+    written = rb->written;
+    oldest = ring_oldest(rb, written);
+    start = (written - rb->read > written - oldest) ? oldest : rb->read; //registers not read may have been overwritten
+    if(n < 0 || written - start < (cyg_uint32)n)
+        n = written - start;
+    rb->read = start + n;
+    cyg_mutex_unlock(&ring_read_mux);
+    *first = start;
+    return n;
+}
 
-    cyg_handle_t counterH, system_clockH, alarmH;
-    cyg_tick_count_t ticks;
-    cyg_alarm alarm;
-    unsigned how_many_alarms = 0, prev_alarms = 0, tmp_how_many;
-    system_clockH = cyg_real_time_clock();
-    cyg_clock_to_counter(system_clockH, &counterH);
-    cyg_alarm_create(counterH, alarm_func, //create alarm
-    (cyg_addrword_t) &how_many_alarms, &alarmH, &alarm);
-
+//get the ring buffer to read it without locking the writer
+//it is not freed by ring_resize until the reader calls ring_release
+ring_buffer_* ring_acquire(void)
+{
+    __sync_fetch_and_add(&ring_users, 1);
+    return ring;
+}
 
-    int period_of_transference = 0;
-    int threshold_temperature = 25;
-    int threshold_lum = 2;
-    int size;
-    int num_reads;
+//end the reading of the ring buffer got by ring_acquire
+void ring_release(void)
+{
+    __sync_fetch_and_sub(&ring_users, 1);
+}
 
-    while(1)
+//replace the ring buffer with one of "size" registers, with the registers stored in the same order and with the same
+//numbers (the oldest ones are lost if they do not fit); returns FALSE if there is not enough memory
+//the writer waits while the registers are copied; the readers of the old ring buffer go on until they release it
+int ring_resize(int size)
+{
+    ring_buffer_* rb = (ring_buffer_*)malloc(sizeof(ring_buffer_));
+    ring_buffer_* old;
+    unsigned char registers[5*RING_BLOCK];
+    register_ r;
+    cyg_uint32 k, start;
+    int n;
+    if(rb == NULL || !ring_init(rb, size))
     {
-        unsigned char* m;
-        m=cyg_mbox_get(mbx_processingTaskH);
-        if(m[0] != SOM) //message must start with SOM
-        continue;
-        size=bufflen(m);
-        unsigned char* m_;
-        switch(m[1])
+        if(rb != NULL)
+            ring_free(rb);
+        free(rb);
+        return FALSE;
+    }
+    mutex_lock_counted(&ring_buffer_mux, &ring_buffer_mux_stats);
+    cyg_mutex_lock(&ring_read_mux);
+    old = ring;
+    start = ring_oldest(old, old->written);
+    if(old->written - start > (cyg_uint32)size)
+        start = old->written - size;
+    rb->written = start;
+    rb->writing = start;
+    for(k = start; k != old->written; k += n)
+    {
+        for(n = 0; n < RING_BLOCK && k + n != old->written; n++)
         {
-            case CPT: //check period of tranference
-                m_ = (unsigned char*)malloc(4*sizeof(unsigned char));
-                m_[0] = SOM;
-                m_[1] = CPT;
-                m_[2] = period_of_transference;
-                m_[3] = EOM;
-                cyg_mbox_put(mbx_UITaskH, m_); //put message in UI mailbox
-                break;
-            case MPT: //modify period of transference
-                m_ = (unsigned char*)malloc(4*sizeof(unsigned char));
-                m_[0] = SOM;
-                m_[1] = MPT;
+            ring_get(old, k + n, &r);
+            registers[n*5] = r.hours;
+            registers[n*5+1] = r.minutes;
+            registers[n*5+2] = r.seconds;
+            registers[n*5+3] = r.temperature;
+            registers[n*5+4] = r.luminosity;
+        }
+        copyToRingBuffer(rb, registers, n);
+    }
+    rb->first = start;
+    rb->read = old->read;
+    __sync_synchronize();
+    ring = rb;
+    __sync_synchronize();
+    cyg_mutex_unlock(&ring_read_mux);
+    cyg_mutex_unlock(&ring_buffer_mux);
+
+    while(ring_users > 0)
+        cyg_thread_delay(1);
+    //a reader of the old ring buffer may have read registers meanwhile
+    cyg_mutex_lock(&ring_read_mux);
+    if((cyg_int32)(old->read - rb->read) > 0)
+        rb->read = old->read;
+    cyg_mutex_unlock(&ring_read_mux);
+    ring_free(old);
+    free(old);
+    return TRUE;
+}
 
-                m_[3] = EOM;
-                if(m[2] < 0)
-                {
-                    m_[2] = CMD_ERROR;
-                }
-                else
-                {
-                    m_[2] = CMD_OK;
-                    //update alarm
-                    period_of_transference = m[2];
-                    updateTransferAlarm(alarmH, period_of_transference);
-                }
-                cyg_mbox_put(mbx_UITaskH, m_); //put message in UI mailbox
-                break;
-                case CTTL: //check threshold temperature and luminosity for processing
-                m_ = (unsigned char*)malloc(5*sizeof(unsigned char));
-                m_[0] = SOM;
-                m_[1] = CTTL;
-                m_[2] = threshold_temperature;
-                m_[3] = threshold_lum;
-                m_[4] = EOM;
-                cyg_mbox_put(mbx_UITaskH, m_); //put message in UI mailbox
+//position (from the oldest register) of the first register from s to e with the time >= t, or > t if "after"
+//the times of the registers from s to e do not decrease (they are in the same run)
+cyg_int32 ring_search(ring_buffer_* rb, cyg_uint32 oldest, cyg_int32 s, cyg_int32 e, cyg_int32 t, int after)
+{
+    cyg_int32 m, time;
+    cyg_uint32 i;
+    while(s < e)
+    {
+        m = s + (e - s)/2;
+        i = (oldest + m) % rb->size;
+        time = rb->time[i/RING_PAGE][i%RING_PAGE];
+        if(time < t || (after && time == t))
+            s = m + 1;
+        else
+            e = m;
+    }
+    return s;
+}
+
+//aggregate the registers in positions p to q of the ring buffer with lo <= time <= hi, one contiguous span per page
+void ring_span(ring_buffer_* rb, int p, int q, cyg_int32 lo, cyg_int32 hi, aggregate_* a)
+{
+    int n;
+    for(; p < q; p += n)
+    {
+        n = (q - p < RING_PAGE - p%RING_PAGE) ? q - p : RING_PAGE - p%RING_PAGE;
+        aggregate_span(rb->time[p/RING_PAGE] + p%RING_PAGE, rb->temperature[p/RING_PAGE] + p%RING_PAGE,
+            rb->luminosity[p/RING_PAGE] + p%RING_PAGE, n, lo, hi, a);
+    }
+}
+
+//aggregate the registers in positions p to q of the ring buffer, all of them with lo <= time <= hi
+//the blocks inside come from the summary tree (log2 of the number of blocks nodes at most), so only the registers of the
+//blocks at the ends are aggregated one by one
+void ring_summarize(ring_buffer_* rb, int p, int q, cyg_int32 lo, cyg_int32 hi, aggregate_* a)
+{
+    int l = (p + RING_BLOCK - 1)/RING_BLOCK; //first block inside
+    int r = q/RING_BLOCK; //block after the last one inside
+    if(l >= r)
+    {
+        ring_span(rb, p, q, lo, hi, a);
+        return;
+    }
+    ring_span(rb, p, l*RING_BLOCK, lo, hi, a);
+    ring_span(rb, r*RING_BLOCK, q, lo, hi, a);
+    for(l += rb->leaves, r += rb->leaves; l < r; l /= 2, r /= 2)
+    {
+        if(l & 1)
+            aggregate_merge(a, &rb->tree[l++]);
+        if(r & 1)
+            aggregate_merge(a, &rb->tree[--r]);
+    }
+}
+
+//aggregate the registers from position s to e (from the oldest register) with lo <= time <= hi
+//when they are in the same run ("sorted") the registers found by binary search are aggregated with the summary tree,
+//otherwise all of them go through aggregate_span; either way in at most two spans of positions
+void ring_aggregate_slice(ring_buffer_* rb, cyg_uint32 oldest, cyg_int32 s, cyg_int32 e, cyg_int32 lo, cyg_int32 hi,
+    int sorted, aggregate_* a)
+{
+    cyg_uint32 start;
+    cyg_int32 n, first;
+    if(sorted)
+    {
+        s = ring_search(rb, oldest, s, e, lo, FALSE);
+        e = ring_search(rb, oldest, s, e, hi, TRUE);
+    }
+    start = (oldest + s) % rb->size;
+    n = e - s;
+    first = (n < (cyg_int32)(rb->size - start)) ? n : (cyg_int32)(rb->size - start);
+    if(sorted)
+    {
+        ring_summarize(rb, start, start + first, lo, hi, a);
+        ring_summarize(rb, 0, n - first, lo, hi, a);
+    }
+    else
+    {
+        ring_span(rb, start, start + first, lo, hi, a);
+        ring_span(rb, 0, n - first, lo, hi, a);
+    }
+}
+
+//positions (from the oldest register) s to e of the registers numbered "first" to first + count - 1 that are in the
+//ring buffer, when "written" registers were written
+void ring_bounds(cyg_uint32 oldest, cyg_uint32 written, cyg_uint32 first, cyg_uint32 count, cyg_int32* s, cyg_int32* e)
+{
+    *s = (cyg_int32)(first - oldest);
+    *e = (cyg_int32)(first + count - oldest);
+    if(*s < 0)
+        *s = 0;
+    if(*e > (cyg_int32)(written - oldest))
+        *e = written - oldest;
+    if(*s > *e)
+        *s = *e;
+}
+
+//aggregate the registers of the ring buffer numbered "first" to first + count - 1 (those still in it) with the time
+//within one of the ranges [lo, hi]
+//the runs are walked from the newest, searching each range in each run, and the registers older than the runs still in
+//the run table are all scanned; when the writer overwrote registers or runs meanwhile, the aggregation is repeated
+//(RING_RETRIES times at most, so a busy writer can not starve pr)
+//returns the number of the oldest register of the ring buffer
+cyg_uint32 ring_aggregate(ring_buffer_* rb, cyg_uint32 first, cyg_uint32 count, cyg_int32* lo, cyg_int32* hi, int nranges,
+    aggregate_* a)
+{
+    cyg_uint32 written, oldest, runs, r;
+    cyg_int32 s, e, b;
+    int tries, i;
+    for(tries = 0; ; tries++)
+    {
+        aggregate_init(a);
+        written = rb->written;
+        oldest = ring_oldest(rb, written);
+        __sync_synchronize();
+        runs = rb->runs;
+        ring_bounds(oldest, written, first, count, &b, &e);
+        //run r - 1 is used while the writer can not be overwriting its entry
+        for(r = runs; e > b && r != 0 && runs - r + 1 < NRUNS; r--)
+        {
+            s = (cyg_int32)(rb->run_start[(r - 1) % NRUNS] - oldest);
+            if(s >= e) //run started by the write in progress
+                continue;
+            if(s < b)
+                s = b;
+            for(i = 0; i < nranges; i++)
+                ring_aggregate_slice(rb, oldest, s, e, lo[i], hi[i], TRUE, a);
+            e = s;
+        }
+        if(e > b)
+        {
+            for(i = 0; i < nranges; i++)
+                ring_aggregate_slice(rb, oldest, b, e, lo[i], hi[i], FALSE, a);
+        }
+        __sync_synchronize();
+        if((rb->writing - oldest <= (cyg_uint32)rb->size && rb->runs - r < NRUNS) || tries == RING_RETRIES)
+            break;
+    }
+    return oldest;
+}
+
+//count the registers in positions p to q of the ring buffer with lo <= time <= hi, one contiguous span per page
+void ring_histogram_span(ring_buffer_* rb, int p, int q, cyg_int32 lo, cyg_int32 hi, cyg_uint32* bins)
+{
+    int n;
+    for(; p < q; p += n)
+    {
+        n = (q - p < RING_PAGE - p%RING_PAGE) ? q - p : RING_PAGE - p%RING_PAGE;
+        histogram_span(rb->time[p/RING_PAGE] + p%RING_PAGE, rb->temperature[p/RING_PAGE] + p%RING_PAGE,
+            rb->luminosity[p/RING_PAGE] + p%RING_PAGE, n, lo, hi, bins);
+    }
+}
+
+//count in the histograms "bins" (cleared first) the registers of the ring buffer numbered "first" to
+//first + count - 1 with the time within one of the ranges [lo, hi], walking the runs as ring_aggregate does (the
+//summary tree has no histograms, so the registers found are counted one by one)
+//returns the number of the oldest register of the ring buffer
+cyg_uint32 ring_histogram(ring_buffer_* rb, cyg_uint32 first, cyg_uint32 count, cyg_int32* lo, cyg_int32* hi, int nranges,
+    cyg_uint32* bins)
+{
+    cyg_uint32 written, oldest, runs, r, start;
+    cyg_int32 s, e, b, p, q, n, m;
+    int tries, i, sorted;
+    for(tries = 0; ; tries++)
+    {
+        memset(bins, 0, 2*NBINS*sizeof(cyg_uint32));
+        written = rb->written;
+        oldest = ring_oldest(rb, written);
+        __sync_synchronize();
+        runs = rb->runs;
+        ring_bounds(oldest, written, first, count, &b, &e);
+        //run r - 1 is used while the writer can not be overwriting its entry, the registers older than the runs in
+        //the run table are all scanned
+        for(r = runs; e > b; r--)
+        {
+            sorted = (r != 0 && runs - r + 1 < NRUNS);
+            s = sorted ? (cyg_int32)(rb->run_start[(r - 1) % NRUNS] - oldest) : b;
+            if(s >= e) //run started by the write in progress
+                continue;
+            if(s < b)
+                s = b;
+            for(i = 0; i < nranges; i++)
+            {
+                p = sorted ? ring_search(rb, oldest, s, e, lo[i], FALSE) : s;
+                q = sorted ? ring_search(rb, oldest, p, e, hi[i], TRUE) : e;
+                start = (oldest + p) % rb->size;
+                n = q - p;
+                m = (n < (cyg_int32)(rb->size - start)) ? n : (cyg_int32)(rb->size - start);
+                ring_histogram_span(rb, start, start + m, lo[i], hi[i], bins);
+                ring_histogram_span(rb, 0, n - m, lo[i], hi[i], bins);
+            }
+            e = s;
+            if(!sorted)
+                break;
+        }
+        __sync_synchronize();
+        if((rb->writing - oldest <= (cyg_uint32)rb->size && rb->runs - r < NRUNS) || tries == RING_RETRIES)
+            break;
+    }
+    return oldest;
+}
+
+//start an aggregation
+void aggregate_init(aggregate_* a)
+{
+    a->count = 0;
+    a->sum_temperature = 0;
+    a->sum_luminosity = 0;
+    a->min_temperature = 255;
+    a->max_temperature = 0;
+    a->min_luminosity = 255;
+    a->max_luminosity = 0;
+}
+
+//add aggregation b to aggregation a
+void aggregate_merge(aggregate_* a, const aggregate_* b)
+{
+    a->count += b->count;
+    a->sum_temperature += b->sum_temperature;
+    a->sum_luminosity += b->sum_luminosity;
+    if(b->min_temperature < a->min_temperature) a->min_temperature = b->min_temperature;
+    if(b->max_temperature > a->max_temperature) a->max_temperature = b->max_temperature;
+    if(b->min_luminosity < a->min_luminosity) a->min_luminosity = b->min_luminosity;
+    if(b->max_luminosity > a->max_luminosity) a->max_luminosity = b->max_luminosity;
+}
+
+//count the registers of a span with lo <= time <= hi in the histograms "bins" (temperature, then luminosity)
+void histogram_span(const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity, int n,
+    cyg_int32 lo, cyg_int32 hi, cyg_uint32* bins)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        if(time[i] < lo || time[i] > hi)
+            continue;
+        bins[temperature[i]]++;
+        bins[NBINS + luminosity[i]]++;
+    }
+}
+
+//value of the histogram of "count" registers below which "percent" percent of them are (nearest rank)
+int histogram_quantile(const cyg_uint32* bins, unsigned long count, int percent)
+{
+    unsigned long rank = ((cyg_uint64)count*percent + 99)/100, seen = 0;
+    int v;
+    if(rank == 0)
+        rank = 1;
+    for(v = 0; v < NBINS - 1; v++)
+    {
+        seen += bins[v];
+        if(seen >= rank)
+            break;
+    }
+    return v;
+}
+
+//print the bins that are not empty of the histograms of temperature and luminosity (called with print_mux locked)
+void histogram_print(const cyg_uint32* bins)
+{
+    int v, n;
+    console_printf("HISTOGRAM OF TEMPERATURE (VALUE - REGISTERS):");
+    for(v = 0, n = 0; v < NBINS; v++)
+        if(bins[v] > 0)
+            console_printf("%s %d - %lu", (n++ % 8) ? "," : "\n ", v, (unsigned long)bins[v]);
+    console_printf("\nHISTOGRAM OF LUMINOSITY (VALUE - REGISTERS):");
+    for(v = 0, n = 0; v < NBINS; v++)
+        if(bins[NBINS + v] > 0)
+            console_printf("%s %d - %lu", (n++ % 8) ? "," : "\n ", v, (unsigned long)bins[NBINS + v]);
+    console_printf("\n");
+}
+
+//aggregate the registers of a span with lo <= time <= hi, one register at a time
+void aggregate_scalar(const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity, int n,
+    cyg_int32 lo, cyg_int32 hi, aggregate_* a)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        if(time[i] < lo || time[i] > hi)
+            continue;
+        a->count++;
+        a->sum_temperature += temperature[i];
+        a->sum_luminosity += luminosity[i];
+        if(temperature[i] < a->min_temperature) a->min_temperature = temperature[i];
+        if(temperature[i] > a->max_temperature) a->max_temperature = temperature[i];
+        if(luminosity[i] < a->min_luminosity) a->min_luminosity = luminosity[i];
+        if(luminosity[i] > a->max_luminosity) a->max_luminosity = luminosity[i];
+    }
+}
+
+//aggregate the registers of a span with lo <= time <= hi
+//with AVX2 (32 registers per step) or SSE2 (16 registers per step) the time comparisons are packed into a byte mask:
+//the sums come from _sad_epu8 of the masked bytes, the minimum sees 255 and the maximum 0 out of the range
+//the registers left go through aggregate_scalar, which is also used when the compiler targets neither
+void aggregate_span(const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity, int n,
+    cyg_int32 lo, cyg_int32 hi, aggregate_* a)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7); //undo the interleaving of the lanes by the packs
+    __m256i vlo = _mm256_set1_epi32(lo - 1);
+    __m256i vhi = _mm256_set1_epi32(hi);
+    __m256i ones = _mm256_set1_epi8(-1);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sum_t = zero, sum_l = zero, min_t = ones, max_t = zero, min_l = ones, max_l = zero;
+    __m256i m0, m1, m2, m3, mask, t, l;
+    unsigned char b[32];
+    cyg_uint64 s[4];
+    int j;
+    if(lo == (cyg_int32)0x80000000) //lo - 1 would wrap
+        i = n;
+    for(; i + 32 <= n; i += 32)
+    {
+        m0 = _mm256_loadu_si256((const __m256i*)(time + i));
+        m1 = _mm256_loadu_si256((const __m256i*)(time + i + 8));
+        m2 = _mm256_loadu_si256((const __m256i*)(time + i + 16));
+        m3 = _mm256_loadu_si256((const __m256i*)(time + i + 24));
+        m0 = _mm256_andnot_si256(_mm256_cmpgt_epi32(m0, vhi), _mm256_cmpgt_epi32(m0, vlo));
+        m1 = _mm256_andnot_si256(_mm256_cmpgt_epi32(m1, vhi), _mm256_cmpgt_epi32(m1, vlo));
+        m2 = _mm256_andnot_si256(_mm256_cmpgt_epi32(m2, vhi), _mm256_cmpgt_epi32(m2, vlo));
+        m3 = _mm256_andnot_si256(_mm256_cmpgt_epi32(m3, vhi), _mm256_cmpgt_epi32(m3, vlo));
+        mask = _mm256_packs_epi16(_mm256_packs_epi32(m0, m1), _mm256_packs_epi32(m2, m3));
+        mask = _mm256_permutevar8x32_epi32(mask, order);
+        a->count += __builtin_popcount((unsigned)_mm256_movemask_epi8(mask));
+        t = _mm256_loadu_si256((const __m256i*)(temperature + i));
+        l = _mm256_loadu_si256((const __m256i*)(luminosity + i));
+        sum_t = _mm256_add_epi64(sum_t, _mm256_sad_epu8(_mm256_and_si256(mask, t), zero));
+        sum_l = _mm256_add_epi64(sum_l, _mm256_sad_epu8(_mm256_and_si256(mask, l), zero));
+        max_t = _mm256_max_epu8(max_t, _mm256_and_si256(mask, t));
+        max_l = _mm256_max_epu8(max_l, _mm256_and_si256(mask, l));
+        min_t = _mm256_min_epu8(min_t, _mm256_or_si256(_mm256_and_si256(mask, t), _mm256_andnot_si256(mask, ones)));
+        min_l = _mm256_min_epu8(min_l, _mm256_or_si256(_mm256_and_si256(mask, l), _mm256_andnot_si256(mask, ones)));
+    }
+    _mm256_storeu_si256((__m256i*)s, sum_t);
+    a->sum_temperature += s[0] + s[1] + s[2] + s[3];
+    _mm256_storeu_si256((__m256i*)s, sum_l);
+    a->sum_luminosity += s[0] + s[1] + s[2] + s[3];
+    _mm256_storeu_si256((__m256i*)b, min_t);
+    for(j = 0; j < 32; j++) if(b[j] < a->min_temperature) a->min_temperature = b[j];
+    _mm256_storeu_si256((__m256i*)b, max_t);
+    for(j = 0; j < 32; j++) if(b[j] > a->max_temperature) a->max_temperature = b[j];
+    _mm256_storeu_si256((__m256i*)b, min_l);
+    for(j = 0; j < 32; j++) if(b[j] < a->min_luminosity) a->min_luminosity = b[j];
+    _mm256_storeu_si256((__m256i*)b, max_l);
+    for(j = 0; j < 32; j++) if(b[j] > a->max_luminosity) a->max_luminosity = b[j];
+#elif defined(__SSE2__)
+    __m128i vlo = _mm_set1_epi32(lo - 1);
+    __m128i vhi = _mm_set1_epi32(hi);
+    __m128i ones = _mm_set1_epi8(-1);
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum_t = zero, sum_l = zero, min_t = ones, max_t = zero, min_l = ones, max_l = zero;
+    __m128i m0, m1, m2, m3, mask, t, l;
+    unsigned char b[16];
+    cyg_uint64 s[2];
+    int j;
+    if(lo == (cyg_int32)0x80000000) //lo - 1 would wrap
+        i = n;
+    for(; i + 16 <= n; i += 16)
+    {
+        m0 = _mm_loadu_si128((const __m128i*)(time + i));
+        m1 = _mm_loadu_si128((const __m128i*)(time + i + 4));
+        m2 = _mm_loadu_si128((const __m128i*)(time + i + 8));
+        m3 = _mm_loadu_si128((const __m128i*)(time + i + 12));
+        m0 = _mm_andnot_si128(_mm_cmpgt_epi32(m0, vhi), _mm_cmpgt_epi32(m0, vlo));
+        m1 = _mm_andnot_si128(_mm_cmpgt_epi32(m1, vhi), _mm_cmpgt_epi32(m1, vlo));
+        m2 = _mm_andnot_si128(_mm_cmpgt_epi32(m2, vhi), _mm_cmpgt_epi32(m2, vlo));
+        m3 = _mm_andnot_si128(_mm_cmpgt_epi32(m3, vhi), _mm_cmpgt_epi32(m3, vlo));
+        mask = _mm_packs_epi16(_mm_packs_epi32(m0, m1), _mm_packs_epi32(m2, m3));
+        a->count += __builtin_popcount((unsigned)_mm_movemask_epi8(mask));
+        t = _mm_loadu_si128((const __m128i*)(temperature + i));
+        l = _mm_loadu_si128((const __m128i*)(luminosity + i));
+        sum_t = _mm_add_epi64(sum_t, _mm_sad_epu8(_mm_and_si128(mask, t), zero));
+        sum_l = _mm_add_epi64(sum_l, _mm_sad_epu8(_mm_and_si128(mask, l), zero));
+        max_t = _mm_max_epu8(max_t, _mm_and_si128(mask, t));
+        max_l = _mm_max_epu8(max_l, _mm_and_si128(mask, l));
+        min_t = _mm_min_epu8(min_t, _mm_or_si128(_mm_and_si128(mask, t), _mm_andnot_si128(mask, ones)));
+        min_l = _mm_min_epu8(min_l, _mm_or_si128(_mm_and_si128(mask, l), _mm_andnot_si128(mask, ones)));
+    }
+    _mm_storeu_si128((__m128i*)s, sum_t);
+    a->sum_temperature += s[0] + s[1];
+    _mm_storeu_si128((__m128i*)s, sum_l);
+    a->sum_luminosity += s[0] + s[1];
+    _mm_storeu_si128((__m128i*)b, min_t);
+    for(j = 0; j < 16; j++) if(b[j] < a->min_temperature) a->min_temperature = b[j];
+    _mm_storeu_si128((__m128i*)b, max_t);
+    for(j = 0; j < 16; j++) if(b[j] > a->max_temperature) a->max_temperature = b[j];
+    _mm_storeu_si128((__m128i*)b, min_l);
+    for(j = 0; j < 16; j++) if(b[j] < a->min_luminosity) a->min_luminosity = b[j];
+    _mm_storeu_si128((__m128i*)b, max_l);
+    for(j = 0; j < 16; j++) if(b[j] > a->max_luminosity) a->max_luminosity = b[j];
+#endif
+    aggregate_scalar(time + i, temperature + i, luminosity + i, n - i, lo, hi, a);
+}
+
+//get a free block from the message pool for a message of "size" bytes (NULL if the pool is exhausted)
+//the pool is protected by the scheduler lock so that it can also be used by the alarm function
+unsigned char* msg_alloc(int size)
+{
+    unsigned char* block = NULL;
+    cyg_scheduler_lock();
+    if(msg_pool_nfree > 0)
+    {
+        block = msg_pool_free[--msg_pool_nfree];
+        msg_pool_size[(block - msg_pool[0])/MSG_BLOCK_SIZE] = size;
+        msg_pool_station[(block - msg_pool[0])/MSG_BLOCK_SIZE] = MSG_HOST;
+        if(NMSG - msg_pool_nfree > msg_pool_high_water)
+            msg_pool_high_water = NMSG - msg_pool_nfree;
+    }
+    else
+        msg_pool_exhausted++;
+    cyg_scheduler_unlock();
+    return block;
+}
+
+//size of a message of the message pool
+int msg_size(unsigned char* m)
+{
+    return msg_pool_size[(m - msg_pool[0])/MSG_BLOCK_SIZE];
+}
+
+//station whose device sent a message of the message pool (MSG_HOST - not from a device)
+int msg_station(unsigned char* m)
+{
+    return msg_pool_station[(m - msg_pool[0])/MSG_BLOCK_SIZE];
+}
+
+//mark a message of the message pool as sent by the device of station s
+void msg_from(unsigned char* m, int s)
+{
+    msg_pool_station[(m - msg_pool[0])/MSG_BLOCK_SIZE] = s;
+}
+
+//give back a block of the message pool
+void msg_free(unsigned char* m)
+{
+    cyg_scheduler_lock();
+    msg_pool_free[msg_pool_nfree++] = m;
+    cyg_scheduler_unlock();
+}
+
+//get a block of the message pool with the command (reply FALSE) or the reply (reply TRUE) with "opcode" and n
+//arguments (NULL if the pool is exhausted or the protocol table does not allow n arguments)
+unsigned char* msg_encode(unsigned char opcode, const unsigned char* arguments, int n, int reply)
+{
+    unsigned char* m;
+    if(n + 3 > MSG_BLOCK_SIZE || !protocol_valid(opcode, n, reply) || (m = msg_alloc(n + 3)) == NULL)
+        return NULL;
+    protocol_encode(m, opcode, arguments, n, reply);
+    return m;
+}
+
+//copy n registers received from the device of the station of decoder d to the ring buffer of the station (station 0 -
+//also to the rollups, and the log thread appends them to the log and the history)
+//only the registers taken from iread by the device itself ("ordered" - TRGC, TRCACK and BCHK) go to the rollups, and
+//only those of the live decoder: a TRGI may send again registers already received and a replay repeats a capture
+void ingest_registers(frame_decoder* d, unsigned char* registers, int n, int ordered)
+{
+    station_* st = &stations[d->station];
+    cyg_uint32 k;
+    if(d->station > 0)
+    {
+        copyToRingBuffer(st->ring, registers, n);
+        st->registers_ingested += n;
+        return;
+    }
+    mutex_lock_counted(&ring_buffer_mux, &ring_buffer_mux_stats); //lock buffer
+    k = ring->written;
+    copyToRingBuffer(ring, registers, n);
+    if(ordered && d == &st->decoder)
+        rollup_add(registers, n, k);
+    else
+        rollup_skip(k + n);
+    st->registers_ingested += n;
+    cyg_mutex_unlock(&ring_buffer_mux); //unlock buffer
+    if(log_file != NULL || hist_budget > 0)
+        cyg_semaphore_post(&log_pending); //the log thread appends the registers to the log and the history
+}
+
+//start a bulk transfer of station st (before its BTRC is sent)
+//the transfer goes on from the sequence number expected, so a chunk of the transfer before that was late is not taken
+//for a chunk of this one
+void bulk_start(station_* st)
+{
+    st->bulk_rewound = -1;
+    st->bulk_registers = 0;
+    st->bulk_last = cyg_current_time();
+    st->bulk = TRUE;
+}
+
+//acknowledge to the device of station st the chunks of its bulk transfer up to sequence number seq
+//(resend TRUE - ask again for the chunks not acknowledged)
+void bulk_ack(station_* st, int seq, int resend)
+{
+    unsigned char arguments[2];
+    unsigned char* m;
+    arguments[0] = seq;
+    arguments[1] = resend;
+    if((m = msg_encode(BACK, arguments, 2, FALSE)) != NULL)
+        mbox_put(st->mbx_sendingH, m);
+}
+
+//chunk of a bulk transfer received by decoder d
+//a chunk in order goes to the ring buffer and is acknowledged right away, so the device keeps its window full; a chunk
+//out of order is discarded, asking once for those not acknowledged when one was lost, or acknowledging again when it
+//was already received. the chunk without registers ends the transfer: the number of registers received goes to the
+//processing task (station 0)
+void bulk_chunk(frame_decoder* d, unsigned char* message_received, int index_message_received)
+{
+    station_* st = &stations[d->station];
+    int seq = message_received[2];
+    int n = (index_message_received - 3)/5; //number of registers received
+    unsigned long count;
+    unsigned char reply[2];
+    unsigned char* m_;
+    if(d != &st->decoder) //replays and benchmarks: the registers of every chunk, nothing is acknowledged
+    {
+        ingest_registers(d, message_received + 3, n, TRUE);
+        return;
+    }
+    if(!st->bulk) //chunk of a transfer that already ended
+        return;
+    if(seq != st->bulk_expected)
+    {
+        st->bulk_discarded++;
+        if((seq - st->bulk_expected + BULK_SEQ) % BULK_SEQ >= BULK_SEQ/2) //already received
+            bulk_ack(st, (st->bulk_expected + BULK_SEQ - 1) % BULK_SEQ, FALSE);
+        else if(st->bulk_rewound != st->bulk_expected) //the chunks after a lost one are not asked again for every one
+        {
+            st->bulk_rewound = st->bulk_expected;
+            bulk_ack(st, (st->bulk_expected + BULK_SEQ - 1) % BULK_SEQ, TRUE);
+        }
+        return;
+    }
+    st->bulk_expected = (seq + 1) % BULK_SEQ;
+    st->bulk_last = cyg_current_time();
+    st->bulk_chunks++;
+    if(n > 0)
+    {
+        ingest_registers(d, message_received + 3, n, TRUE);
+        st->bulk_registers += n;
+        bulk_ack(st, seq, FALSE);
+        return;
+    }
+    st->bulk = FALSE;
+    if(d->station > 0)
+        return;
+    count = st->bulk_registers < 0xFFFF ? st->bulk_registers : 0xFFFF;
+    reply[0] = count >> 8;
+    reply[1] = count & 0xFF;
+    if((m_ = msg_encode(BTRC, reply, 2, TRUE)) == NULL)
+    {
+        d->dropped++;
+        return;
+    }
+    mbox_put(mbx_processingTaskH, m_);
+}
+
+//pre-process message in receiving thread before sending it to the UI/processing thread
+//the message lives in the decoder buffer, so it is copied to a block of the frame pool when it has to go to another thread
+//the registers of a station other than station 0 go to its own ring buffer, which only its receiving thread writes
+void pre_process_message(frame_decoder* d, unsigned char* message_received, int index_message_received)
+{
+    station_* st = &stations[d->station];
+    unsigned char* m_;
+    unsigned char status;
+    //if it is a message of type transference, copy to ring buffer
+    if(message_received[1] == TRGC || message_received[1] == TRGI || message_received[1] == TRCACK)
+    {
+        if(index_message_received != 3 || message_received[2] != CMD_ERROR)
+            ingest_registers(d, message_received+2, (index_message_received + 1 - 3)/5, message_received[1] != TRGI);
+        status = (index_message_received == 3 && message_received[2] == CMD_ERROR) ? CMD_ERROR : CMD_OK;
+        m_ = msg_encode(message_received[1], &status, 1, TRUE); //message to send to UI/processing
+        if(m_ == NULL)
+        {
+            d->dropped++;
+            return;
+        }
+        msg_from(m_, d->station);
+        if(message_received[1] == TRGC || message_received[1] == TRGI)
+            mbox_put(mbx_UITaskH, m_); //TRGC and TRGI messages go to UI thread
+        else if(message_received[1] == TRCACK && d->station == 0)
+            mbox_put(mbx_processingTaskH, m_); //TRCACK messages go to precessing task
+        else
+            msg_free(m_); //the periodic transfers of the other stations are not processed
+        latency_record(LAT_RECEIVE, message_received[1], d->time_us);
+        return;
+    }
+
+    if(message_received[1] == BCHK)
+    {
+        bulk_chunk(d, message_received, index_message_received);
+        latency_record(LAT_RECEIVE, message_received[1], d->time_us);
+        return;
+    }
+
+    if(message_received[1] == BTRC) //the device refused the bulk transfer, ended it or has none going on
+    {
+        st->bulk = FALSE; //the scheduler of the periodic transfers starts another one after TRANSFER_TIMEOUT
+        latency_record(LAT_RECEIVE, message_received[1], d->time_us);
+        return;
+    }
+
+    if(message_received[1] == NMFL && d->station > 0)
+    {
+        //the memory of the device of another station is drained to its ring buffer right away
+        if((m_ = msg_encode(PTRC, NULL, 0, FALSE)) == NULL)
+        {
+            d->dropped++;
+            return;
+        }
+        mbox_put(st->mbx_sendingH, m_);
+        latency_record(LAT_RECEIVE, message_received[1], d->time_us);
+        return;
+    }
+
+    if(index_message_received >= MSG_BLOCK_SIZE || (m_ = msg_alloc(index_message_received + 1)) == NULL)
+    {
+        d->dropped++;
+        return;
+    }
+    memcpy(m_, message_received, index_message_received + 1);
+    msg_from(m_, d->station);
+    if(m_[1] == NMFL)
+        mbox_put(mbx_processingTaskH, m_);//NMFL message goes to processing task
+    else
+        mbox_put(mbx_UITaskH, m_); //all other messages go to UI task
+    latency_record(LAT_RECEIVE, message_received[1], d->time_us);
+}
+
+//deliver every complete frame in the decoder buffer and keep the incomplete one at the start of the buffer
+//frames of both protocol versions are accepted: protocol v2 frames are unescaped in place and delivered
+//in the same SOM, opcode, arguments, EOM layout as protocol v1 frames
+void decode_frames(frame_decoder* d, int scanned)
+{
+    int i;
+    unsigned char b;
+    for(i = scanned; i < d->length; i++)
+    {
+        b = d->buffer[i];
+        if(b == SOM) //message starts with SOM
+        {
+            d->start = i;
+            d->write = i + 1;
+            d->version = 0;
+            d->escape = FALSE;
+            continue;
+        }
+        if(d->start < 0)
+            continue;
+
+        if(b == EOM || d->write - d->start == MAX_MESSAGE-2) //message ends with EOM
+        {
+            d->buffer[d->write] = EOM;
+            if(d->version == 2 && (b != EOM || d->escape || d->write - d->start - 1 != d->expected))
+                d->malformed++;
+            else if(!protocol_check(d->buffer + d->start, d->write - d->start + 1, TRUE)) //size not allowed by the protocol table
+                d->malformed++;
+            else
+            {
+                d->deliver(d, d->buffer + d->start, d->write - d->start); //pre-process and send the message to right thread
+                d->frames++;
+            }
+            d->start = -1;
+        }
+        else if(d->version == 0 && b < MAX_LEN) //length field of a protocol v2 frame
+        {
+            d->version = 2;
+            d->expected = b;
+        }
+        else if(d->version == 2 && b == ESC)
+        {
+            if(d->escape) //ESC is never escaped twice: without this a run of ESC would fill the buffer
+            {
+                d->malformed++;
+                d->start = -1;
+            }
+            else
+                d->escape = TRUE;
+        }
+        else
+        {
+            if(d->version == 0)
+                d->version = 1;
+            if(d->escape)
+            {
+                b ^= ESC_XOR;
+                d->escape = FALSE;
+            }
+            d->buffer[d->write++] = b;
+        }
+    }
+
+    if(d->start >= 0)
+    {
+        memmove(d->buffer, d->buffer + d->start, d->length - d->start);
+        d->length -= d->start;
+        d->write -= d->start;
+        d->start = 0;
+    }
+    else
+        d->length = 0;
+    if(d->length == RX_BUFFER_SIZE) //a partial frame that fills the buffer is dropped, so there is always room to read
+    {
+        d->dropped++;
+        d->start = -1;
+        d->length = 0;
+    }
+}
+
+//thread to receive messages from the device of station "data"
+//reads every byte the driver has already buffered in one call, blocking only while it is empty
+void receiveFromSerial(cyg_addrword_t data)
+{
+    station_* st = &stations[data];
+    frame_decoder* decoder = &st->decoder;
+    cyg_serial_buf_info_t info;
+    cyg_uint32 len;
+    cyg_uint32 n;
+    Cyg_ErrNo rerr;
+
+    decoder->length = 0;
+    decoder->start = -1;
+    decoder->deliver = pre_process_message;
+    decoder->station = (int)data;
+    while(1)
+    {
+        n = 1;
+        len = sizeof(info);
+        if(cyg_io_get_config(st->serH, CYG_IO_GET_CONFIG_SERIAL_BUFFER_INFO, &info, &len) == ENOERR && info.rx_count > 1)
+            n = info.rx_count;
+        if(n > RX_BUFFER_SIZE - decoder->length)
+            n = RX_BUFFER_SIZE - decoder->length;
+
+        rerr = cyg_io_read(st->serH, decoder->buffer + decoder->length, &n);
+        if(rerr != ENOERR || n == 0)
+            continue;
+        decoder->time_us = current_time_us();
+        st->bytes_received += n;
+        if(capture_file)
+            capture_record(CAPTURE_RX, decoder->buffer + decoder->length, n);
+        decoder->length += n;
+        decode_frames(decoder, decoder->length - n);
+    }
+}
+
+//encode message m (SOM, opcode, arguments, EOM) in the frame format of the protocol version in use
+//returns the size of the frame
+int encode_frame(unsigned char* m, int size, unsigned char* frame)
+{
+    int i;
+    int n = 0;
+    if(protocol_version == 1)
+    {
+        memcpy(frame, m, size);
+        return size;
+    }
+    frame[n++] = SOM;
+    frame[n++] = size - 2; //length of opcode and arguments
+    for(i = 1; i < size - 1; i++)
+    {
+        if(m[i] == SOM || m[i] == EOM || m[i] == ESC)
+        {
+            frame[n++] = ESC;
+            frame[n++] = m[i] ^ ESC_XOR;
+        }
+        else
+            frame[n++] = m[i];
+    }
+    frame[n++] = EOM;
+    return n;
+}
+
+//thread to write to the device of station "data"
+//every message already in the mailbox is coalesced in the transmit buffer and written with a single call
+void writeToSerial (cyg_addrword_t data)
+{
+    static unsigned char tx_buffers[NSTATIONS][TX_BUFFER_SIZE];
+    station_* st = &stations[data];
+    unsigned char* tx_buffer = tx_buffers[data];
+    unsigned char* m;
+    cyg_uint32 n;
+    int batch;
+    while(1)
+    {
+        m=cyg_mbox_get(st->mbx_sendingH); //get message from mailbox
+        n=encode_frame(m, msg_size(m), tx_buffer);
+        msg_free(m);
+        batch = 1;
+
+        if(writer_linger > 0)
+            cyg_thread_delay(writer_linger); //give other messages the chance to join this write
+
+        while(n + MAX_FRAME <= TX_BUFFER_SIZE && (m=cyg_mbox_tryget(st->mbx_sendingH)) != NULL)
+        {
+            n+=encode_frame(m, msg_size(m), tx_buffer+n);
+            msg_free(m);
+            batch++;
+        }
+
+        if(capture_file)
+            capture_record(CAPTURE_TX, tx_buffer, n);
+        err=cyg_io_write(st->serH,tx_buffer,&n); //send to device
+        writer_writes++;
+        st->bytes_sent+=n;
+        writer_messages+=batch;
+        writer_batches[(batch < WRITER_NBATCH ? batch : WRITER_NBATCH) - 1]++;
+    }
+}
+
+//function associated with the alarm that sends to the processing task the message PTRC (start periodic tranfer) planned by the scheduler
+void alarm_func(cyg_handle_t alarmH, cyg_addrword_t data)
+{
+    unsigned char* buffer=msg_encode(PTRC, NULL, 0, FALSE);
+    if(buffer == NULL)
+        return;
+    if(!cyg_mbox_tryput(mbx_processingTaskH,(void*)buffer)) //the alarm function can not block
+        msg_free(buffer);
+}
+
+//determines the ranges of times, in seconds of the day, between two times (hourT1, minuteT1, secondT1) and (hourT2,minuteT2,secondT2)
+//the value NONE can be used to express that a field does not exist; returns the number of ranges (two if the interval crosses midnight)
+int time_ranges(unsigned char hourT1, unsigned char minuteT1, unsigned char secondT1, unsigned char hourT2, unsigned char minuteT2, unsigned char secondT2, cyg_int32* lo, cyg_int32* hi)
+{
+    int time1 = 60*60*hourT1 + 60*minuteT1 + secondT1;
+    int time2 = 60*60*hourT2 + 60*minuteT2 + secondT2;
+    lo[0] = 0;
+    hi[0] = 0x7FFFFFFF;
+    if(hourT2 == NONE && minuteT2 == NONE && secondT2 == NONE && hourT1 == NONE && minuteT1 == NONE && secondT1 == NONE)
+        return 1;
+    lo[0] = time1;
+    if(hourT2 == NONE && minuteT2 == NONE && secondT2 == NONE)
+        return 1;
+    if(time1 <= time2)
+    {
+        hi[0] = time2;
+        return 1;
+    }
+    lo[1] = 0;
+    hi[1] = time2;
+    return 2;
+}
+
+//determines the ranges of times of the n arguments "t" of pr, prd or exp: none, t1 (h,m,s) or t1 and t2 (h,m,s,h,m,s)
+//returns the number of ranges, 0 if n is none of those
+int time_arguments(const unsigned char* t, int n, cyg_int32* lo, cyg_int32* hi)
+{
+    if(n == 6)
+        return time_ranges(t[0], t[1], t[2], t[3], t[4], t[5], lo, hi);
+    if(n == 3)
+        return time_ranges(t[0], t[1], t[2], NONE, NONE, NONE, lo, hi);
+    if(n == 0)
+        return time_ranges(NONE, NONE, NONE, NONE, NONE, NONE, lo, hi);
+    return 0;
+}
+
+/*-------------------------------------------------------------------------+
+| Scheduler of the periodic transfers of station 0
++--------------------------------------------------------------------------*/
+//each periodic transfer is a bulk transfer (BTRC), which drains the device in chunks acknowledged as they arrive, so a
+//lost chunk is sent again instead of lost; when a transfer stalls for TRANSFER_TIMEOUT ticks the chunks not
+//acknowledged are asked again, or the transfer is started again if the device has none going on
+//the alarm fires once for each transfer, planned just before the registers not transferred would fill TRANSFER_FILL
+//percent of the ring buffer of the device at the rate estimated from the transfers, so the device does not
+//overwrite them; the end of each transfer plans the next one. the rate decays when the transfers come back empty,
+//which backs off the transfers up to the period set by mpt while the device is idle. the NMFL of the device (half
+//full) corrects an estimate that was too low, and the size of its ring buffer is asked once with IREG. until the
+//rate is sampled the transfers are at most TRANSFER_PROBE ticks apart
+
+//arm the alarm to send the next PTRC "delay" ticks from now
+void transfer_arm(cyg_handle_t alarmH, cyg_tick_count_t delay)
+{
+    scheduler.next = cyg_current_time() + delay;
+    cyg_alarm_initialize(alarmH, scheduler.next, 0); //one shot
+    cyg_alarm_enable(alarmH);
+}
+
+//start a bulk transfer of station 0, with a window of BULK_WINDOW chunks from the one expected, and check it after
+//TRANSFER_TIMEOUT ticks
+void transfer_send(cyg_handle_t alarmH)
+{
+    unsigned char arguments[2];
+    unsigned char* m;
+    arguments[0] = BULK_WINDOW;
+    arguments[1] = stations[0].bulk_expected;
+    m = msg_encode(BTRC, arguments, 2, FALSE);
+    if(m != NULL)
+    {
+        bulk_start(&stations[0]);
+        mbox_put(stations[0].mbx_sendingH, m);
+        scheduler.transfers++;
+    }
+    scheduler.waiting = TRUE;
+    transfer_arm(alarmH, TRANSFER_TIMEOUT);
+}
+
+//ask station 0 for the size of the ring buffer of the device
+//the IREG is a request of the table of requests like those of the commands, so the reply thread gives its reply to the
+//processing thread and not the one of an "ir" sent before or after it; a lost reply expires with the requests, and the
+//scheduler asks again while NREG is not known (it does not ask when the table is full)
+void transfer_ireg(void)
+{
+    unsigned char* m = msg_encode(IREG, NULL, 0, FALSE);
+    if(m == NULL)
+        return;
+    if(!cyg_semaphore_trywait(&request_slots))
+    {
+        msg_free(m);
+        return;
+    }
+    request_add(0, IREG, TRUE);
+    mbox_put(stations[0].mbx_sendingH, m);
+}
+
+//plan the next PTRC when the device has "pending" registers not transferred (disarm the alarm if the transfer is disabled)
+void transfer_plan(cyg_handle_t alarmH, int pending)
+{
+    cyg_tick_count_t delay = (cyg_tick_count_t)scheduler.period*60*TICKS_PER_SECOND;
+    float left;
+    if(scheduler.period == 0)
+    {
+        cyg_alarm_disable(alarmH);
+        scheduler.next = 0;
+        return;
+    }
+    if(scheduler.samples == 0 && delay > TRANSFER_PROBE) //two transfers close together give the first sample
+        delay = TRANSFER_PROBE;
+    else if(scheduler.nreg > 0 && scheduler.rate > 0)
+    {
+        left = (float)scheduler.nreg*TRANSFER_FILL/100 - pending; //registers the device can still produce
+        if(left <= 0)
+            delay = 0;
+        else if(left*TICKS_PER_SECOND/scheduler.rate < delay)
+            delay = (cyg_tick_count_t)(left*TICKS_PER_SECOND/scheduler.rate);
+    }
+    if(delay < TRANSFER_MIN_DELAY)
+        delay = TRANSFER_MIN_DELAY;
+    transfer_arm(alarmH, delay);
+}
+
+//account the n registers of the bulk transfer that ended and plan the next one
+//the device has no register left, which ends a sample of the rate (registers transferred since the device was last
+//empty over the time elapsed)
+void transfer_done(cyg_handle_t alarmH, int n)
+{
+    cyg_tick_count_t now = cyg_current_time();
+    float sample;
+    scheduler.waiting = FALSE;
+    scheduler.received += n;
+    if(n == 0)
+        scheduler.idle++;
+    if(scheduler.empty == 0 || now - scheduler.empty >= TRANSFER_MIN_DELAY) //shorter samples are joined to the next one
+    {
+        if(scheduler.empty != 0)
+        {
+            sample = (float)scheduler.received*TICKS_PER_SECOND/(now - scheduler.empty);
+            scheduler.rate = scheduler.samples > 0 ? (scheduler.rate + sample)/2 : sample;
+            scheduler.samples++;
+        }
+        scheduler.empty = now;
+        scheduler.received = 0;
+    }
+    transfer_plan(alarmH, 0);
+}
+
+//the device notified that NREG/2 registers are not transferred: plan the next PTRC from there, with the rate raised
+//to the one of this sample if the estimate was lower (a PTRC is sent right away if the rate or NREG are not known)
+//returns the ticks to the next PTRC
+cyg_tick_count_t transfer_half_full(cyg_handle_t alarmH)
+{
+    cyg_tick_count_t now = cyg_current_time();
+    float sample;
+    if(scheduler.period == 0)
+        scheduler.period = TRANSFER_PERIOD;
+    if(scheduler.nreg == 0)
+        transfer_ireg();
+    if(scheduler.nreg > 0 && scheduler.empty != 0 && now > scheduler.empty)
+    {
+        sample = (float)(scheduler.nreg/2)*TICKS_PER_SECOND/(now - scheduler.empty);
+        if(sample > scheduler.rate)
+            scheduler.rate = sample;
+    }
+    if(scheduler.waiting) //the end of the transfer going on plans the next one
+        return 0;
+    if(scheduler.nreg == 0 || scheduler.rate == 0)
+    {
+        transfer_send(alarmH);
+        return 0;
+    }
+    transfer_plan(alarmH, scheduler.nreg/2);
+    return scheduler.next - now;
+}
+
+//function executed in the processing task
+void processingTask(void)
+{
+
+    cyg_handle_t counterH, system_clockH, alarmH;
+    cyg_tick_count_t ticks;
+    cyg_alarm alarm;
+    unsigned how_many_alarms = 0, prev_alarms = 0, tmp_how_many;
+    system_clockH = cyg_real_time_clock();
+    cyg_clock_to_counter(system_clockH, &counterH);
+    cyg_alarm_create(counterH, alarm_func, //create alarm
+    (cyg_addrword_t) &how_many_alarms, &alarmH, &alarm);
+
+
+    int threshold_temperature = 25;
+    int threshold_lum = 2;
+    int size;
+    int num_reads;
+    int n;
+    register_ r;
+    cyg_uint32 k;
+    ring_buffer_* rb;
+    aggregate_ aggregate, part;
+    cyg_int32 lo[2], hi[2];
+    cyg_int32 all_lo[2], all_hi[2];
+    cyg_int32 edge_lo[4], edge_hi[4];
+    cyg_uint32 written, from;
+    int nranges, nedges, nall, histograms;
+    unsigned char reply[PROTOCOL_MAX_ARGUMENTS]; //arguments of the reply to the UI
+
+    while(1)
+    {
+        unsigned char* m;
+        m=cyg_mbox_get(mbx_processingTaskH);
+        if(m[0] != SOM) //message must start with SOM
+        {
+            msg_free(m);
+            continue;
+        }
+        size=msg_size(m);
+        unsigned char* m_;
+        switch(m[1])
+        {
+            case CPT: //check period of tranference
+                reply[0] = scheduler.period;
+                m_ = msg_encode(CPT, reply, 1, TRUE);
+                if(m_ == NULL)
+                    break;
+                mbox_put(mbx_UITaskH, m_); //put message in UI mailbox
+                break;
+            case MPT: //modify period of transference
+                //plan the next transfer with the new period (the reply to the IREG plans it again with the registers pending)
+                scheduler.period = m[2];
+                if(scheduler.period > 0 && scheduler.nreg == 0)
+                    transfer_ireg();
+                if(!scheduler.waiting)
+                    transfer_plan(alarmH, 0);
+                reply[0] = CMD_OK;
+                m_ = msg_encode(MPT, reply, 1, TRUE);
+                if(m_ == NULL)
+                    break;
+                mbox_put(mbx_UITaskH, m_); //put message in UI mailbox
+                break;
+                case CTTL: //check threshold temperature and luminosity for processing
+                reply[0] = threshold_temperature;
+                reply[1] = threshold_lum;
+                m_ = msg_encode(CTTL, reply, 2, TRUE);
+                if(m_ == NULL)
+                    break;
+                mbox_put(mbx_UITaskH, m_); //put message in UI mailbox
+                break;
+
+            case DTTL: //define threshold temperature and luminosity for processing
+                //update thresholds
+                threshold_temperature = m[2];
+                threshold_lum = m[3];
+                reply[0] = CMD_OK;
+                m_ = msg_encode(DTTL, reply, 1, TRUE);
+                if(m_ == NULL)
+                    break;
+                mbox_put(mbx_UITaskH, m_); //put message in UI mailbox
+                break;
+
+            case PR: //process registers (max, min, mean) between instants t1 and t2 (h,m,s)
+            case PRD: //process registers (median, p90, p95, p99 and histogram) between instants t1 and t2 (h,m,s)
+                num_reads = 0;
+                float mean_temperature = 0.0;
+                int min_temperature = 255;
+                int max_temperature = 0;
+                float mean_lum = 0.0;
+                int min_lum = 255;
+                int max_lum = 0;
+                //the message has no time, t1 or t1 and t2
+                nall = time_arguments(m + 2, size - 3, all_lo, all_hi);
+                if(nall == 0)
+                {
+                    reply[0] = CMD_ERROR;
+                    m_ = msg_encode(m[1], reply, 1, TRUE);
+                    if(m_ == NULL)
+                        break;
+                    mbox_put(mbx_UITaskH, m_);
+                    break;
+                }
+
+                //aggregate all registers that are between T1 and T2
+                //the registers of the ring buffer from "from" on come from the summaries for the whole minutes and
+                //from the ring buffer for the seconds at the ends; all the registers kept before are read
+                memcpy(lo, all_lo, nall*sizeof(cyg_int32));
+                memcpy(hi, all_hi, nall*sizeof(cyg_int32));
+                nranges = rollup_ranges(lo, hi, nall, edge_lo, edge_hi, &nedges);
+                histograms = m[1] == PRD && rollup_histograms();
+                rb = ring_acquire();
+                written = rb->written;
+                k = ring_oldest(rb, written);
+                from = (m[1] == PR || histograms) ? rollup_start(k, written, m[1] == PRD) : written;
+                if(from == written) //no summary
+                    nranges = 0;
+                if(m[1] == PRD)
+                {
+                    //the bins of all registers between T1 and T2 are counted, those of the whole minutes merged from
+                    //the histograms of the summaries (if they have them)
+                    ring_histogram(rb, from, written - from, edge_lo, edge_hi, nedges, prd_part);
+                    k = ring_histogram(rb, k, from - k, all_lo, all_hi, nall, prd_bins);
+                    for(n = 0; n < 2*NBINS; n++)
+                        prd_bins[n] += prd_part[n];
+                    k = hist_histogram(all_lo, all_hi, nall, k, prd_bins);
+                    log_histogram(all_lo, all_hi, nall, k, prd_bins);
+                    ring_release();
+                    aggregate_init(&aggregate);
+                    rollup_aggregate(lo, hi, nranges, from, &aggregate, prd_bins);
+                    for(num_reads = 0, n = 0; n < NBINS; n++)
+                        num_reads += prd_bins[n];
+                    if(num_reads == 0)
+                    {
+                        reply[0] = CMD_ERROR;
+                        m_ = msg_encode(PRD, reply, 1, TRUE);
+                        if(m_ == NULL)
+                            break;
+                        mbox_put(mbx_UITaskH, m_);
+                        break;
+                    }
+                    mutex_lock_counted(&print_mux, &print_mux_stats);
+                    histogram_print(prd_bins);
+                    cyg_mutex_unlock(&print_mux);
+                    reply[0] = histogram_quantile(prd_bins, num_reads, 50);
+                    reply[1] = histogram_quantile(prd_bins, num_reads, 90);
+                    reply[2] = histogram_quantile(prd_bins, num_reads, 95);
+                    reply[3] = histogram_quantile(prd_bins, num_reads, 99);
+                    reply[4] = histogram_quantile(prd_bins + NBINS, num_reads, 50);
+                    reply[5] = histogram_quantile(prd_bins + NBINS, num_reads, 90);
+                    reply[6] = histogram_quantile(prd_bins + NBINS, num_reads, 95);
+                    reply[7] = histogram_quantile(prd_bins + NBINS, num_reads, 99);
+                    m_ = msg_encode(PRD, reply, 8, TRUE);
+                    if(m_ == NULL)
+                        break;
+                    mbox_put(mbx_UITaskH, m_);  //put message in UI mailbox
+                    break;
+                }
+                ring_aggregate(rb, from, written - from, edge_lo, edge_hi, nedges, &aggregate);
+                k = ring_aggregate(rb, k, from - k, all_lo, all_hi, nall, &part);
+                aggregate_merge(&aggregate, &part);
+                k = hist_aggregate(all_lo, all_hi, nall, k, &aggregate); //registers older than the ring buffer
+                log_aggregate(all_lo, all_hi, nall, k, &aggregate); //registers older than the history
+                ring_release();
+                rollup_aggregate(lo, hi, nranges, from, &aggregate, NULL);
+                num_reads = aggregate.count;
+                min_temperature = aggregate.min_temperature;
+                max_temperature = aggregate.max_temperature;
+                min_lum = aggregate.min_luminosity;
+                max_lum = aggregate.max_luminosity;
+
+                if(num_reads > 0)
+                {
+                    //determine mean
+                    mean_temperature = ((float)aggregate.sum_temperature/num_reads);
+                    mean_lum = ((float)aggregate.sum_luminosity/num_reads);
+                    reply[0] = max_temperature;
+                    reply[1] = min_temperature;
+                    reply[2] = (int)mean_temperature;
+                    reply[3] = max_lum;
+                    reply[4] = min_lum;
+                    reply[5] = (int)mean_lum;
+                    m_ = msg_encode(PR, reply, 6, TRUE);
+                    if(m_ == NULL)
+                        break;
+                    mbox_put(mbx_UITaskH, m_);  //put message in UI mailbox
+                }
+                else
+                {
+                    reply[0] = CMD_ERROR;
+                    m_ = msg_encode(PR, reply, 1, TRUE);
+                    if(m_ == NULL)
+                        break;
+                    mbox_put(mbx_UITaskH, m_);
+                }
+                break;
+
+            case PTRC: //start periodic tranference
+                if(scheduler.period == 0) //disabled after the alarm fired
+                {
+                    scheduler.waiting = FALSE;
+                    break;
+                }
+                if(scheduler.waiting && stations[0].bulk) //transfer going on
+                {
+                    ticks = cyg_current_time() - stations[0].bulk_last;
+                    if(ticks < TRANSFER_TIMEOUT) //still receiving chunks
+                    {
+                        transfer_arm(alarmH, TRANSFER_TIMEOUT - ticks);
+                        break;
+                    }
+                    scheduler.timeouts++;
+                    bulk_ack(&stations[0], (stations[0].bulk_expected + BULK_SEQ - 1) % BULK_SEQ, TRUE);
+                    stations[0].bulk_last = cyg_current_time();
+                    transfer_arm(alarmH, TRANSFER_TIMEOUT);
+                    break;
+                }
+                if(scheduler.waiting) //the BTRC was lost, refused or the end of the transfer was lost
+                    scheduler.timeouts++;
+                if(scheduler.nreg == 0)
+                    transfer_ireg();
+                mutex_lock_counted(&print_mux, &print_mux_stats);
+                console_printf("STARTING PERIODIC TRANSFERENCE...\n");
+                cyg_mutex_unlock(&print_mux);
+                transfer_send(alarmH); //put message in communication task mailbox
+                break;
+
+            case TRCACK: //tranference acknowledgment
+            case BTRC: //end of a bulk transfer (registers transferred in m[2] and m[3])
+                num_reads = 0;
+                rb = ring_acquire();
+                n = ring_consume(rb, -1, &k);
+                //list registers above threeshold
+                mutex_lock_counted(&print_mux, &print_mux_stats);
+                for(; n > 0; n--, k++)
+                {
+                    if(ring_get(rb, k, &r) && (r.temperature > threshold_temperature || r.luminosity > threshold_lum))
+                    {
+                        console_printf("\nREGISTER:\nHOURS: %d\nMINUTES: %d\nSECONDS: %d\nTEMPERATURE: %d\nLUMINOSITY: %d\n",
+                            r.hours, r.minutes, r.seconds, r.temperature, r.luminosity);
+                        num_reads++;
+                    }
+                }
+                console_printf("PERIODIC TRANFER COMPLETE. %d REGISTERS ABOVE THRESHOLD\n", num_reads);
+                cyg_mutex_unlock(&print_mux);
+                ring_release();
+                if(m[1] == BTRC && scheduler.waiting)
+                    transfer_done(alarmH, (m[2] << 8) | m[3]);
+
+                break;
+
+            case NMFL: //notification of memory full
+                ticks = transfer_half_full(alarmH);
+                mutex_lock_counted(&print_mux, &print_mux_stats);
+                console_printf("NOTIFICATION OF MEMORY HALF FULL. NEXT PERIODIC TRANFER IN %d SECONDS\n", (int)(ticks/TICKS_PER_SECOND));
+                cyg_mutex_unlock(&print_mux);
+                break;
+
+            case IREG: //information about the registers of the device, asked by the scheduler
+                if(size == 7) //NREG, nr, iread and iwrite (not CMD_ERROR)
+                {
+                    scheduler.nreg = m[2];
+                    //registers not transferred (0 as well when all of them are, which the NMFL at half full makes up for)
+                    if(!scheduler.waiting && m[2] > 0)
+                        transfer_plan(alarmH, (m[5] + m[2] - m[4]) % m[2]);
+                }
+                break;
+
+
+        }
+        msg_free(m);
+    }
+}
+
+/*-------------------------------------------------------------------------+
+| Benchmarks (command bench)
++--------------------------------------------------------------------------*/
+unsigned char bench_stream[BENCH_STREAM]; //bytes replayed by the benchmarks
+int bench_stream_len = 0; //number of bytes in bench_stream
+int bench_pos = 0; //position of the next byte to replay
+unsigned long bench_reads = 0; //number of reads done on the replayed stream
+unsigned long bench_frames = 0; //number of frames decoded from the replayed stream
+
+char bench_stack[3][STKSIZE]; //stacks of the writer and readers of the ring buffer benchmark
+cyg_handle_t bench_threadsH[3];
+cyg_thread bench_threads[3];
+cyg_sem_t bench_done; //posted by each thread of the ring buffer benchmark when it ends
+volatile int bench_running = 0; //the writer of the ring buffer benchmark is still writing
+int bench_locking = 0; //readers of the ring buffer benchmark lock the writers out while they read (as the readers did before)
+ring_buffer_ bench_rb; //ring buffer of the ring buffer benchmark (the registers of the station are left alone)
+cyg_uint32 bench_max_write_us = 0; //maximum time of one write to the ring buffer (microseconds)
+unsigned long bench_scans = 0; //number of full scans of the ring buffer (as pr)
+unsigned long bench_consumed = 0; //number of registers consumed (as lr)
+unsigned long bench_overwritten = 0; //number of registers overwritten before they were read
+char bench_station_stack[NSTATIONS][STKSIZE]; //stacks of the receiving threads of the multi-station benchmark
+cyg_handle_t bench_stationsH[NSTATIONS];
+cyg_thread bench_station_threads[NSTATIONS];
+frame_decoder bench_decoders[NSTATIONS]; //frame decoders of the stations of the multi-station benchmark
+ring_buffer_ bench_rings[NSTATIONS]; //ring buffers of the stations of the multi-station benchmark (size 0 - not allocated)
+unsigned long bench_ingested[NSTATIONS]; //registers copied to the ring buffer of each station
+int bench_station_runs = 0; //times each station of the multi-station benchmark decodes the stream
+
+//build a stream like the ones received from the device: TRGC bursts of 39 registers followed by a short reply
+void bench_fill_stream(void)
+{
+    int k = 0;
+    int j;
+    bench_stream_len = 0;
+    while(bench_stream_len + MAX_MESSAGE + 6 <= BENCH_STREAM)
+    {
+        bench_stream[bench_stream_len++] = SOM;
+        bench_stream[bench_stream_len++] = TRGC;
+        for(j = 0; j < 39; j++, k++)
+        {
+            bench_stream[bench_stream_len++] = (k/3600)%24;
+            bench_stream[bench_stream_len++] = (k/60)%60;
+            bench_stream[bench_stream_len++] = k%60;
+            bench_stream[bench_stream_len++] = 20 + k%10;
+            bench_stream[bench_stream_len++] = k%4;
+        }
+        bench_stream[bench_stream_len++] = EOM;
+
+        bench_stream[bench_stream_len++] = SOM;
+        bench_stream[bench_stream_len++] = RCLK;
+        bench_stream[bench_stream_len++] = 12;
+        bench_stream[bench_stream_len++] = 30;
+        bench_stream[bench_stream_len++] = 15;
+        bench_stream[bench_stream_len++] = EOM;
+    }
+}
+
+//read up to n bytes of the replayed stream, returns the number of bytes read
+int bench_read(unsigned char* buffer, int n)
+{
+    if(n > bench_stream_len - bench_pos)
+        n = bench_stream_len - bench_pos;
+    memcpy(buffer, bench_stream + bench_pos, n);
+    bench_pos += n;
+    bench_reads++;
+    return n;
+}
+
+//frame sink of the decoder benchmark
+void bench_count_frame(frame_decoder* d, unsigned char* message, int index_eom)
+{
+    bench_frames++;
+}
+
+//receive loop used before the frame decoder: one read per byte and one malloc per frame
+void bench_byte_loop(void)
+{
+    int receiving_message = FALSE;
+    int index_message_received = 0;
+    unsigned char* message_received = NULL;
+    unsigned char bit_received;
+    while(bench_read(&bit_received, 1) == 1)
+    {
+        if(bit_received == SOM)
+        {
+            free(message_received);
+            message_received = (unsigned char*) malloc(MAX_MESSAGE*sizeof(unsigned char));
+            receiving_message = TRUE;
+            index_message_received = 0;
+            message_received[index_message_received] = SOM;
+            index_message_received++;
+        }
+        else if(receiving_message && (bit_received == EOM || index_message_received == MAX_MESSAGE-2))
+        {
+            receiving_message = FALSE;
+            message_received[index_message_received] = EOM;
+            bench_count_frame(NULL, message_received, index_message_received);
+            free(message_received);
+            message_received = NULL;
+        }
+        else if(receiving_message)
+        {
+            message_received[index_message_received] = bit_received;
+            index_message_received++;
+        }
+    }
+    free(message_received);
+}
+
+//receive loop of the frame decoder, reading as much as fits in its buffer
+void bench_decoder_loop(frame_decoder* d)
+{
+    int n;
+    while((n = bench_read(d->buffer + d->length, RX_BUFFER_SIZE - d->length)) > 0)
+    {
+        d->length += n;
+        decode_frames(d, d->length - n);
+    }
+}
+
+//print the throughput of a benchmark that replayed the stream "runs" times in "ticks"
+void bench_report(char* name, int runs, cyg_tick_count_t ticks)
+{
+    double bytes = (double)bench_stream_len*runs;
+    if(ticks == 0)
+        ticks = 1;
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("%s: %d RUNS, %lu READS, %lu FRAMES IN %d TICKS - %lu BYTES/S, %lu FRAMES/S\n", name, runs, bench_reads, bench_frames,
+        (int)ticks, (unsigned long)(bytes*TICKS_PER_SECOND/ticks), (unsigned long)((double)bench_frames*TICKS_PER_SECOND/ticks));
+    cyg_mutex_unlock(&print_mux);
+}
+
+//writer of the ring buffer benchmark: writes "data" chunks of BENCH_CHUNK registers as fast as possible, as the receiving thread
+void bench_ring_writer(cyg_addrword_t data)
+{
+    unsigned char registers[5*BENCH_CHUNK];
+    cyg_uint64 start;
+    cyg_uint32 us;
+    int i;
+    for(i = 0; i < 5*BENCH_CHUNK; i++)
+        registers[i] = i % 60;
+    for(i = 0; i < (int)data; i++)
+    {
+        start = current_time_us();
+        cyg_mutex_lock(&bench_rb_mux);
+        copyToRingBuffer(&bench_rb, registers, BENCH_CHUNK);
+        cyg_mutex_unlock(&bench_rb_mux);
+        us = (cyg_uint32)(current_time_us() - start);
+        if(us > bench_max_write_us)
+            bench_max_write_us = us;
+        cyg_thread_yield();
+    }
+    bench_running = 0;
+    cyg_semaphore_post(&bench_done);
+}
+
+//reader of the ring buffer benchmark: consumes the registers not yet read (data = 0, as lr)
+//or scans the whole ring buffer (data = 1, as pr) until the writer ends
+void bench_ring_reader(cyg_addrword_t data)
+{
+    ring_buffer_* rb = &bench_rb;
+    register_ r;
+    aggregate_ a;
+    cyg_int32 lo = 0, hi = 0x7FFFFFFF;
+    cyg_uint32 k;
+    unsigned long sum = 0;
+    int n;
+    while(bench_running)
+    {
+        if(bench_locking)
+            cyg_mutex_lock(&bench_rb_mux);
+        if(data == 0)
+        {
+            n = ring_consume(rb, -1, &k);
+            for(; n > 0; n--, k++)
+            {
+                if(ring_get(rb, k, &r))
+                    sum += r.temperature;
+                else
+                    bench_overwritten++;
+                bench_consumed++;
+            }
+        }
+        else
+        {
+            ring_aggregate(rb, ring_oldest(rb, rb->written), rb->size, &lo, &hi, 1, &a);
+            sum += a.sum_temperature;
+            bench_scans++;
+        }
+        if(bench_locking)
+            cyg_mutex_unlock(&bench_rb_mux);
+        cyg_thread_yield();
+    }
+    cyg_semaphore_post(&bench_done);
+}
+
+//frame sink of the multi-station benchmark: the registers of the TRGC frames go to the ring buffer of the station, as
+//pre_process_message does for a station other than station 0
+void bench_station_frame(frame_decoder* d, unsigned char* message, int index_eom)
+{
+    int n;
+    if(message[1] != TRGC)
+        return;
+    n = (index_eom + 1 - 3)/5;
+    copyToRingBuffer(&bench_rings[d->station], message + 2, n);
+    bench_ingested[d->station] += n;
+}
+
+//receiving thread of station "data" of the multi-station benchmark: decodes the stream bench_station_runs times, as
+//much as fits in the decoder buffer at a time
+void bench_station(cyg_addrword_t data)
+{
+    frame_decoder* d = &bench_decoders[data];
+    int runs, pos, n;
+    for(runs = 0; runs < bench_station_runs; runs++)
+    {
+        for(pos = 0; pos < bench_stream_len; pos += n)
+        {
+            n = (RX_BUFFER_SIZE - d->length < bench_stream_len - pos) ? RX_BUFFER_SIZE - d->length : bench_stream_len - pos;
+            memcpy(d->buffer + d->length, bench_stream + pos, n);
+            d->length += n;
+            decode_frames(d, d->length - n);
+        }
+        cyg_thread_yield();
+    }
+    cyg_semaphore_post(&bench_done);
+}
+
+//run the multi-station benchmark: "nstations" stations decode the stream "runs" times each at the same time
+//prints the registers per second of all the stations together, to compare them with the number of stations
+void bench_stations(int nstations, int runs)
+{
+    cyg_tick_count_t ticks;
+    unsigned long total = 0;
+    int i;
+    bench_fill_stream();
+    bench_station_runs = runs;
+    cyg_semaphore_init(&bench_done, 0);
+    for(i = 0; i < nstations; i++)
+    {
+        if(bench_rings[i].size == 0 && !ring_init(&bench_rings[i], NRBUF))
+        {
+            ring_free(&bench_rings[i]);
+            bench_rings[i].size = 0;
+            mutex_lock_counted(&print_mux, &print_mux_stats);
+            console_printf("BENCHMARK: NOT ENOUGH MEMORY\n");
+            cyg_mutex_unlock(&print_mux);
+            return;
+        }
+        bench_decoders[i].length = 0;
+        bench_decoders[i].start = -1;
+        bench_decoders[i].deliver = bench_station_frame;
+        bench_decoders[i].station = i;
+        bench_ingested[i] = 0;
+        cyg_thread_create(PRI+3, bench_station, (cyg_addrword_t)i, "BenchStation", (void*)bench_station_stack[i], STKSIZE,
+            &bench_stationsH[i], &bench_station_threads[i]);
+    }
+    ticks = cyg_current_time();
+    for(i = 0; i < nstations; i++)
+        cyg_thread_resume(bench_stationsH[i]);
+    for(i = 0; i < nstations; i++)
+        cyg_semaphore_wait(&bench_done);
+    ticks = cyg_current_time() - ticks;
+    for(i = 0; i < nstations; i++)
+    {
+        cyg_thread_delete(bench_stationsH[i]);
+        total += bench_ingested[i];
+    }
+    if(ticks == 0)
+        ticks = 1;
+
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("%d STATIONS: %lu REGISTERS IN %d TICKS - %lu REGISTERS/S, %lu PER STATION\n", nstations, total, (int)ticks,
+        (unsigned long)((double)total*TICKS_PER_SECOND/ticks), (unsigned long)((double)total*TICKS_PER_SECOND/ticks/nstations));
+    cyg_mutex_unlock(&print_mux);
+}
+
+//list n registers as the periodic transfer does (all above the thresholds), with "out" - printf to the console
+//directly or console_printf through the console queue, and print the registers listed per second
+void bench_listing(char* name, int n, int (*out)(const char* format, ...))
+{
+    unsigned long dropped;
+    cyg_uint64 us;
+    int i;
+    console_flush(); //both start with the console queue empty
+    fflush(stdout);
+    dropped = console_dropped;
+    us = current_time_us();
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    for(i = 0; i < n; i++)
+        out("\nREGISTER:\nHOURS: %d\nMINUTES: %d\nSECONDS: %d\nTEMPERATURE: %d\nLUMINOSITY: %d\n", i/3600%24, i/60%60,
+            i%60, 30 + i%10, 3);
+    cyg_mutex_unlock(&print_mux);
+    us = current_time_us() - us;
+    if(out != console_printf)
+        fflush(stdout);
+    dropped = console_dropped - dropped;
+    console_flush();
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("%s: %d REGISTERS LISTED IN %lu US - %lu REGISTERS/S, %lu DROPPED\n", name, n, (unsigned long)us,
+        us ? (unsigned long)((cyg_uint64)n*1000000/us) : 0, dropped);
+    cyg_mutex_unlock(&print_mux);
+}
+
+//run the ring buffer benchmark: one writer of "chunks" chunks against one consuming and one scanning reader, on a ring
+//buffer of the size of the one of station 0
+void bench_ring(char* name, int chunks, int locking)
+{
+    cyg_tick_count_t ticks;
+    int i;
+    i = ring_acquire()->size;
+    ring_release();
+    if(!ring_init(&bench_rb, i))
+    {
+        ring_free(&bench_rb);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("BENCHMARK: NOT ENOUGH MEMORY\n");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    bench_locking = locking;
+    bench_running = 1;
+    bench_max_write_us = 0;
+    bench_scans = 0;
+    bench_consumed = 0;
+    bench_overwritten = 0;
+    cyg_semaphore_init(&bench_done, 0);
+    cyg_thread_create(PRI+3, bench_ring_writer, (cyg_addrword_t)chunks, "BenchWriter", (void*)bench_stack[0], STKSIZE,
+        &bench_threadsH[0], &bench_threads[0]);
+    cyg_thread_create(PRI+3, bench_ring_reader, (cyg_addrword_t)0, "BenchConsumer", (void*)bench_stack[1], STKSIZE,
+        &bench_threadsH[1], &bench_threads[1]);
+    cyg_thread_create(PRI+3, bench_ring_reader, (cyg_addrword_t)1, "BenchScanner", (void*)bench_stack[2], STKSIZE,
+        &bench_threadsH[2], &bench_threads[2]);
+    ticks = cyg_current_time();
+    for(i = 0; i < 3; i++)
+        cyg_thread_resume(bench_threadsH[i]);
+    for(i = 0; i < 3; i++)
+        cyg_semaphore_wait(&bench_done);
+    ticks = cyg_current_time() - ticks;
+    for(i = 0; i < 3; i++)
+        cyg_thread_delete(bench_threadsH[i]);
+    ring_free(&bench_rb);
+    if(ticks == 0)
+        ticks = 1;
+
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("%s: %lu REGISTERS/S WRITTEN, MAX WRITE %lu US, %lu SCANS, %lu CONSUMED, %lu OVERWRITTEN BEFORE READ\n", name,
+        (unsigned long)((double)chunks*BENCH_CHUNK*TICKS_PER_SECOND/ticks), (unsigned long)bench_max_write_us,
+        bench_scans, bench_consumed, bench_overwritten);
+    cyg_mutex_unlock(&print_mux);
+}
+
+//aggregate the benchmark columns "runs" times with one of the kernels and print the throughput
+void bench_aggregate(char* name, int runs, int vector, cyg_int32* time, unsigned char* temperature, unsigned char* luminosity)
+{
+    aggregate_ a;
+    cyg_tick_count_t ticks;
+    double registers = (double)BENCH_REGISTERS*runs;
+    int i;
+    ticks = cyg_current_time();
+    for(i = 0; i < runs; i++)
+    {
+        aggregate_init(&a);
+        if(vector)
+            aggregate_span(time, temperature, luminosity, BENCH_REGISTERS, 6*60*60, 18*60*60, &a);
+        else
+            aggregate_scalar(time, temperature, luminosity, BENCH_REGISTERS, 6*60*60, 18*60*60, &a);
+    }
+    ticks = cyg_current_time() - ticks;
+    if(ticks == 0)
+        ticks = 1;
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("%s: %d RUNS OF %d REGISTERS IN %d TICKS - %lu REGISTERS/S, %lu MB/S (count %lu, temperature %d/%d/%lu, luminosity %d/%d/%lu)\n",
+        name, runs, BENCH_REGISTERS, (int)ticks, (unsigned long)(registers*TICKS_PER_SECOND/ticks),
+        (unsigned long)(registers*(sizeof(cyg_int32) + 2)*TICKS_PER_SECOND/ticks/1000000), a.count,
+        a.min_temperature, a.max_temperature, a.sum_temperature, a.min_luminosity, a.max_luminosity, a.sum_luminosity);
+    cyg_mutex_unlock(&print_mux);
+}
+
+//query "runs" times BENCH_WINDOWS windows of "window" seconds spread over a day in a ring buffer of "size" registers,
+//searching the runs of the ring buffer or scanning all of it, and print the time per query
+void bench_window(int size, int window, int runs)
+{
+    static ring_buffer_ rb;
+    unsigned char registers[5*BENCH_CHUNK];
+    aggregate_ a;
+    cyg_int32 lo, hi;
+    cyg_uint64 us[2];
+    unsigned long count[2];
+    cyg_uint32 k, t;
+    int i, j, scan;
+    if(!ring_init(&rb, size))
+    {
+        ring_free(&rb);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("BENCHMARK: NOT ENOUGH MEMORY\n");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    //a day of registers, or one register every second of the days needed to fill the ring buffer
+    for(k = 0; k < (cyg_uint32)size; k += j)
+    {
+        for(j = 0; j < BENCH_CHUNK && k + j < (cyg_uint32)size; j++)
+        {
+            t = (cyg_uint32)((cyg_uint64)(k + j)*24*60*60/(size < 24*60*60 ? size : 24*60*60))%(24*60*60);
+            registers[j*5] = t/3600;
+            registers[j*5+1] = t/60%60;
+            registers[j*5+2] = t%60;
+            registers[j*5+3] = 10 + (k + j)%31;
+            registers[j*5+4] = (k + j)/5%4;
+        }
+        copyToRingBuffer(&rb, registers, j);
+    }
+    for(scan = 0; scan < 2; scan++)
+    {
+        count[scan] = 0;
+        us[scan] = current_time_us();
+        for(i = 0; i < runs; i++)
+        {
+            for(j = 0; j < BENCH_WINDOWS; j++)
+            {
+                lo = (cyg_int32)((cyg_uint32)j*(24*60*60 - window)/BENCH_WINDOWS);
+                hi = lo + window - 1;
+                if(scan)
+                {
+                    aggregate_init(&a);
+                    ring_aggregate_slice(&rb, ring_oldest(&rb, rb.written), 0, size, lo, hi, FALSE, &a);
+                }
+                else
+                    ring_aggregate(&rb, ring_oldest(&rb, rb.written), rb.size, &lo, &hi, 1, &a);
+                count[scan] += a.count;
+            }
+        }
+        us[scan] = current_time_us() - us[scan];
+    }
+    ring_free(&rb);
+
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("%7d REGISTERS, WINDOW %4d S: %lu RUNS, SEARCH %lu NS, SCAN %lu NS PER QUERY (%lu/%lu REGISTERS)\n", size, window,
+        (unsigned long)rb.runs, (unsigned long)(us[0]*1000/((cyg_uint64)runs*BENCH_WINDOWS)),
+        (unsigned long)(us[1]*1000/((cyg_uint64)runs*BENCH_WINDOWS)), count[0], count[1]);
+    cyg_mutex_unlock(&print_mux);
+}
+
+//compress BENCH_REGISTERS registers in blocks of the history, decode them "runs" times and print the compression ratio
+//and the decoding throughput
+void bench_history(char* name, int runs, cyg_int32* time, unsigned char* temperature, unsigned char* luminosity)
+{
+    static unsigned char* code = NULL;
+    static unsigned long offset[BENCH_REGISTERS/HIST_BLOCK + 1]; //start of the code of each block
+    static cyg_int32 t[HIST_BLOCK];
+    static unsigned char T[HIST_BLOCK], L[HIST_BLOCK];
+    unsigned long errors = 0;
+    cyg_uint64 us;
+    int i, j, b;
+    if(code == NULL && (code = (unsigned char*)malloc(HIST_CODE*(BENCH_REGISTERS/HIST_BLOCK))) == NULL)
+    {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("BENCHMARK: NOT ENOUGH MEMORY\n");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    offset[0] = 0;
+    for(b = 0; b < BENCH_REGISTERS/HIST_BLOCK; b++)
+        offset[b + 1] = offset[b] + hist_encode(time + b*HIST_BLOCK, temperature + b*HIST_BLOCK,
+            luminosity + b*HIST_BLOCK, HIST_BLOCK, code + offset[b]);
+    us = current_time_us();
+    for(i = 0; i < runs; i++)
+    {
+        for(b = 0; b < BENCH_REGISTERS/HIST_BLOCK; b++)
+        {
+            hist_decode(code + offset[b], HIST_BLOCK, t, T, L);
+            if(i == 0) //the registers decoded are checked once
+                for(j = 0; j < HIST_BLOCK; j++)
+                    errors += t[j] != time[b*HIST_BLOCK + j] || T[j] != temperature[b*HIST_BLOCK + j] ||
+                        L[j] != luminosity[b*HIST_BLOCK + j];
+        }
+    }
+    us = current_time_us() - us;
+    if(us == 0)
+        us = 1;
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("%s: %d REGISTERS IN %lu BYTES - COMPRESSION %lu.%02lux, DECODED %lu REGISTERS/MS IN %d RUNS (%lu ERRORS)\n",
+        name, BENCH_REGISTERS, offset[BENCH_REGISTERS/HIST_BLOCK],
+        (unsigned long)((cyg_uint64)BENCH_REGISTERS*sizeof(register_)/offset[BENCH_REGISTERS/HIST_BLOCK]),
+        (unsigned long)((cyg_uint64)BENCH_REGISTERS*sizeof(register_)*100/offset[BENCH_REGISTERS/HIST_BLOCK]%100),
+        (unsigned long)((cyg_uint64)BENCH_REGISTERS*runs*1000/us), runs, errors);
+    cyg_mutex_unlock(&print_mux);
+}
+
+//execute the command bench (run benchmark t n times)
+void cmd_bench(int argc, char **argv)
+{
+    static frame_decoder d;
+    cyg_tick_count_t ticks;
+    int runs;
+    int i;
+
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "dec") == 0) {
+        runs = (argc == 3) ? atoi(argv[2]) : 1000;
+        bench_fill_stream();
+
+        bench_reads = 0;
+        bench_frames = 0;
+        ticks = cyg_current_time();
+        for(i = 0; i < runs; i++)
+        {
+            bench_pos = 0;
+            bench_byte_loop();
+        }
+        bench_report("PER-BYTE LOOP", runs, cyg_current_time() - ticks);
+
+        d.length = 0;
+        d.start = -1;
+        d.deliver = bench_count_frame;
+        bench_reads = 0;
+        bench_frames = 0;
+        ticks = cyg_current_time();
+        for(i = 0; i < runs; i++)
+        {
+            bench_pos = 0;
+            bench_decoder_loop(&d);
+        }
+        bench_report("FRAME DECODER", runs, cyg_current_time() - ticks);
+    }
+    else if ((argc == 2 || argc == 3) && strcmp(argv[1], "agg") == 0) {
+        //a day of registers, one every 86400/BENCH_REGISTERS seconds, aggregated from 6:00 to 18:00
+        static cyg_int32* time = NULL;
+        static unsigned char* temperature;
+        static unsigned char* luminosity;
+        runs = (argc == 3) ? atoi(argv[2]) : 100;
+        if(time == NULL)
+        {
+            time = (cyg_int32*)malloc(BENCH_REGISTERS*sizeof(cyg_int32));
+            temperature = (unsigned char*)malloc(BENCH_REGISTERS);
+            luminosity = (unsigned char*)malloc(BENCH_REGISTERS);
+            if(time == NULL || temperature == NULL || luminosity == NULL)
+            {
+                free(time);
+                free(temperature);
+                free(luminosity);
+                time = NULL;
+                mutex_lock_counted(&print_mux, &print_mux_stats);
+                console_printf("BENCHMARK: NOT ENOUGH MEMORY\n");
+                cyg_mutex_unlock(&print_mux);
+                return;
+            }
+            for(i = 0; i < BENCH_REGISTERS; i++)
+            {
+                time[i] = (cyg_int32)((double)i*24*60*60/BENCH_REGISTERS);
+                temperature[i] = 10 + (i*7)%31;
+                luminosity[i] = (i/5)%4;
+            }
+        }
+        bench_aggregate("SCALAR KERNEL", runs, FALSE, time, temperature, luminosity);
+        bench_aggregate("VECTOR KERNEL", runs, TRUE, time, temperature, luminosity);
+    }
+    else if ((argc == 2 || argc == 3) && strcmp(argv[1], "win") == 0) {
+        static const int sizes[] = {4096, 65536, 1048576};
+        static const int windows[] = {60, 600, 6000};
+        int j;
+        runs = (argc == 3) ? atoi(argv[2]) : 10;
+        if(runs < 1)
+            runs = 1;
+        for(i = 0; i < 3; i++)
+            for(j = 0; j < 3; j++)
+                bench_window(sizes[i], windows[j], runs);
+    }
+    else if ((argc == 2 || argc == 3) && strcmp(argv[1], "hist") == 0) {
+        //a register every 5 seconds as the simulator saves them (the temperature goes up every sample and the
+        //luminosity every 16 samples), and samples every 5 seconds of a sensor where the temperature changes in one of 4
+        //samples and the luminosity in one of 16, saved only when they change as the device does
+        static cyg_int32* time = NULL;
+        static unsigned char* temperature;
+        static unsigned char* luminosity;
+        cyg_uint32 seed = 1;
+        runs = (argc == 3) ? atoi(argv[2]) : 10;
+        if(runs < 1)
+            runs = 1;
+        if(time == NULL)
+        {
+            time = (cyg_int32*)malloc(BENCH_REGISTERS*sizeof(cyg_int32));
+            temperature = (unsigned char*)malloc(BENCH_REGISTERS);
+            luminosity = (unsigned char*)malloc(BENCH_REGISTERS);
+            if(time == NULL || temperature == NULL || luminosity == NULL)
+            {
+                free(time);
+                free(temperature);
+                free(luminosity);
+                time = NULL;
+                mutex_lock_counted(&print_mux, &print_mux_stats);
+                console_printf("BENCHMARK: NOT ENOUGH MEMORY\n");
+                cyg_mutex_unlock(&print_mux);
+                return;
+            }
+        }
+        for(i = 0; i < BENCH_REGISTERS; i++)
+        {
+            time[i] = 5*i%(24*60*60);
+            temperature[i] = 15 + i%16;
+            luminosity[i] = i/16%4;
+        }
+        bench_history("PERIODIC REGISTERS", runs, time, temperature, luminosity);
+        for(i = 0; i < BENCH_REGISTERS; i++)
+        {
+            time[i] = i ? time[i-1] : 0;
+            temperature[i] = i ? temperature[i-1] : 20;
+            luminosity[i] = i ? luminosity[i-1] : 0;
+            do
+            {
+                seed = seed*1103515245 + 12345;
+                time[i] = (time[i] + 5)%(24*60*60);
+                if(((seed >> 16) & 3) == 0)
+                    temperature[i] += (((seed >> 20) & 1) && temperature[i] < 40) || temperature[i] == 0 ? 1 : -1;
+                if(((seed >> 24) & 15) == 0)
+                    luminosity[i] += (((seed >> 28) & 1) && luminosity[i] < 3) || luminosity[i] == 0 ? 1 : -1;
+            } while(temperature[i] == (i ? temperature[i-1] : 20) && luminosity[i] == (i ? luminosity[i-1] : 0));
+        }
+        bench_history("SENSOR REGISTERS", runs, time, temperature, luminosity);
+    }
+    else if ((argc == 2 || argc == 3) && strcmp(argv[1], "ring") == 0) {
+        runs = (argc == 3) ? atoi(argv[2]) : 10000;
+        bench_ring("READERS LOCKING THE WRITER", runs, TRUE);
+        bench_ring("READERS WITHOUT LOCKING", runs, FALSE);
+    }
+    else if ((argc == 2 || argc == 3) && strcmp(argv[1], "con") == 0) {
+        runs = (argc == 3) ? atoi(argv[2]) : 500;
+        bench_listing("PRINTF TO THE CONSOLE", runs, printf);
+        bench_listing("CONSOLE QUEUE", runs, console_printf);
+    }
+    else if ((argc == 2 || argc == 3) && strcmp(argv[1], "st") == 0) {
+        runs = (argc == 3) ? atoi(argv[2]) : 1000;
+        for(i = 1; i <= NSTATIONS; i++)
+            bench_stations(i, runs);
+    }
+    else {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+    }
+}
+
+/*-------------------------------------------------------------------------+
+| Capture and replay of the serial traffic (commands cap and rep)
++--------------------------------------------------------------------------*/
+//a capture file starts with "WSCAP1" followed by one record per read/write of the device:
+//direction (1 byte), ticks since the start of the capture (4 bytes), size (2 bytes), bytes read/written
+const char CaptureMagic[] = "WSCAP1";
+
+//append a record to the capture file
+void capture_record(int direction, unsigned char* data, int size)
+{
+    unsigned char header[7];
+    cyg_uint32 ticks;
+    cyg_mutex_lock(&capture_mux);
+    if(capture_file != NULL)
+    {
+        ticks = (cyg_uint32)(cyg_current_time() - capture_start);
+        header[0] = direction;
+        header[1] = ticks & 0xFF;
+        header[2] = (ticks >> 8) & 0xFF;
+        header[3] = (ticks >> 16) & 0xFF;
+        header[4] = (ticks >> 24) & 0xFF;
+        header[5] = size & 0xFF;
+        header[6] = (size >> 8) & 0xFF;
+        fwrite(header, 1, sizeof(header), capture_file);
+        fwrite(data, 1, size, capture_file);
+    }
+    cyg_mutex_unlock(&capture_mux);
+}
+
+//execute the command cap (start/stop capture of serial traffic)
+void cmd_cap(int argc, char **argv)
+{
+    FILE* f = NULL;
+    if (argc == 2 && (f = fopen(argv[1], "wb")) == NULL) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("CAPTURE: CAN NOT OPEN %s\n", argv[1]);
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    if (argc > 2) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+
+    cyg_mutex_lock(&capture_mux);
+    if(capture_file != NULL)
+        fclose(capture_file);
+    capture_file = f;
+    if(f != NULL)
+    {
+        fwrite(CaptureMagic, 1, strlen(CaptureMagic), f);
+        capture_start = cyg_current_time();
+    }
+    cyg_mutex_unlock(&capture_mux);
+
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf(f != NULL ? "CAPTURE: STARTED\n" : "CAPTURE: STOPPED\n");
+    cyg_mutex_unlock(&print_mux);
+}
+
+//execute the command rep (replay the bytes read in a capture through the receiving pipeline)
+//the bytes go through a decoder of their own to pre_process_message, so transfers reach the ring buffer
+//and TRCACK the processing task as if they came from the device (the registers of every chunk of a bulk transfer
+//are taken, also those sent again)
+void cmd_rep(int argc, char **argv)
+{
+    static frame_decoder d;
+    unsigned char header[7];
+    char magic[sizeof(CaptureMagic)];
+    cyg_tick_count_t start, ticks;
+    unsigned long records = 0;
+    unsigned long bytes = 0;
+    int recorded_speed;
+    int size;
+    FILE* f;
+
+    if (argc < 2 || argc > 3) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    recorded_speed = (argc == 3) ? atoi(argv[2]) : 1;
+    f = fopen(argv[1], "rb");
+    if (f == NULL || fread(magic, 1, strlen(CaptureMagic), f) != strlen(CaptureMagic) || strncmp(magic, CaptureMagic, strlen(CaptureMagic)) != 0) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("REPLAY: %s IS NOT A CAPTURE\n", argv[1]);
+        cyg_mutex_unlock(&print_mux);
+        if(f != NULL)
+            fclose(f);
+        return;
+    }
+
+    d.length = 0;
+    d.start = -1;
+    d.deliver = pre_process_message;
+    d.station = 0;
+    d.frames = 0;
+    d.malformed = 0;
+    start = cyg_current_time();
+    while(fread(header, 1, sizeof(header), f) == sizeof(header))
+    {
+        ticks = header[1] | (header[2] << 8) | (header[3] << 16) | ((cyg_tick_count_t)header[4] << 24);
+        size = header[5] | (header[6] << 8);
+        if(header[0] != CAPTURE_RX) //bytes written to the device are not replayed
+        {
+            fseek(f, size, SEEK_CUR);
+            continue;
+        }
+        if(recorded_speed && cyg_current_time() < start + ticks)
+            cyg_thread_delay(start + ticks - cyg_current_time());
+
+        while(size > 0) //a record never holds more than a read, but the decoder may hold a partial frame
+        {
+            int n = RX_BUFFER_SIZE - d.length;
+            if(n > size)
+                n = size;
+            if(fread(d.buffer + d.length, 1, n, f) != n)
                 break;
+            d.length += n;
+            d.time_us = current_time_us();
+            decode_frames(&d, d.length - n);
+            size -= n;
+            bytes += n;
+        }
+        records++;
+    }
+    ticks = cyg_current_time() - start;
+    fclose(f);
 
-            case DTTL: //define threshold temperature and luminosity for processing
-                //update thresholds
-                threshold_temperature = m[2];
-                threshold_lum = m[3];
-                m_ = (unsigned char*)malloc(4*sizeof(unsigned char));
-                m_[0] = SOM;
-                m_[1] = DTTL;
-                m_[2] = CMD_OK;
-                m_[4] = EOM;
-                cyg_mbox_put(mbx_UITaskH, m_); //put message in UI mailbox
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    console_printf("REPLAY: %lu RECORDS, %lu BYTES, %lu FRAMES, %lu MALFORMED IN %d TICKS - %lu BYTES/S\n", records, bytes, d.frames, d.malformed,
+        (int)ticks, (unsigned long)((double)bytes*TICKS_PER_SECOND/(ticks ? ticks : 1)));
+    cyg_mutex_unlock(&print_mux);
+}
+
+/*-------------------------------------------------------------------------+
+| Register log (command log)
++--------------------------------------------------------------------------*/
+//the registers are appended to segment files of LOG_SEGMENT registers (segNNNNN.log in the directory of the log), each
+//starting with "WSLOG1"; a register takes LOG_RECORD bytes: hours, minutes, seconds, temperature, luminosity and a check
+//byte (complement of the sum of the others), so that a record torn by a crash is found when the log is opened again
+const char LogMagic[] = "WSLOG1";
+
+//check byte of a record of the log
+unsigned char log_check(unsigned char* record)
+{
+    return ~(record[0] + record[1] + record[2] + record[3] + record[4]) & 0xFF;
+}
+
+//path of segment s of the log
+void log_path(char* path, int s)
+{
+    sprintf(path, "%s/seg%05d.log", log_dir, s);
+}
+
+//add a record, number n of the log, to the index of the log
+//returns FALSE if there is not enough memory for the index
+int log_index_add(cyg_uint32 n, unsigned char* record)
+{
+    int b = n/LOG_BLOCK;
+    cyg_int32 time = 60*60*record[0] + 60*record[1] + record[2];
+    log_block_* index;
+    if(b >= log_index_size)
+    {
+        index = (log_block_*)realloc(log_index, 2*(b + 1)*sizeof(log_block_));
+        if(index == NULL)
+            return FALSE;
+        log_index = index;
+        log_index_size = 2*(b + 1);
+    }
+    if(n % LOG_BLOCK == 0)
+    {
+        aggregate_init(&log_index[b].a);
+        log_index[b].min_time = time;
+        log_index[b].max_time = time;
+    }
+    aggregate_scalar(&time, record + 3, record + 4, 1, time, time, &log_index[b].a);
+    if(time < log_index[b].min_time) log_index[b].min_time = time;
+    if(time > log_index[b].max_time) log_index[b].max_time = time;
+    return TRUE;
+}
+
+//index the records of segment s of the log, up to the first torn record
+//returns the number of records (-1 if the segment does not exist or is not a segment of the log, -2 if there is not
+//enough memory for the index)
+int log_load_segment(int s)
+{
+    static unsigned char buffer[LOG_RECORD*LOG_BLOCK];
+    char path[LOG_PATH];
+    FILE* f;
+    int n = 0, got, i;
+    log_path(path, s);
+    if((f = fopen(path, "rb")) == NULL)
+        return -1;
+    if(fread(buffer, 1, LOG_RECORD, f) != LOG_RECORD || memcmp(buffer, LogMagic, LOG_RECORD) != 0)
+    {
+        fclose(f);
+        return -1;
+    }
+    while(n < LOG_SEGMENT && (got = fread(buffer, LOG_RECORD, LOG_BLOCK, f)) > 0)
+    {
+        for(i = 0; i < got && buffer[i*LOG_RECORD+5] == log_check(buffer + i*LOG_RECORD); i++, n++)
+        {
+            if(!log_index_add(log_written, buffer + i*LOG_RECORD))
+            {
+                fclose(f);
+                return -2;
+            }
+            log_written++;
+        }
+        if(i < got)
+            break;
+    }
+    fclose(f);
+    return n;
+}
+
+//open the log in directory "dir": the segments found are indexed and the registers are appended after the last record
+//found whole, overwriting a torn one; returns FALSE if the segment to append to can not be opened
+//called with log_mux locked
+int log_open(char* dir)
+{
+    static int opened = FALSE;
+    char path[LOG_PATH];
+    ring_buffer_* rb;
+    cyg_uint32 before = log_written;
+    int s, n;
+    strcpy(log_dir, dir);
+    log_written = 0;
+    for(s = 0; (n = log_load_segment(s)) == LOG_SEGMENT; s++)
+        ;
+    if(n == -2)
+        return FALSE;
+    if(log_written != before) //not the log that was stopped: its registers are older than those of the ring buffer
+        log_nruns = 0;
+    log_path(path, s);
+    if(n > 0)
+    {
+        if((log_file = fopen(path, "r+b")) != NULL)
+            fseek(log_file, LOG_RECORD*(1 + n), SEEK_SET);
+    }
+    else if((log_file = fopen(path, "wb")) != NULL)
+        fwrite(LogMagic, 1, LOG_RECORD, log_file);
+    if(log_file == NULL)
+        return FALSE;
+    //the registers of the ring buffer are appended, and when the log is started again, those received while it was stopped
+    if(!opened)
+    {
+        rb = ring_acquire();
+        log_next = ring_oldest(rb, rb->written);
+        ring_release();
+        opened = TRUE;
+    }
+    return TRUE;
+}
+
+//close the log (called with log_mux locked)
+void log_close(void)
+{
+    if(log_file != NULL)
+        fclose(log_file);
+    if(log_reader != NULL)
+        fclose(log_reader);
+    log_file = NULL;
+    log_reader = NULL;
+}
+
+//append to the log the registers written to the ring buffer since the last time, and make them durable
+//an error stops the log and is printed once log_mux is unlocked (cmd_lr locks log_mux while it holds print_mux)
+void log_append(void)
+{
+    ring_buffer_* rb = ring_acquire();
+    cyg_uint32 written = rb->written;
+    unsigned char record[LOG_RECORD];
+    char path[LOG_PATH];
+    const char* error = NULL;
+    register_ r;
+    cyg_mutex_lock(&log_mux);
+    if(log_file != NULL && written - log_next > (cyg_uint32)rb->size) //overwritten before they were appended
+    {
+        log_lost += written - rb->size - log_next;
+        log_next = written - rb->size;
+    }
+    for(; log_file != NULL && log_next != written; log_next++)
+    {
+        if(!ring_get(rb, log_next, &r))
+        {
+            log_lost++;
+            continue;
+        }
+        record[0] = r.hours;
+        record[1] = r.minutes;
+        record[2] = r.seconds;
+        record[3] = r.temperature;
+        record[4] = r.luminosity;
+        record[5] = log_check(record);
+        if(fwrite(record, 1, LOG_RECORD, log_file) != LOG_RECORD || !log_index_add(log_written, record))
+        {
+            log_close();
+            error = "LOG: CAN NOT APPEND REGISTERS, STOPPED\n";
+            break;
+        }
+        log_run_add(log_next, log_written);
+        log_written++;
+        if(log_written % LOG_SEGMENT == 0) //next segment (the full one is made durable before it is closed)
+        {
+            fflush(log_file);
+            fsync(fileno(log_file));
+            fclose(log_file);
+            log_path(path, log_written/LOG_SEGMENT);
+            if((log_file = fopen(path, "wb")) == NULL || fwrite(LogMagic, 1, LOG_RECORD, log_file) != LOG_RECORD)
+            {
+                log_close();
+                error = "LOG: CAN NOT CREATE THE NEXT SEGMENT, STOPPED\n";
                 break;
+            }
+        }
+    }
+    if(log_file != NULL && (fflush(log_file) != 0 || fsync(fileno(log_file)) != 0)) //once per batch of registers
+    {
+        log_close();
+        error = "LOG: CAN NOT WRITE REGISTERS TO THE DISK, STOPPED\n";
+    }
+    if(error != NULL)
+        log_errors++;
+    cyg_mutex_unlock(&log_mux);
+    ring_release();
+    if(error != NULL)
+    {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("%s", error);
+        cyg_mutex_unlock(&print_mux);
+    }
+}
+
+//read "count" records of the log from number n (all in the same segment) to "buffer"
+//returns FALSE if they can not be read (called with log_mux locked)
+int log_read(cyg_uint32 n, int count, unsigned char* buffer)
+{
+    char path[LOG_PATH];
+    int s = n/LOG_SEGMENT;
+    if(log_reader == NULL || log_reader_segment != s)
+    {
+        if(log_reader != NULL)
+            fclose(log_reader);
+        log_path(path, s);
+        log_reader = fopen(path, "rb");
+        log_reader_segment = s;
+        if(log_reader == NULL)
+            return FALSE;
+    }
+    return fseek(log_reader, LOG_RECORD*(1 + n % LOG_SEGMENT), SEEK_SET) == 0 &&
+        fread(buffer, LOG_RECORD, count, log_reader) == (size_t)count;
+}
+
+//register "ring" of the ring buffer is appended to the log as register n: it starts a run unless it follows the last one
+//(when LOG_RUNS are remembered the oldest is forgotten, and log_end takes its registers as older than all the others)
+void log_run_add(cyg_uint32 ring, cyg_uint32 n)
+{
+    if(log_nruns > 0 && ring - log_runs[log_nruns - 1].ring == n - log_runs[log_nruns - 1].log)
+        return;
+    if(log_nruns == LOG_RUNS)
+    {
+        memmove(log_runs, log_runs + 1, (LOG_RUNS - 1)*sizeof(log_run_));
+        log_nruns--;
+    }
+    log_runs[log_nruns].ring = ring;
+    log_runs[log_nruns].log = n;
+    log_nruns++;
+}
+
+//number of registers of the log older than register "oldest" of the ring buffer (0 if the log is stopped)
+//the runs give the number in the log of the registers of the ring buffer, as the ones lost leave gaps; registers of
+//the log older than all the runs (appended before the log was opened) are older than any of the ring buffer
+//called with log_mux locked
+cyg_uint32 log_end(cyg_uint32 oldest)
+{
+    cyg_uint32 end;
+    int i;
+    if(log_file == NULL)
+        return 0;
+    if((cyg_int32)(log_next - oldest) <= 0 || log_nruns == 0)
+        return log_written;
+    for(i = log_nruns - 1; i >= 0 && (cyg_int32)(oldest - log_runs[i].ring) < 0; i--)
+        ;
+    if(i < 0)
+        return log_runs[0].log;
+    end = (i + 1 < log_nruns) ? log_runs[i + 1].log : log_written; //registers lost after the run are not in the log
+    return (oldest - log_runs[i].ring < end - log_runs[i].log) ? log_runs[i].log + (oldest - log_runs[i].ring) : end;
+}
+
+//copy register n of the log to r (returns FALSE if it can not be read)
+int log_get(cyg_uint32 n, register_* r)
+{
+    unsigned char record[LOG_RECORD];
+    int ok;
+    cyg_mutex_lock(&log_mux);
+    ok = log_read(n, 1, record);
+    cyg_mutex_unlock(&log_mux);
+    if(!ok)
+        return FALSE;
+    r->hours = record[0];
+    r->minutes = record[1];
+    r->seconds = record[2];
+    r->temperature = record[3];
+    r->luminosity = record[4];
+    return TRUE;
+}
+
+//copy to the columns up to "count" registers of the log from number n, with one read of at most LOG_BLOCK records
+//of the same segment; returns the number of registers copied (0 if they can not be read)
+int log_copy(cyg_uint32 n, int count, cyg_int32* time, unsigned char* temperature, unsigned char* luminosity)
+{
+    static unsigned char buffer[LOG_RECORD*LOG_BLOCK];
+    unsigned char* record = buffer;
+    int i;
+    if(count > LOG_BLOCK)
+        count = LOG_BLOCK;
+    if(count > (int)(LOG_SEGMENT - n % LOG_SEGMENT))
+        count = LOG_SEGMENT - n % LOG_SEGMENT;
+    cyg_mutex_lock(&log_mux);
+    if(!log_read(n, count, buffer))
+        count = 0;
+    for(i = 0; i < count; i++, record += LOG_RECORD)
+    {
+        time[i] = 60*60*record[0] + 60*record[1] + record[2];
+        temperature[i] = record[3];
+        luminosity[i] = record[4];
+    }
+    cyg_mutex_unlock(&log_mux);
+    return count;
+}
+
+//aggregate the registers of the log older than register "oldest" of the ring buffer with the time within one of the
+//ranges [lo, hi]; the index gives the blocks entirely within a range or outside all of them, so only the blocks
+//across the bounds of a range are read from the segments
+void log_aggregate(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 oldest, aggregate_* a)
+{
+    static unsigned char buffer[LOG_RECORD*LOG_BLOCK];
+    static cyg_int32 time[LOG_BLOCK];
+    static unsigned char temperature[LOG_BLOCK], luminosity[LOG_BLOCK];
+    cyg_uint32 end, b, n, i;
+    int j, loaded;
+    cyg_mutex_lock(&log_mux);
+    end = log_end(oldest);
+    for(b = 0; b*LOG_BLOCK < end; b++)
+    {
+        n = (end - b*LOG_BLOCK < LOG_BLOCK) ? end - b*LOG_BLOCK : LOG_BLOCK;
+        loaded = FALSE;
+        for(j = 0; j < nranges; j++)
+        {
+            if(log_index[b].max_time < lo[j] || log_index[b].min_time > hi[j])
+                continue;
+            if(n == LOG_BLOCK && log_index[b].min_time >= lo[j] && log_index[b].max_time <= hi[j])
+            {
+                aggregate_merge(a, &log_index[b].a);
+                continue;
+            }
+            if(!loaded)
+            {
+                if(!log_read(b*LOG_BLOCK, n, buffer))
+                    break;
+                for(i = 0; i < n; i++)
+                {
+                    time[i] = 60*60*buffer[i*LOG_RECORD] + 60*buffer[i*LOG_RECORD+1] + buffer[i*LOG_RECORD+2];
+                    temperature[i] = buffer[i*LOG_RECORD+3];
+                    luminosity[i] = buffer[i*LOG_RECORD+4];
+                }
+                loaded = TRUE;
+            }
+            aggregate_span(time, temperature, luminosity, n, lo[j], hi[j], a);
+        }
+    }
+    cyg_mutex_unlock(&log_mux);
+}
+
+//count in the histograms "bins" the registers of the log older than register "oldest" of the ring buffer with the time
+//within one of the ranges [lo, hi]; the index has no histograms, so every block within a range is read
+void log_histogram(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 oldest, cyg_uint32* bins)
+{
+    static unsigned char buffer[LOG_RECORD*LOG_BLOCK];
+    static cyg_int32 time[LOG_BLOCK];
+    static unsigned char temperature[LOG_BLOCK], luminosity[LOG_BLOCK];
+    cyg_uint32 end, b, n, i;
+    int j, loaded;
+    cyg_mutex_lock(&log_mux);
+    end = log_end(oldest);
+    for(b = 0; b*LOG_BLOCK < end; b++)
+    {
+        n = (end - b*LOG_BLOCK < LOG_BLOCK) ? end - b*LOG_BLOCK : LOG_BLOCK;
+        loaded = FALSE;
+        for(j = 0; j < nranges; j++)
+        {
+            if(log_index[b].max_time < lo[j] || log_index[b].min_time > hi[j])
+                continue;
+            if(!loaded)
+            {
+                if(!log_read(b*LOG_BLOCK, n, buffer))
+                    break;
+                for(i = 0; i < n; i++)
+                {
+                    time[i] = 60*60*buffer[i*LOG_RECORD] + 60*buffer[i*LOG_RECORD+1] + buffer[i*LOG_RECORD+2];
+                    temperature[i] = buffer[i*LOG_RECORD+3];
+                    luminosity[i] = buffer[i*LOG_RECORD+4];
+                }
+                loaded = TRUE;
+            }
+            histogram_span(time, temperature, luminosity, n, lo[j], hi[j], bins);
+        }
+    }
+    cyg_mutex_unlock(&log_mux);
+}
+
+//thread that appends the registers to the log and to the compressed history, woken by the receiving thread when it
+//writes to the ring buffer
+void logTask(void)
+{
+    for(;;)
+    {
+        cyg_semaphore_wait(&log_pending);
+        log_append();
+        hist_append();
+    }
+}
+
+//executes command log (start the register log in directory d, stop it if none)
+void cmd_log(int argc, char **argv)
+{
+    int ok = FALSE;
+    cyg_uint32 n;
+    if (argc > 2 || (argc == 2 && strlen(argv[1]) > LOG_PATH - 16)) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+
+    cyg_mutex_lock(&log_mux);
+    log_close();
+    if(argc == 2)
+        ok = log_open(argv[1]);
+    n = log_written;
+    cyg_mutex_unlock(&log_mux);
+    if(ok)
+        cyg_semaphore_post(&log_pending);
+
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    if(argc == 1)
+        console_printf("LOG: STOPPED\n");
+    else if(ok)
+        console_printf("LOG: STARTED, %lu REGISTERS IN %lu SEGMENTS\n", (unsigned long)n, (unsigned long)(n/LOG_SEGMENT + 1));
+    else
+        console_printf("LOG: CAN NOT OPEN %s\n", argv[1]);
+    cyg_mutex_unlock(&print_mux);
+}
+
+/*-------------------------------------------------------------------------+
+| Compressed register history (command hist)
++--------------------------------------------------------------------------*/
+//the registers written to the ring buffer are also kept, in blocks of HIST_BLOCK registers, with each register coded
+//as the difference from the one before (the first one from zero); the code of a block starts with a byte with the
+//greatest common divisor of the times between its registers (the unit, 0 if above 255 s), and then:
+//00xxxxxx - the last difference repeated x+1 times
+//01kkdddd - time d units later and temperature (kk 0 - one more, 1 - one less) or luminosity (2 - one more, 3 - one less)
+//1ffTTTLL - a new difference, followed by the bytes its fields need:
+//  ff - time (0 - same difference as before, 1 - 1 byte, 2 - 2 bytes, 3 - hours, minutes and seconds of the register)
+//  TTT - temperature (0 to 6 - difference -3 to 3, 7 - 1 byte with the temperature of the register)
+//  LL - luminosity (0 - same, 1 - one more, 2 - one less, 3 - 1 byte with the luminosity of the register)
+//the device samples with the same period and only saves a register when the temperature or the luminosity changes,
+//so most registers take one byte or less; the oldest blocks are freed when the history takes more memory than
+//hist_budget
+
+//greatest common divisor of a and b
+cyg_int32 hist_gcd(cyg_int32 a, cyg_int32 b)
+{
+    cyg_int32 r;
+    while(b != 0)
+    {
+        r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
 
-            case PR: //process registers (max, min, mean) between instants t1 and t2 (h,m,s)
-                num_reads = 0;
-                float mean_temperature = 0.0;
-                int min_temperature = 255;
-                int max_temperature = 0;
-                float mean_lum = 0.0;
-                int min_lum = 255;
-                int max_lum = 0;
-                int hour1, minute1, second1, hour2, minute2, second2;
-                //depending on the size of the message, determine fields that user inserted
-                if(size == 9)
+//code n registers in "code" (at most 6 bytes per register and the unit), returns the number of bytes
+int hist_encode(const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity, int n,
+    unsigned char* code)
+{
+    static const signed char steps[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}}; //differences of the short form
+    cyg_int32 t = 0, dt = 0, last, unit = 0;
+    int T = 0, L = 0, dT = 0, dL = 0, repeat = 0, size = 0, i, k;
+    unsigned char* header;
+    for(i = 1; i < n; i++)
+        if(time[i] > time[i-1])
+            unit = hist_gcd(time[i] - time[i-1], unit);
+    code[size++] = (unit < 0x100) ? unit : 0;
+    for(i = 0; i < n; i++)
+    {
+        if(time[i] - t == dt && temperature[i] - T == dT && luminosity[i] - L == dL)
+        {
+            if(++repeat == HIST_REPEAT)
+            {
+                code[size++] = repeat - 1;
+                repeat = 0;
+            }
+        }
+        else
+        {
+            if(repeat > 0)
+                code[size++] = repeat - 1;
+            repeat = 0;
+            last = dt;
+            dt = time[i] - t;
+            dT = temperature[i] - T;
+            dL = luminosity[i] - L;
+            for(k = 0; k < 4 && (steps[k][0] != dT || steps[k][1] != dL); k++)
+                ;
+            if(k < 4 && code[0] != 0 && dt >= 0 && dt % code[0] == 0 && dt/code[0] < 0x10)
+                code[size++] = 0x40 | (k << 4) | (dt/code[0]);
+            else
+            {
+                header = &code[size++];
+                *header = 0x80;
+                if(dt == last)
+                    ;
+                else if(dt < 0 || dt >= 0x10000)
                 {
-                    hour1 = m[2];
-                    minute1 = m[3];
-                    second1 = m[4];
-                    hour2 = m[5];
-                    minute2 = m[6];
-                    second2 = m[7];
+                    *header |= 3 << 5;
+                    code[size++] = time[i]/3600;
+                    code[size++] = time[i]/60%60;
+                    code[size++] = time[i]%60;
                 }
-                else if(size == 6)
+                else if(dt >= 0x100)
                 {
-                    hour1 = m[2];
-                    minute1 = m[3];
-                    second1 = m[4];
-                    hour2 = NONE;
-                    minute2 = NONE;
-                    second2 = NONE;
+                    *header |= 2 << 5;
+                    code[size++] = dt & 0xFF;
+                    code[size++] = dt >> 8;
                 }
-                else if(size == 3)
+                else
                 {
-                    hour1 = NONE;
-                    minute1 = NONE;
-                    second1 = NONE;
-                    hour2 = NONE;
-                    minute2 = NONE;
-                    second2 = NONE;
+                    *header |= 1 << 5;
+                    code[size++] = dt;
                 }
+                if(dT >= -3 && dT <= 3)
+                    *header |= (dT + 3) << 2;
                 else
                 {
-                    m_ = (unsigned char*)malloc(4*sizeof(unsigned char));
-                    m_[0] = SOM;
-                    m_[1] = PR;
-                    m_[2] = CMD_ERROR;
-                    m_[3] = EOM;
-                    cyg_mbox_put(mbx_UITaskH, m_);
-                    break;
+                    *header |= 7 << 2;
+                    code[size++] = temperature[i];
                 }
-
-                cyg_mutex_lock(&ring_buffer_mux); //lock buffer
-                //read all registers that are between T1 and T2
-                int aux_iread = (iwrite - nr);
-                while(aux_iread < 0)
-                aux_iread = aux_iread + NRBUF;
-
-                while(nr > 0)
+                if(dL == 1)
+                    *header |= 1;
+                else if(dL == -1)
+                    *header |= 2;
+                else if(dL != 0)
                 {
-                    if(isBetweenT1andT2(hour1, minute1, second1, hour2, minute2, second2, RingBuffer[aux_iread].hours, RingBuffer[aux_iread].minutes, RingBuffer[aux_iread].seconds))
-                    {
-                        mean_temperature += RingBuffer[aux_iread].temperature;
-                        if(RingBuffer[aux_iread].temperature < min_temperature) min_temperature = RingBuffer[aux_iread].temperature;
-                        if(RingBuffer[aux_iread].temperature > max_temperature) max_temperature = RingBuffer[aux_iread].temperature;
-                        mean_lum += RingBuffer[aux_iread].luminosity;
-                        if(RingBuffer[aux_iread].luminosity < min_lum) min_lum = RingBuffer[aux_iread].luminosity;
-                        if(RingBuffer[aux_iread].luminosity > max_lum) max_lum = RingBuffer[aux_iread].luminosity;
+                    *header |= 3;
+                    code[size++] = luminosity[i];
+                }
+            }
+        }
+        t = time[i];
+        T = temperature[i];
+        L = luminosity[i];
+    }
+    if(repeat > 0)
+        code[size++] = repeat - 1;
+    return size;
+}
 
-                        num_reads++;
-                    }
+//decode the n registers coded by hist_encode in "code"
+void hist_decode(const unsigned char* code, int n, cyg_int32* time, unsigned char* temperature, unsigned char* luminosity)
+{
+    static const signed char steps[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+    cyg_int32 t = 0, dt = 0, unit = *code++;
+    int T = 0, L = 0, dT = 0, dL = 0, repeat, i = 0;
+    unsigned char header;
+    while(i < n)
+    {
+        header = *code++;
+        repeat = 1;
+        if(header < 0x40)
+            repeat = header + 1;
+        else if(header < 0x80)
+        {
+            dt = unit*(header & 0x0F);
+            dT = steps[(header >> 4) & 3][0];
+            dL = steps[(header >> 4) & 3][1];
+        }
+        else
+        {
+            switch((header >> 5) & 3)
+            {
+                case 1: dt = code[0]; code += 1; break;
+                case 2: dt = code[0] | (code[1] << 8); code += 2; break;
+                case 3: dt = 60*60*code[0] + 60*code[1] + code[2] - t; code += 3; break;
+            }
+            if(((header >> 2) & 7) == 7)
+                dT = *code++ - T;
+            else
+                dT = ((header >> 2) & 7) - 3;
+            switch(header & 3)
+            {
+                case 0: dL = 0; break;
+                case 1: dL = 1; break;
+                case 2: dL = -1; break;
+                case 3: dL = *code++ - L; break;
+            }
+        }
+        for(; repeat > 0 && i < n; repeat--, i++)
+        {
+            t += dt;
+            T += dT;
+            L += dL;
+            time[i] = t;
+            temperature[i] = T;
+            luminosity[i] = L;
+        }
+    }
+}
 
+//decode block b of the history to the columns (called with hist_mux locked)
+//the last block decoded is kept, so that lr decodes each block once
+const hist_block_* hist_load(int b, cyg_int32** time, unsigned char** temperature, unsigned char** luminosity)
+{
+    static cyg_int32 cache_time[HIST_BLOCK];
+    static unsigned char cache_temperature[HIST_BLOCK], cache_luminosity[HIST_BLOCK];
+    const hist_block_* block = &hist_blocks[(hist_begin + b) % hist_capacity];
+    cyg_uint64 start;
+    if(block->code != hist_cached)
+    {
+        start = current_time_us();
+        hist_decode(block->code, block->count, cache_time, cache_temperature, cache_luminosity);
+        hist_decode_us += current_time_us() - start;
+        hist_decoded += block->count;
+        hist_cached = block->code;
+    }
+    *time = cache_time;
+    *temperature = cache_temperature;
+    *luminosity = cache_luminosity;
+    return block;
+}
 
-                    aux_iread++;
-                    if(aux_iread >= NRBUF)
-                        aux_iread = 0;
+//free the oldest block of the history (called with hist_mux locked)
+void hist_drop(void)
+{
+    hist_block_* block = &hist_blocks[hist_begin];
+    hist_memory -= block->size + sizeof(hist_block_);
+    hist_registers -= block->count;
+    if(block->code == hist_cached)
+        hist_cached = NULL;
+    free(block->code);
+    hist_begin = (hist_begin + 1) % hist_capacity;
+    hist_nblocks--;
+}
 
-                    if(aux_iread == iwrite)
-                        break;
+//compress the block being filled and add it to the history, freeing the oldest blocks beyond the memory of the history
+//returns FALSE if there is not enough memory (called with hist_mux locked)
+int hist_seal(void)
+{
+    static unsigned char code[HIST_CODE];
+    hist_block_* blocks;
+    hist_block_* block;
+    int i, size;
+    if(hist_staged == 0)
+        return TRUE;
+    if(hist_nblocks == hist_capacity)
+    {
+        if((blocks = (hist_block_*)malloc(2*(hist_capacity + 1)*sizeof(hist_block_))) == NULL)
+            return FALSE;
+        for(i = 0; i < hist_nblocks; i++)
+            blocks[i] = hist_blocks[(hist_begin + i) % hist_capacity];
+        free(hist_blocks);
+        hist_blocks = blocks;
+        hist_capacity = 2*(hist_capacity + 1);
+        hist_begin = 0;
+    }
+    block = &hist_blocks[(hist_begin + hist_nblocks) % hist_capacity];
+    size = hist_encode(hist_time, hist_temperature, hist_luminosity, hist_staged, code);
+    if((block->code = (unsigned char*)malloc(size)) == NULL)
+        return FALSE;
+    memcpy(block->code, code, size);
+    block->first = hist_next - hist_staged;
+    block->count = hist_staged;
+    block->size = size;
+    aggregate_init(&block->a);
+    block->min_time = hist_time[0];
+    block->max_time = hist_time[0];
+    for(i = 0; i < hist_staged; i++)
+    {
+        if(hist_time[i] < block->min_time) block->min_time = hist_time[i];
+        if(hist_time[i] > block->max_time) block->max_time = hist_time[i];
+    }
+    aggregate_scalar(hist_time, hist_temperature, hist_luminosity, hist_staged, block->min_time, block->max_time, &block->a);
+    hist_nblocks++;
+    hist_memory += size + sizeof(hist_block_);
+    hist_registers += hist_staged;
+    hist_staged = 0;
+    while(hist_nblocks > 0 && hist_memory > hist_budget)
+        hist_drop();
+    return TRUE;
+}
 
-                }
-                cyg_mutex_unlock(&ring_buffer_mux); //unlock buffer
+//free every block of the history (called with hist_mux locked)
+void hist_clear(void)
+{
+    while(hist_nblocks > 0)
+        hist_drop();
+    hist_staged = 0;
+}
 
-                if(num_reads > 0)
-                {
-                    //determine mean, min and max
-                    mean_temperature = (mean_temperature/num_reads);
-                    mean_lum = (mean_lum/num_reads);
-                    m_ = (unsigned char*)malloc(9*sizeof(unsigned char));
-                    m_[0] = SOM;
-                    m_[1] = PR;
-                    m_[2] = max_temperature;
-                    m_[3] = min_temperature;
-                    m_[4] = (int)mean_temperature;
-                    m_[5] = max_lum;
-                    m_[6] = min_lum;
-                    m_[7] = (int)mean_lum;
-                    m_[8] = EOM;
-                    cyg_mbox_put(mbx_UITaskH, m_);  //put message in UI mailbox
-                }
-                else
-                {
-                    m_ = (unsigned char*)malloc(4*sizeof(unsigned char));
-                    m_[0] = SOM;
-                    m_[1] = PR;
-                    m_[2] = CMD_ERROR;
-                    m_[3] = EOM;
-                    cyg_mbox_put(mbx_UITaskH, m_);
-                }
+//append to the history the registers written to the ring buffer since the last time
+void hist_append(void)
+{
+    ring_buffer_* rb = ring_acquire();
+    cyg_uint32 written = rb->written;
+    register_ r;
+    cyg_mutex_lock(&hist_mux);
+    if(hist_budget > 0 && written - hist_next > (cyg_uint32)rb->size && hist_seal()) //overwritten before they were appended
+    {
+        hist_lost += written - rb->size - hist_next;
+        hist_next = written - rb->size;
+    }
+    for(; hist_budget > 0 && hist_next != written; hist_next++)
+    {
+        if(!ring_get(rb, hist_next, &r))
+        {
+            if(!hist_seal()) //the registers of a block follow without gaps
                 break;
+            hist_lost++;
+            continue;
+        }
+        if(hist_staged == HIST_BLOCK && !hist_seal()) //the block is full (the register is appended when there is memory)
+            break;
+        hist_time[hist_staged] = 60*60*r.hours + 60*r.minutes + r.seconds;
+        hist_temperature[hist_staged] = r.temperature;
+        hist_luminosity[hist_staged] = r.luminosity;
+        hist_staged++;
+    }
+    cyg_mutex_unlock(&hist_mux);
+    ring_release();
+}
 
-            case PTRC: //start periodic tranference
-                cyg_mutex_lock(&print_mux);
-                printf("STARTING PERIODIC TRANSFERENCE...\n");
-                cyg_mutex_unlock(&print_mux);
-                m_ = (unsigned char*)malloc(3*sizeof(unsigned char));
-                m_[0] = SOM;
-                m_[1] = PTRC;
-                m_[2] = EOM;
-                cyg_mbox_put(mbx_sendingTaskH, m_);  //put message in communication task mailbox
-                break;
+//number of the oldest register of the history, if it is older than register "oldest" of the ring buffer ("oldest" if
+//not)
+cyg_uint32 hist_oldest(cyg_uint32 oldest)
+{
+    cyg_uint32 first;
+    cyg_mutex_lock(&hist_mux);
+    first = (hist_nblocks > 0) ? hist_blocks[hist_begin].first : hist_next - hist_staged;
+    cyg_mutex_unlock(&hist_mux);
+    return (hist_budget > 0 && (cyg_int32)(first - oldest) < 0) ? first : oldest;
+}
 
-            case TRCACK: //tranference acknowledgment
-                num_reads = 0;
-                cyg_mutex_lock(&ring_buffer_mux); //lock buffer
-                //list registers above threeshold
-                cyg_mutex_lock(&print_mux);
-                while(num_unread_registers > 0)
-                {
-                    if( RingBuffer[iread].temperature > threshold_temperature || RingBuffer[iread].luminosity > threshold_lum)
-                    {
-                        printf("\nREGISTER:\n");
-                        printf("HOURS: %d\n", RingBuffer[iread].hours);
-                        printf("MINUTES: %d\n", RingBuffer[iread].minutes);
-                        printf("SECONDS: %d\n", RingBuffer[iread].seconds);
-                        printf("TEMPERATURE: %d\n", RingBuffer[iread].temperature);
-                        printf("LUMINOSITY: %d\n", RingBuffer[iread].luminosity);
-                        num_reads++;
-                    }
+//copy register k (number in the ring buffer) of the history to r (returns FALSE if it is not in the history)
+int hist_get(cyg_uint32 k, register_* r)
+{
+    cyg_int32 time;
+    if(!hist_copy(k, 1, &time, &r->temperature, &r->luminosity))
+        return FALSE;
+    r->hours = time/3600;
+    r->minutes = time/60%60;
+    r->seconds = time%60;
+    return TRUE;
+}
+
+//copy to the columns up to "count" registers of the history from number k (number in the ring buffer), stopping at
+//the end of the block of register k; returns the number of registers copied (0 if register k is not in the history)
+int hist_copy(cyg_uint32 k, int count, cyg_int32* time, unsigned char* temperature, unsigned char* luminosity)
+{
+    const hist_block_* block = NULL;
+    cyg_int32* t = NULL;
+    unsigned char* T = NULL;
+    unsigned char* L = NULL;
+    cyg_uint32 i = 0;
+    int lo = 0, hi, b, n = 0;
+    cyg_mutex_lock(&hist_mux);
+    hi = hist_nblocks - 1;
+    if(k - (hist_next - hist_staged) < (cyg_uint32)hist_staged) //block being filled
+    {
+        i = k - (hist_next - hist_staged);
+        t = hist_time;
+        T = hist_temperature;
+        L = hist_luminosity;
+        n = hist_staged - i;
+    }
+    while(n == 0 && lo <= hi) //blocks are in the order of their registers
+    {
+        b = (lo + hi)/2;
+        block = &hist_blocks[(hist_begin + b) % hist_capacity];
+        if((cyg_int32)(k - block->first) < 0)
+            hi = b - 1;
+        else if(k - block->first >= (cyg_uint32)block->count)
+            lo = b + 1;
+        else
+        {
+            i = k - block->first;
+            hist_load(b, &t, &T, &L);
+            n = block->count - i;
+        }
+    }
+    if(n > count)
+        n = count;
+    if(n > 0)
+    {
+        memcpy(time, t + i, n*sizeof(cyg_int32));
+        memcpy(temperature, T + i, n);
+        memcpy(luminosity, L + i, n);
+    }
+    cyg_mutex_unlock(&hist_mux);
+    return n;
+}
+
+//aggregate the registers of the history older than register "oldest" of the ring buffer with the time within one of
+//the ranges [lo, hi]; only the blocks across the bounds of a range are decoded
+//returns the number of the oldest register of the history aggregated ("oldest" if none)
+cyg_uint32 hist_aggregate(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 oldest, aggregate_* a)
+{
+    const hist_block_* block;
+    cyg_int32* time;
+    unsigned char* temperature;
+    unsigned char* luminosity;
+    cyg_uint32 first = oldest;
+    int b, j, n, loaded;
+    cyg_mutex_lock(&hist_mux);
+    for(b = 0; hist_budget > 0 && b < hist_nblocks; b++)
+    {
+        block = &hist_blocks[(hist_begin + b) % hist_capacity];
+        if((cyg_int32)(block->first - oldest) >= 0)
+            break;
+        if(b == 0)
+            first = block->first;
+        n = (oldest - block->first < (cyg_uint32)block->count) ? (int)(oldest - block->first) : block->count;
+        loaded = FALSE;
+        for(j = 0; j < nranges; j++)
+        {
+            if(block->max_time < lo[j] || block->min_time > hi[j])
+                continue;
+            if(n == block->count && block->min_time >= lo[j] && block->max_time <= hi[j])
+            {
+                aggregate_merge(a, &block->a);
+                continue;
+            }
+            if(!loaded)
+            {
+                hist_load(b, &time, &temperature, &luminosity);
+                loaded = TRUE;
+            }
+            aggregate_span(time, temperature, luminosity, n, lo[j], hi[j], a);
+        }
+    }
+    //registers of the block being filled, if the ring buffer is smaller than a block
+    n = (cyg_int32)(oldest - (hist_next - hist_staged)) > 0 ? (int)(oldest - (hist_next - hist_staged)) : 0;
+    if(hist_budget > 0 && n > 0)
+    {
+        if(n > hist_staged)
+            n = hist_staged;
+        if(hist_nblocks == 0)
+            first = hist_next - hist_staged;
+        for(j = 0; j < nranges; j++)
+            aggregate_span(hist_time, hist_temperature, hist_luminosity, n, lo[j], hi[j], a);
+    }
+    cyg_mutex_unlock(&hist_mux);
+    return first;
+}
+
+//count in the histograms "bins" the registers of the history older than register "oldest" of the ring buffer with the
+//time within one of the ranges [lo, hi]; every block within a range is decoded
+//returns the number of the oldest register of the history counted ("oldest" if none)
+cyg_uint32 hist_histogram(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 oldest, cyg_uint32* bins)
+{
+    const hist_block_* block;
+    cyg_int32* time;
+    unsigned char* temperature;
+    unsigned char* luminosity;
+    cyg_uint32 first = oldest;
+    int b, j, n, loaded;
+    cyg_mutex_lock(&hist_mux);
+    for(b = 0; hist_budget > 0 && b < hist_nblocks; b++)
+    {
+        block = &hist_blocks[(hist_begin + b) % hist_capacity];
+        if((cyg_int32)(block->first - oldest) >= 0)
+            break;
+        if(b == 0)
+            first = block->first;
+        n = (oldest - block->first < (cyg_uint32)block->count) ? (int)(oldest - block->first) : block->count;
+        loaded = FALSE;
+        for(j = 0; j < nranges; j++)
+        {
+            if(block->max_time < lo[j] || block->min_time > hi[j])
+                continue;
+            if(!loaded)
+            {
+                hist_load(b, &time, &temperature, &luminosity);
+                loaded = TRUE;
+            }
+            histogram_span(time, temperature, luminosity, n, lo[j], hi[j], bins);
+        }
+    }
+    //registers of the block being filled, if the ring buffer is smaller than a block
+    n = (cyg_int32)(oldest - (hist_next - hist_staged)) > 0 ? (int)(oldest - (hist_next - hist_staged)) : 0;
+    if(hist_budget > 0 && n > 0)
+    {
+        if(n > hist_staged)
+            n = hist_staged;
+        if(hist_nblocks == 0)
+            first = hist_next - hist_staged;
+        for(j = 0; j < nranges; j++)
+            histogram_span(hist_time, hist_temperature, hist_luminosity, n, lo[j], hi[j], bins);
+    }
+    cyg_mutex_unlock(&hist_mux);
+    return first;
+}
+
+//print the registers, memory, compression and decoding throughput of the history (called with print_mux locked)
+void hist_print(void)
+{
+    cyg_uint64 ratio = hist_memory ? (cyg_uint64)hist_registers*sizeof(register_)*100/hist_memory : 0; //percent
+    console_printf("HISTORY: registers - %lu, blocks - %d, memory - %lu of %lu bytes, compression - %lu.%02lux, lost - %lu, "
+        "decoded - %lu registers/ms\n", hist_registers + hist_staged, hist_nblocks, hist_memory, hist_budget,
+        (unsigned long)(ratio/100), (unsigned long)(ratio%100), hist_lost,
+        hist_decode_us ? (unsigned long)(hist_decoded*1000ULL/hist_decode_us) : 0);
+}
+
+//executes command hist (information about the compressed history/keep k KB of registers in it, 0 - off)
+void cmd_hist(int argc, char **argv)
+{
+    ring_buffer_* rb;
+    if (argc == 2 && atoi(argv[1]) >= 0) {
+        cyg_mutex_lock(&hist_mux);
+        if(hist_budget == 0) //the registers of the ring buffer are appended first
+        {
+            rb = ring_acquire();
+            hist_next = ring_oldest(rb, rb->written);
+            ring_release();
+        }
+        hist_budget = 1024UL*atoi(argv[1]);
+        if(hist_budget == 0)
+            hist_clear();
+        while(hist_nblocks > 0 && hist_memory > hist_budget)
+            hist_drop();
+        cyg_mutex_unlock(&hist_mux);
+        if(hist_budget > 0)
+            cyg_semaphore_post(&log_pending);
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("MODIFY SIZE OF HISTORY: OK\n");
+        cyg_mutex_unlock(&print_mux);
+    }
+    else if (argc == 1) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        hist_print();
+        cyg_mutex_unlock(&print_mux);
+    }
+    else {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+    }
+}
+
+/*-------------------------------------------------------------------------+
+| Rollups of registers (summaries per minute, hour and day)
++--------------------------------------------------------------------------*/
+//every register the live decoder of station 0 gets from iread of the device (TRGC, TRCACK and BCHK) is added to the
+//summary of its minute, hour and day, kept for ROLLUP_MINUTES minutes, ROLLUP_HOURS hours and ROLLUP_DAYS days after
+//the last register; those registers come in the order the device took them, so the registers of a summary are
+//consecutive in the ring buffer, and the day counter goes to the next day every time the time goes back (midnight, or
+//the clock of the device set back); the registers have no date, so a day without any register is not counted
+//a register written to the ring buffer without going to the rollups (TRGI, replay) or deleted by dr makes the
+//summaries started before it unusable, so pr never mixes the summaries with registers that are not in them
+//pr counts the registers kept (ring buffer, history and log) and only takes from the summaries the whole minutes of
+//those from rollup_start on, which are all in the ring buffer: the day if all its registers are within the interval,
+//the hours of the day if not, and the minutes of the hours across the bounds of the interval; the registers before
+//are read from the ring buffer, the history and the log
+//each summary also has the histograms of temperature and luminosity of its registers, allocated on the first prd,
+//which prd merges in the same way
+
+//allocate the histograms of the summaries, on the first prd so that the memory is only taken if prd is used
+//returns FALSE if there is not enough memory (prd counts every register then)
+//only the summaries started after the allocation have all their registers counted in the histograms, so prd takes
+//them from rollup_binned on, the number of the next register written to the ring buffer then
+int rollup_histograms(void)
+{
+    int ok;
+    mutex_lock_counted(&ring_buffer_mux, &ring_buffer_mux_stats); //no register is added to the rollups meanwhile
+    cyg_mutex_lock(&rollup_mux);
+    if(rollup_day_bins == NULL)
+    {
+        rollup_minute_bins = calloc(ROLLUP_MINUTES, sizeof(*rollup_minute_bins));
+        rollup_hour_bins = calloc(ROLLUP_HOURS, sizeof(*rollup_hour_bins));
+        rollup_day_bins = calloc(ROLLUP_DAYS, sizeof(*rollup_day_bins));
+        if(rollup_minute_bins == NULL || rollup_hour_bins == NULL || rollup_day_bins == NULL)
+        {
+            free(rollup_minute_bins);
+            free(rollup_hour_bins);
+            free(rollup_day_bins);
+            rollup_minute_bins = NULL;
+            rollup_hour_bins = NULL;
+            rollup_day_bins = NULL;
+        }
+        rollup_binned = ring->written;
+    }
+    ok = rollup_day_bins != NULL;
+    cyg_mutex_unlock(&rollup_mux);
+    cyg_mutex_unlock(&ring_buffer_mux);
+    return ok;
+}
+
+//add register k of the ring buffer to the summary of "key" in entry e of one of the tiers
+//returns FALSE if the register is older than the summary of the entry (not added)
+int rollup_update(rollup_* e, cyg_uint32 key, cyg_int32 time, unsigned char* reg, cyg_uint32 k)
+{
+    if(e->a.count > 0 && e->key != key)
+    {
+        if((cyg_int32)(key - e->key) < 0) //the entry went to a later summary
+            return FALSE;
+        e->a.count = 0;
+    }
+    if(e->a.count == 0)
+    {
+        e->key = key;
+        e->first = k;
+        aggregate_init(&e->a);
+        e->min_time = time;
+        e->max_time = time;
+    }
+    aggregate_scalar(&time, reg + 3, reg + 4, 1, time, time, &e->a);
+    if(time < e->min_time) e->min_time = time;
+    if(time > e->max_time) e->max_time = time;
+    return TRUE;
+}
+
+//add a register to the histograms of a summary, cleared if it is the first one of the summary
+void rollup_count(cyg_uint32* bins, const rollup_* e, unsigned char* reg)
+{
+    if(e->a.count == 1)
+        memset(bins, 0, 2*NBINS*sizeof(cyg_uint32));
+    bins[reg[3]]++;
+    bins[NBINS + reg[4]]++;
+}
+
+//add the registers received, numbered from k in the ring buffer, to the summaries
+void rollup_add(unsigned char* registers, int num_registers, cyg_uint32 k)
+{
+    cyg_int32 time;
+    cyg_uint32 minute, m, h, d;
+    unsigned char* reg;
+    int i;
+    cyg_mutex_lock(&rollup_mux);
+    for(i = 0; i < num_registers; i++, k++)
+    {
+        reg = registers + i*5;
+        time = 60*60*reg[0] + 60*reg[1] + reg[2];
+        if(time < rollup_last) //next day
+            rollup_day++;
+        rollup_last = time;
+        minute = (time < 24*60*60) ? time/60 : 24*60 - 1; //a faulty time goes to the last minute of the day
+        rollup_minute = rollup_day*24*60 + minute;
+        m = (rollup_day*24*60 + minute) % ROLLUP_MINUTES;
+        h = (rollup_day*24 + minute/60) % ROLLUP_HOURS;
+        d = rollup_day % ROLLUP_DAYS;
+        if(rollup_update(&rollup_minutes[m], rollup_day*24*60 + minute, time, reg, k) && rollup_minute_bins != NULL)
+            rollup_count(rollup_minute_bins[m], &rollup_minutes[m], reg);
+        if(rollup_update(&rollup_hours[h], rollup_day*24 + minute/60, time, reg, k) && rollup_hour_bins != NULL)
+            rollup_count(rollup_hour_bins[h], &rollup_hours[h], reg);
+        if(rollup_update(&rollup_days[d], rollup_day, time, reg, k) && rollup_day_bins != NULL)
+            rollup_count(rollup_day_bins[d], &rollup_days[d], reg);
+    }
+    cyg_mutex_unlock(&rollup_mux);
+}
+
+//register k - 1 of the ring buffer was written without going to the rollups
+void rollup_skip(cyg_uint32 k)
+{
+    cyg_mutex_lock(&rollup_mux);
+    rollup_since = k;
+    cyg_mutex_unlock(&rollup_mux);
+}
+
+//drop all the summaries, the registers before number k of the ring buffer were deleted
+void rollup_reset(cyg_uint32 k)
+{
+    int i;
+    cyg_mutex_lock(&rollup_mux);
+    for(i = 0; i < ROLLUP_MINUTES; i++)
+        rollup_minutes[i].a.count = 0;
+    for(i = 0; i < ROLLUP_HOURS; i++)
+        rollup_hours[i].a.count = 0;
+    for(i = 0; i < ROLLUP_DAYS; i++)
+        rollup_days[i].a.count = 0;
+    rollup_since = k;
+    cyg_mutex_unlock(&rollup_mux);
+}
+
+//number of the first register of the ring buffer that pr can take from the summaries ("written" if none), with the
+//ring buffer from "oldest" to "written": the first register of the oldest minute kept that is all in the ring buffer
+//and after the last register that did not go to the rollups; the summaries of the minutes after it are all kept
+//with "bins" (prd) the minute must also be counted in the histograms (from rollup_binned on)
+cyg_uint32 rollup_start(cyg_uint32 oldest, cyg_uint32 written, int bins)
+{
+    cyg_uint32 from = written;
+    cyg_uint32 since;
+    int m;
+    cyg_mutex_lock(&rollup_mux);
+    since = ((cyg_int32)(rollup_since - oldest) > 0) ? rollup_since : oldest;
+    if(bins && (cyg_int32)(rollup_binned - since) > 0)
+        since = rollup_binned;
+    for(m = 0; m < ROLLUP_MINUTES; m++)
+    {
+        if(rollup_minutes[m].a.count > 0 && rollup_minutes[m].key + ROLLUP_MINUTES > rollup_minute &&
+            (cyg_int32)(rollup_minutes[m].first - since) >= 0 && (cyg_int32)(rollup_minutes[m].first - from) < 0)
+            from = rollup_minutes[m].first;
+    }
+    cyg_mutex_unlock(&rollup_mux);
+    return from;
+}
+
+//split the ranges [lo, hi] in the whole minutes, left in lo and hi, and the seconds at their ends, put in edge_lo and
+//edge_hi (at most 2 per range); returns the number of ranges of whole minutes
+int rollup_ranges(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_int32* edge_lo, cyg_int32* edge_hi, int* nedges)
+{
+    cyg_int32 first, last;
+    int i, n = 0;
+    *nedges = 0;
+    for(i = 0; i < nranges; i++)
+    {
+        first = (lo[i] + 59)/60*60;
+        last = (hi[i] == 0x7FFFFFFF) ? hi[i] : (hi[i] + 1)/60*60 - 1;
+        if(first > last) //no whole minute
+        {
+            edge_lo[*nedges] = lo[i];
+            edge_hi[(*nedges)++] = hi[i];
+            continue;
+        }
+        if(lo[i] < first)
+        {
+            edge_lo[*nedges] = lo[i];
+            edge_hi[(*nedges)++] = first - 1;
+        }
+        if(last < hi[i])
+        {
+            edge_lo[*nedges] = last + 1;
+            edge_hi[(*nedges)++] = hi[i];
+        }
+        lo[n] = first;
+        hi[n++] = last;
+    }
+    return n;
+}
+
+//merge the summary to "a" if all its registers are within [lo, hi] and numbered from "from" on in the ring buffer
+//returns FALSE if only some of them are, ROLLUP_MERGED if the summary is merged and TRUE if it is skipped
+int rollup_merge(const rollup_* e, cyg_uint32 key, cyg_int32 lo, cyg_int32 hi, cyg_uint32 from, aggregate_* a)
+{
+    rollup_reads++;
+    if(e->a.count == 0 || e->key != key || e->max_time < lo || e->min_time > hi)
+        return TRUE;
+    if(e->min_time < lo || e->max_time > hi || (cyg_int32)(e->first - from) < 0)
+        return FALSE;
+    aggregate_merge(a, &e->a);
+    return ROLLUP_MERGED;
+}
 
-                    iread++;
-                    num_unread_registers--;
-                    if(iread >= NRBUF)
-                    iread = 0;
+//add the histograms of a summary to "bins"
+void rollup_merge_bins(cyg_uint32* bins, const cyg_uint32* b)
+{
+    int v;
+    for(v = 0; v < 2*NBINS; v++)
+        bins[v] += b[v];
+}
 
+//aggregate the registers of the summaries numbered from "from" on in the ring buffer (got from rollup_start) with the
+//time within one of the ranges [lo, hi] of whole minutes, and add their histograms to "bins" if it is not NULL (the
+//summaries must have histograms then)
+void rollup_aggregate(cyg_int32* lo, cyg_int32* hi, int nranges, cyg_uint32 from, aggregate_* a, cyg_uint32* bins)
+{
+    cyg_uint32 d, h, m, last;
+    int j, merged;
+    cyg_mutex_lock(&rollup_mux);
+    rollup_reads = 0;
+    for(d = (rollup_day >= ROLLUP_DAYS) ? rollup_day - ROLLUP_DAYS + 1 : 0; d <= rollup_day; d++)
+    {
+        for(j = 0; j < nranges; j++)
+        {
+            merged = rollup_merge(&rollup_days[d % ROLLUP_DAYS], d, lo[j], hi[j], from, a);
+            if(merged == ROLLUP_MERGED && bins != NULL)
+                rollup_merge_bins(bins, rollup_day_bins[d % ROLLUP_DAYS]);
+            if(merged)
+                continue;
+            last = (hi[j] < 24*60*60) ? hi[j]/60 : 24*60 - 1;
+            for(h = lo[j]/(60*60); h <= last/60; h++)
+            {
+                merged = rollup_merge(&rollup_hours[(d*24 + h) % ROLLUP_HOURS], d*24 + h, lo[j], hi[j], from, a);
+                if(merged == ROLLUP_MERGED && bins != NULL)
+                    rollup_merge_bins(bins, rollup_hour_bins[(d*24 + h) % ROLLUP_HOURS]);
+                if(merged)
+                    continue;
+                for(m = (lo[j]/60 > 60*h) ? lo[j]/60 : 60*h; m <= last && m < 60*(h + 1); m++)
+                {
+                    merged = rollup_merge(&rollup_minutes[(d*24*60 + m) % ROLLUP_MINUTES], d*24*60 + m, lo[j], hi[j], from,
+                        a);
+                    if(merged == ROLLUP_MERGED && bins != NULL)
+                        rollup_merge_bins(bins, rollup_minute_bins[(d*24*60 + m) % ROLLUP_MINUTES]);
                 }
-                cyg_mutex_unlock(&ring_buffer_mux); //unlock buffer
-                printf("PERIODIC TRANFER COMPLETE. %d REGISTERS ABOVE THRESHOLD\n", num_reads);
-                cyg_mutex_unlock(&print_mux);
+            }
+        }
+    }
+    cyg_mutex_unlock(&rollup_mux);
+}
 
-                break;
+/*-------------------------------------------------------------------------+
+| Export of registers (command exp)
++--------------------------------------------------------------------------*/
+//the registers kept (log, history and local memory, the oldest first) with the time within one of the ranges are
+//written to a file, as CSV (a header line, then "hours,minutes,seconds,temperature,luminosity" for each register) or
+//binary (5 bytes for each register, in the order of the CSV fields, as the device sends them)
+//the registers are copied EXPORT_CHUNK at a time, with the lock of the log or the history held only while a chunk is
+//copied (the ring buffer is read without locking the writer), and formatted in a buffer written with one fwrite when
+//it is full
+
+//write the buffer of an export to its file
+void export_flush(export_* e)
+{
+    if(e->used > 0 && !e->error)
+    {
+        if(fwrite(e->buffer, 1, e->used, e->file) != (size_t)e->used)
+            e->error = TRUE;
+        else
+            e->bytes += e->used;
+    }
+    e->used = 0;
+}
 
-            case NMFL: //notification of memory full
-                cyg_mutex_lock(&print_mux);
-                printf("NOTIFICATION OF MEMORY HALF FULL. PERIODIC TRANFER SET TO 1 MINUTE\n");
-                cyg_mutex_unlock(&print_mux);
-                //update alarm
-                period_of_transference = 1;
-                updateTransferAlarm(alarmH, period_of_transference);
-                break;
+//format a number from 0 to 999 in decimal
+char* export_number(char* p, int v)
+{
+    if(v >= 100)
+        *p++ = '0' + v/100;
+    if(v >= 10)
+        *p++ = '0' + v/10%10;
+    *p++ = '0' + v%10;
+    return p;
+}
+
+//add to the buffer of an export the registers of a span with the time within one of the ranges [lo, hi]
+void export_span(export_* e, const cyg_int32* time, const unsigned char* temperature, const unsigned char* luminosity,
+    int n, cyg_int32* lo, cyg_int32* hi, int nranges)
+{
+    char* p;
+    int i, j;
+    for(i = 0; i < n; i++)
+    {
+        for(j = 0; j < nranges && (time[i] < lo[j] || time[i] > hi[j]); j++)
+            ;
+        if(j == nranges)
+            continue;
+        if(e->used > EXPORT_BUFFER - EXPORT_RECORD)
+            export_flush(e);
+        p = e->buffer + e->used;
+        if(e->binary)
+        {
+            *p++ = time[i]/3600;
+            *p++ = time[i]/60%60;
+            *p++ = time[i]%60;
+            *p++ = temperature[i];
+            *p++ = luminosity[i];
+        }
+        else
+        {
+            p = export_number(p, time[i]/3600);
+            *p++ = ',';
+            p = export_number(p, time[i]/60%60);
+            *p++ = ',';
+            p = export_number(p, time[i]%60);
+            *p++ = ',';
+            p = export_number(p, temperature[i]);
+            *p++ = ',';
+            p = export_number(p, luminosity[i]);
+            *p++ = '\n';
+        }
+        e->used = p - e->buffer;
+        e->registers++;
+    }
+}
 
+//execute the command exp (export the registers between t1 and t2 to file f, as CSV or binary)
+void cmd_exp(int argc, char **argv)
+{
+    static export_ e;
+    static cyg_int32 time[EXPORT_CHUNK];
+    static unsigned char temperature[EXPORT_CHUNK], luminosity[EXPORT_CHUNK];
+    ring_buffer_* rb;
+    cyg_int32 lo[2], hi[2];
+    unsigned char t[6];
+    cyg_uint32 k, next, written, oldest, o, h;
+    cyg_uint64 start;
+    unsigned long lost = 0;
+    int nranges, n;
+
+    if ((argc != 3 && argc != 6 && argc != 9) || (strcmp(argv[2], "csv") != 0 && strcmp(argv[2], "bin") != 0)) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("Wrong arguments");
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    for (n = 3; n < argc; n++)
+        t[n - 3] = atoi(argv[n]);
+    nranges = time_arguments(t, argc - 3, lo, hi);
+    e.binary = strcmp(argv[2], "bin") == 0;
+    if ((e.file = fopen(argv[1], e.binary ? "wb" : "w")) == NULL) {
+        mutex_lock_counted(&print_mux, &print_mux_stats);
+        console_printf("EXPORT: CAN NOT OPEN %s\n", argv[1]);
+        cyg_mutex_unlock(&print_mux);
+        return;
+    }
+    e.used = 0;
+    e.error = FALSE;
+    e.registers = 0;
+    e.bytes = 0;
+    if(!e.binary)
+    {
+        strcpy(e.buffer, "hours,minutes,seconds,temperature,luminosity\n");
+        e.used = strlen(e.buffer);
+    }
 
+    start = current_time_us();
+    rb = ring_acquire();
+    //the registers are numbered as in lr: the ones from o up to the oldest of the ring buffer are in the history, and
+    //register k before o is register h - (o - k) of the log
+    written = rb->written;
+    oldest = ring_oldest(rb, written);
+    o = hist_oldest(oldest);
+    cyg_mutex_lock(&log_mux);
+    h = log_end(o);
+    cyg_mutex_unlock(&log_mux);
+    for(k = o - h; k != written && !e.error; k = next)
+    {
+        next = k;
+        if((cyg_int32)(k - o) < 0)
+            n = log_copy(h - (o - k), (o - k < EXPORT_CHUNK) ? (int)(o - k) : EXPORT_CHUNK, time, temperature, luminosity);
+        else if((cyg_int32)(k - oldest) < 0)
+            n = hist_copy(k, (oldest - k < EXPORT_CHUNK) ? (int)(oldest - k) : EXPORT_CHUNK, time, temperature, luminosity);
+        else
+        {
+            n = ring_copy(rb, &next, (written - k < EXPORT_CHUNK) ? (int)(written - k) : EXPORT_CHUNK, time, temperature,
+                luminosity);
+            if((cyg_int32)(next - written) > 0) //every register left was overwritten, by registers written after the export started
+            {
+                next = written;
+                n = 0;
+            }
+        }
+        export_span(&e, time, temperature, luminosity, n, lo, hi, nranges);
+        lost += next - k;
+        next += n;
+        if(next == k) //register that can not be read
+        {
+            lost++;
+            next++;
         }
-        free(m);
     }
+    ring_release();
+    export_flush(&e);
+    if(fclose(e.file) != 0)
+        e.error = TRUE;
+
+    mutex_lock_counted(&print_mux, &print_mux_stats);
+    if(e.error)
+        console_printf("EXPORT: CAN NOT WRITE %s\n", argv[1]);
+    else
+        console_printf("EXPORT: %lu REGISTERS, %lu BYTES, %lu LOST, %lu MS\n", e.registers, e.bytes, lost,
+            (unsigned long)((current_time_us() - start)/1000));
+    cyg_mutex_unlock(&print_mux);
 }